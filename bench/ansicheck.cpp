@@ -0,0 +1,74 @@
+// ansicheck.cpp : the -c filter (cus/ansifilter.h) on known cases.
+//
+// Each case is fed whole, a byte at a time and split at every offset,
+// since the parser's state has to carry across abuffers, and the clean
+// text must come out the same each way. The exit status is non-zero if
+// any case fails.
+
+#include "ansifilter.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const struct {
+	const char *name, *in, *want;
+} cases[] = {
+	{ "plain", "hello\nworld\n", "hello\nworld\n" },
+	{ "crlf", "one\r\ntwo\r\n", "one\r\ntwo\r\n" },
+	{ "colour", "\x1b[1;31merror\x1b[0m: x\n", "error: x\n" },
+	{ "title", "\x1b]0;title\x07text\n\x1b]2;t\x1b\\more\n", "text\nmore\n" },
+	{ "charset", "\x1b(Bab\x1b" "7c\n", "abc\n" },
+	{ "cr redraw", "10%\r20%\r100%\n", "100%\n" },
+	{ "cr shorter", "Downloading\rDone\n", "Doneloading\n" },
+	{ "bs", "abc\b\bXY\n", "aXY\n" },
+	{ "K", "Downloading 100%\r\x1b[KDone\n", "Done\n" },
+	{ "0K", "Downloading 100%\r\x1b[0KDone\n", "Done\n" },
+	{ "K after bs", "abcdef\b\b\b\x1b[K!\n", "abc!\n" },
+	{ "2K", "Downloading 100%\r\x1b[2KDone\n", "Done\n" },
+	{ "2K mid", "abcdef\b\b\x1b[2Kxy\n", "    xy\n" },
+	{ "1K", "abcdef\b\b\b\x1b[1KXY\n", "   XYf\n" },
+	{ "1K at end", "abc\x1b[1Kd\n", "   d\n" },
+	{ "1K start", "abc\r\x1b[1K\n", " bc\n" },
+	{ "2K params", "abc\x1b[2;5K\n", "   \n" },
+	{ "10K", "abc\r\x1b[10Kx\n", "xbc\n" },
+	{ "flush", "partial\rPART", "PARTial" },
+};
+
+static std::string
+run(const char *in, size_t len, size_t step, size_t split) {
+	ansifilter f;
+	std::string out;
+	size_t i = 0;
+
+	while (i < len) {
+		size_t n = split != 0 ? (i == 0 ? split : len - i) : step;
+
+		if (n > len - i)
+			n = len - i;
+		f.filter((const __int8 *)in + i, (DWORD)n, out);
+		i += n;
+	}
+	f.flush(out);
+	return out;
+}
+
+int
+main(void) {
+	unsigned bad = 0;
+
+	for (const auto &c : cases) {
+		size_t len = strlen(c.in);
+		std::string got = run(c.in, len, len, 0);
+		bool ok = got == c.want && run(c.in, len, 1, 0) == got;
+
+		for (size_t s = 1; s < len && ok; s++)
+			ok = run(c.in, len, 0, s) == got;
+		printf("%-12s %s\n", c.name, ok ? "ok" : "FAIL");
+		if (!ok) {
+			printf("  got  \"%s\"\n  want \"%s\"\n", got.c_str(), c.want);
+			bad++;
+		}
+	}
+	printf("%u of %zu cases failed\n", bad, sizeof(cases) / sizeof(cases[0]));
+	return bad != 0;
+}
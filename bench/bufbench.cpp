@@ -0,0 +1,333 @@
+// bufbench.cpp : microbenchmarks for the buffer/queue primitives.
+//
+// Every data path in cus is an abuffer pushed onto a bufferqueue and
+// drained by start_async_out()/handle_async_out(). This measures that
+// design against a few candidate replacements, using the same write
+// patterns the event loop sees:
+//
+//	sync	every WriteFile completes synchronously and in full
+//	partial	writes complete synchronously but short (abuffer::advance)
+//	pending	every write pends and completes before the next read
+//	backlog	the writer stalls while a long queue builds, then drains
+//
+// For each queue we report ns per chunk, heap allocations per chunk
+// and how often a bounded queue made the producer wait.
+
+#include "abuffer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+static unsigned long long nallocs;
+
+// Out of line, so the compiler can't pair an inlined new with free().
+__attribute__((noinline)) void *
+operator new(size_t n) {
+	nallocs++;
+	if (void *p = malloc(n ? n : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void
+operator delete(void *p) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void
+operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+// The current design: one heap abuffer per chunk on a std::queue.
+struct q_current {
+	bufferqueue q;
+
+	const char *name() { return "abuffer+std::queue"; }
+	bool push(const __int8 *p, DWORD n) {
+		auto abuf = new abuffer();
+		memcpy(abuf->getptr(), p, n);
+		abuf->size(n);
+		q.push(abuf);
+		return true;
+	}
+	bool empty() { return q.empty(); }
+	DWORD peek(const __int8 **p) {
+		*p = q.front()->getptr();
+		return q.front()->size();
+	}
+	void advance(DWORD n) {
+		auto abuf = q.front();
+		abuf->advance(n);
+		if (abuf->empty()) {
+			q.pop();
+			delete abuf;
+		}
+	}
+};
+
+// Intrusive singly linked list; nodes are recycled through a free list
+// so steady state does no allocation.
+struct q_intrusive {
+	struct node {
+		node *next;
+		DWORD len;
+		DWORD off;
+		__int8 buf[ABUFFER_SIZE];
+	};
+	node *head = NULL, *tail = NULL, *freelist = NULL;
+
+	~q_intrusive() {
+		while (head != NULL) {
+			node *n = head;
+			head = n->next;
+			delete n;
+		}
+		while (freelist != NULL) {
+			node *n = freelist;
+			freelist = n->next;
+			delete n;
+		}
+	}
+	const char *name() { return "intrusive list"; }
+	bool push(const __int8 *p, DWORD n) {
+		node *nd = freelist;
+		if (nd != NULL)
+			freelist = nd->next;
+		else
+			nd = new node;
+		memcpy(nd->buf, p, n);
+		nd->len = n;
+		nd->off = 0;
+		nd->next = NULL;
+		if (tail != NULL)
+			tail->next = nd;
+		else
+			head = nd;
+		tail = nd;
+		return true;
+	}
+	bool empty() { return head == NULL; }
+	DWORD peek(const __int8 **p) {
+		*p = head->buf + head->off;
+		return head->len - head->off;
+	}
+	void advance(DWORD n) {
+		head->off += n;
+		if (head->off == head->len) {
+			node *nd = head;
+			head = nd->next;
+			if (head == NULL)
+				tail = NULL;
+			nd->next = freelist;
+			freelist = nd;
+		}
+	}
+};
+
+// A fixed array of buffers used as a ring. Bounded: push fails when
+// every slot is in use.
+struct q_bufring {
+	static const DWORD NSLOTS = 1024;
+	struct slot {
+		DWORD len;
+		DWORD off;
+		__int8 buf[ABUFFER_SIZE];
+	};
+	std::vector<slot> slots;
+	DWORD head = 0, tail = 0;
+
+	q_bufring() : slots(NSLOTS) {}
+	const char *name() { return "fixed buffer ring"; }
+	bool push(const __int8 *p, DWORD n) {
+		if (tail - head == NSLOTS)
+			return false;
+		slot &s = slots[tail % NSLOTS];
+		memcpy(s.buf, p, n);
+		s.len = n;
+		s.off = 0;
+		tail++;
+		return true;
+	}
+	bool empty() { return head == tail; }
+	DWORD peek(const __int8 **p) {
+		slot &s = slots[head % NSLOTS];
+		*p = s.buf + s.off;
+		return s.len - s.off;
+	}
+	void advance(DWORD n) {
+		slot &s = slots[head % NSLOTS];
+		s.off += n;
+		if (s.off == s.len)
+			head++;
+	}
+};
+
+// One contiguous power-of-two byte ring with free-running head/tail.
+// peek() returns the bytes up to the wrap point, so a single write can
+// cover many chunks.
+struct q_bytering {
+	static const DWORD SIZE = 1 << 20;
+	std::vector<__int8> ring;
+	unsigned long long head = 0, tail = 0;
+
+	q_bytering() : ring(SIZE) {}
+	const char *name() { return "contiguous byte ring"; }
+	bool push(const __int8 *p, DWORD n) {
+		if (SIZE - (tail - head) < n)
+			return false;
+		DWORD off = (DWORD)(tail & (SIZE - 1));
+		DWORD first = n < SIZE - off ? n : SIZE - off;
+		memcpy(&ring[off], p, first);
+		memcpy(&ring[0], p + first, n - first);
+		tail += n;
+		return true;
+	}
+	bool empty() { return head == tail; }
+	DWORD peek(const __int8 **p) {
+		DWORD off = (DWORD)(head & (SIZE - 1));
+		unsigned long long avail = tail - head;
+		*p = &ring[off];
+		return (DWORD)(avail < SIZE - off ? avail : SIZE - off);
+	}
+	void advance(DWORD n) { head += n; }
+};
+
+enum pattern {
+	PAT_SYNC,
+	PAT_PARTIAL,
+	PAT_PENDING,
+	PAT_BACKLOG
+};
+
+static const char *patnames[] = { "sync", "partial", "pending", "backlog" };
+
+// A simulated output handle with the semantics start_async_out relies on.
+struct writer {
+	pattern pat;
+	bool busy = false;		// an overlapped write is outstanding
+	DWORD busylen = 0;
+	unsigned long long written = 0;
+	unsigned long long writes = 0;
+	volatile unsigned sink = 0;
+
+	// Issue as many writes as the pattern allows (start_async_out).
+	template <class Q> void kick(Q &q) {
+		while (!busy && !q.empty()) {
+			const __int8 *p;
+			DWORD len = q.peek(&p);
+
+			writes++;
+			sink += (unsigned char)p[0];
+			if (pat == PAT_SYNC) {
+				q.advance(len);
+				written += len;
+			} else if (pat == PAT_PARTIAL) {
+				DWORD n = len > 17 ? 17 : len;
+				q.advance(n);
+				written += n;
+			} else {
+				busy = true;
+				busylen = len;
+			}
+		}
+	}
+
+	// Deliver the outstanding completion (handle_async_out).
+	template <class Q> void complete(Q &q) {
+		if (!busy)
+			return;
+		busy = false;
+		q.advance(busylen);
+		written += busylen;
+		kick(q);
+	}
+};
+
+struct result {
+	double nsper;
+	double allocsper;
+	double writesper;
+	unsigned long long stalls;
+};
+
+template <class Q>
+static result
+run(pattern pat, DWORD nchunks) {
+	__int8 chunk[ABUFFER_SIZE];
+	unsigned long long stalls = 0;
+	writer w;
+	Q q;
+
+	for (DWORD i = 0; i < sizeof(chunk); i++)
+		chunk[i] = (__int8)('a' + i % 26);
+	w.pat = pat;
+
+	auto a0 = nallocs;
+	auto t0 = std::chrono::steady_clock::now();
+	for (DWORD i = 0; i < nchunks; i++) {
+		// pipe reads are usually short; vary the chunk length
+		DWORD len = 1 + (i * 7) % ABUFFER_SIZE;
+
+		while (!q.push(chunk, len)) {
+			// bounded queue is full; the producer has to wait
+			stalls++;
+			w.kick(q);
+			w.complete(q);
+		}
+		if (pat == PAT_BACKLOG)
+			continue;
+		w.kick(q);
+		if (pat == PAT_PENDING)
+			w.complete(q);
+	}
+	w.kick(q);
+	while (!q.empty())
+		w.complete(q);
+	auto t1 = std::chrono::steady_clock::now();
+
+	result r;
+	r.nsper = std::chrono::duration<double, std::nano>(t1 - t0).count() / nchunks;
+	r.allocsper = (double)(nallocs - a0) / nchunks;
+	r.writesper = (double)w.writes / nchunks;
+	r.stalls = stalls;
+	return r;
+}
+
+template <class Q>
+static void
+report(DWORD nchunks) {
+	Q q;
+
+	for (int p = PAT_SYNC; p <= PAT_BACKLOG; p++) {
+		// warm up, then measure
+		run<Q>((pattern)p, nchunks / 10);
+		result r = run<Q>((pattern)p, nchunks);
+		printf("%-22s %-8s %8.1f %10.3f %10.3f %10llu\n", q.name(),
+		    patnames[p], r.nsper, r.allocsper, r.writesper, r.stalls);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	DWORD nchunks = 1000000;
+
+	if (argc > 1)
+		nchunks = (DWORD)strtoul(argv[1], NULL, 0);
+	if (nchunks == 0) {
+		fprintf(stderr, "usage: %s [chunks]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-22s %-8s %8s %10s %10s %10s\n", "queue", "pattern",
+	    "ns/chunk", "allocs/ch", "writes/ch", "stalls");
+	report<q_current>(nchunks);
+	report<q_intrusive>(nchunks);
+	report<q_bufring>(nchunks);
+	report<q_bytering>(nchunks);
+	return 0;
+}
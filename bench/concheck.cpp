@@ -0,0 +1,136 @@
+// concheck.cpp : the console filter (cus/confilter.h) against whole lines.
+//
+// Random streams of console output, built from printk levels, syslog
+// priorities, timestamps in both orders, continuation lines with no
+// level, prompts, escapes, near misses and lines longer than the filter
+// holds back, go through the filter in pieces of random size, so records
+// are split anywhere, even inside a level or timestamp. A naive filter
+// that reassembles each whole line and then decides on it gives what
+// should come out, and how many lines should be dropped, for a random
+// threshold and set of excluded prefixes. The exit status is non-zero
+// if any stream comes out differently.
+
+#include "confilter.h"
+#include "printkidx.h"
+
+#include <stdio.h>
+#include <random>
+
+#define CON_STREAMS 20000
+
+static std::mt19937 rng(1);
+
+static unsigned
+rnd(unsigned n) {
+	return (unsigned)(rng() % n);
+}
+
+// Whether a whole line passes: its level, after any timestamp, below the
+// threshold, and its text not starting with an excluded prefix.
+static bool
+keep(const std::string &l, unsigned threshold, const std::vector<std::string> &pats) {
+	const char *p = l.data(), *end = p + l.size();
+	unsigned lv = PK_NOLEVEL;
+	double ts;
+
+	if (printk_level(p, end, &lv, &p)) {
+		if (printk_ts(p, end, &ts))
+			p = (const char *)memchr(p, ']', end - p) + 1;
+	} else if (printk_ts(p, end, &ts)) {
+		p = (const char *)memchr(p, ']', end - p) + 1;
+		while (p < end && *p == ' ')
+			p++;
+		printk_level(p, end, &lv, &p);
+	}
+	if (lv != PK_NOLEVEL && lv >= threshold)
+		return false;
+	while (p < end && *p == ' ')
+		p++;
+	for (auto &pat : pats) {
+		if ((size_t)(end - p) >= pat.size() && memcmp(p, pat.data(), pat.size()) == 0)
+			return false;
+	}
+	return true;
+}
+
+static std::string
+make_stream(void) {
+	static const char *pieces[] = {
+		"<7>", "<3>", "<30>", "<0>", "<c>", "<x>", "<1234>",
+		"[    1.234567] ", "[12.5]", "[ab]", "[  ", "<6>[ 3.1] ", "[ 2.0] <7>",
+		"usb 1-1: new device", "usb", "PM: suspend", "ACPI: y", "usbfoo",
+		"  continued from the line before", " ", "\t", "\r", "\x1b[32mok\x1b[m",
+		"login: ", "[root@h ~]# ", "plain text",
+	};
+	std::string s;
+	unsigned nlines = rnd(20);
+
+	for (unsigned i = 0; i < nlines; i++) {
+		for (unsigned k = rnd(5); k != 0; k--)
+			s += pieces[rnd(sizeof(pieces) / sizeof(pieces[0]))];
+		if (rnd(50) == 0)
+			s.append(100 + rnd(300), 'x');	// past CF_HEADMAX
+		if (i + 1 < nlines || rnd(2) == 0)
+			s += rnd(2) ? "\r\n" : "\n";
+	}
+	return s;
+}
+
+int
+main(void) {
+	unsigned bad = 0;
+	unsigned long long bytes = 0, lines = 0, dropped = 0;
+
+	for (unsigned it = 0; it < CON_STREAMS; it++) {
+		std::string in = make_stream(), want, got;
+		unsigned threshold = rnd(9);
+		std::vector<std::string> pats;
+		unsigned long long ndrop = 0;
+		confilter f;
+		auto emit = [&](const __int8 *p, DWORD n) {
+			got.append((const char *)p, n);
+			return true;
+		};
+
+		if (rnd(2))
+			pats.push_back("usb ");
+		if (rnd(2))
+			pats.push_back("PM:");
+		for (size_t a = 0; a < in.size();) {
+			size_t nl = in.find('\n', a);
+			size_t b = nl == std::string::npos ? in.size() : nl + 1;
+			std::string l = in.substr(a, b - a);
+
+			if (keep(l, threshold, pats))
+				want += l;
+			else
+				ndrop++;
+			lines++;
+			a = b;
+		}
+
+		f.setlevel(threshold);
+		for (auto &pat : pats)
+			f.exclude(pat);
+		for (size_t o = 0; o < in.size();) {
+			size_t n = rnd(4) == 0 ? rnd(64) : rnd(8);
+
+			if (n > in.size() - o)
+				n = in.size() - o;
+			f.filter((const __int8 *)in.data() + o, (DWORD)n, emit);
+			o += n;
+		}
+		f.flush(emit);
+		bytes += in.size();
+		dropped += ndrop;
+
+		if (got != want || (f.active() && f.dropped() != ndrop)) {
+			if (bad++ < 5)
+				printf("threshold %u, %zu prefixes\n  in   \"%s\"\n  want \"%s\"\n  got  \"%s\"\n  dropped %llu, want %llu\n",
+					threshold, pats.size(), in.c_str(), want.c_str(), got.c_str(), f.dropped(), ndrop);
+		}
+	}
+	printf("%u streams, %llu lines, %llu bytes, %llu lines dropped: %u differ\n", CON_STREAMS, lines, bytes,
+		dropped, bad);
+	return bad != 0;
+}
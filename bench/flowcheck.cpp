@@ -0,0 +1,288 @@
+// flowcheck.cpp : the -o graph (cus/flow.h) run against simulated I/O.
+//
+// Console-like output (escapes, progress redraws, repeated lines, the odd
+// panic and one very long line) goes into a graph ABUFFER_SIZE at a time,
+// as cus reads it, with every filter and several kinds of sink: fast,
+// slow, short writes, one that fails part way. Completions are handed
+// back as they come due, and pipe reads stop while a sink in block mode
+// is full, as in cus. At the end each sink's file must hold exactly what
+// its chain should make of the output (worked out here without the
+// graph), every byte written once. With drop, a sink may lose whole
+// runs but nothing else. No slab may outlive the graph, and the only
+// copies must be the one into the graph and the rewriting filters'.
+//
+// It prints, per chain, the result and the bytes written and dropped,
+// then the simulated time, the bytes copied per byte of output and the
+// real ns per byte. The exit status is non-zero if anything failed.
+
+#include "simio.h"
+#include "flow.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <map>
+
+#define CHECK_BYTES (8 * 1024 * 1024)
+#define READ_NS 1000		// between pipe reads: 64 MB/s
+#define SLOW_LIMIT (256 * 1024)
+
+struct simsink : ovsink {
+	simfile file;
+	simevent ev;
+
+	simsink(const std::string &n, size_t limit, bool d) : ovsink(n, &file, &ev, limit, d), file("sink"), ev{ false } {}
+	void close(void) {
+		DWORD n;
+
+		// CancelIo would end the write; here it just finishes
+		if (!sim.inflight.empty())
+			GetOverlappedResult(h, &ov, &n, TRUE);
+	}
+};
+
+static std::map<std::string, simsink *> made;
+
+// sim:KIND, where KIND says how its writes turn out.
+static flowsink *
+make_sink(const std::string &kind, const std::string &arg, size_t limit, bool drop, std::string &why) {
+	static const struct {
+		const char *name;
+		unsigned mix[SIM_NKINDS];
+		unsigned long long latency;
+	} kinds[] = {
+		{ "sync", { 1, 0, 0, 0, 0, 0 }, 0 },
+		{ "short", { 1, 3, 0, 2, 0, 0 }, 20000 },
+		{ "pending", { 0, 0, 1, 0, 0, 0 }, 50000 },
+		{ "mixed", { 4, 2, 4, 2, 0, 0 }, 100000 },
+		{ "slow", { 0, 0, 1, 1, 0, 0 }, 20000000 },
+		{ "fail", { 0, 0, 0, 0, 1, 1 }, 100000 },
+	};
+
+	if (kind != "sim") {
+		why = "unknown sink " + kind;
+		return NULL;
+	}
+	for (const auto &k : kinds) {
+		if (arg != k.name)
+			continue;
+		simsink *s = new simsink(arg, arg == "slow" ? SLOW_LIMIT : limit, drop);
+
+		memcpy(s->file.mix, k.mix, sizeof(k.mix));
+		s->file.latency = k.latency;
+		if (arg == "fail") {
+			for (int i = 0; i < 20; i++)
+				s->file.script.push_back(simstep{ SIM_SYNC, 0 });
+		}
+		made[arg] = s;
+		return s;
+	}
+	why = "unknown sim kind " + arg;
+	return NULL;
+}
+
+// Output with the things the filters look for.
+static std::string
+make_output(size_t n) {
+	static const char *lines[] = {
+		"[%5u.%06u] eth0: link up, 1000 Mbps\r\n",
+		"\x1b[32m[  OK  ]\x1b[m Started unit %u.%u\r\n",
+		"Loading %u%%\rLoading %u%%\r\n",
+		"\x1b]0;title %u %u\x07prompt$ \r\n",
+		"[%5u.%06u] kernel panic - not syncing\r\n",
+	};
+	std::string out;
+	char buf[128];
+	unsigned i = 0;
+
+	while (out.size() < n) {
+		unsigned r = (unsigned)(sim.next() >> 40);
+		unsigned k = r % 64 == 0 ? 4 : r % 4;
+
+		snprintf(buf, sizeof(buf), lines[k], i, r & 0xfffff);
+		out += buf;
+		if (r % 97 == 0) {
+			for (unsigned j = r % 11; j != 0; j--)
+				out += buf;	// a run for dedup
+		}
+		if (i++ == 5000) {
+			out.append(100000, 'x');	// past FLOW_LINEMAX, decided on its start
+			out.insert(out.size() - 100000, "panic ");
+			out += "\n";
+		}
+	}
+	return out;
+}
+
+static std::string
+grep(const std::string &s, const char *pat, bool invert) {
+	std::string out;
+
+	for (size_t at = 0; at < s.size();) {
+		size_t nl = s.find('\n', at);
+		size_t end = nl == std::string::npos ? s.size() : nl + 1;
+
+		if ((s.find(pat, at) < end) != invert)
+			out.append(s, at, end - at);
+		at = end;
+	}
+	return out;
+}
+
+template <class F>
+static std::string
+rewrite(const std::string &s) {
+	F f;
+	std::string out;
+
+	f.filter((const __int8 *)s.data(), (DWORD)s.size(), out);
+	f.flush(out);
+	return out;
+}
+
+struct chain {
+	const char *spec;
+	const char *sink;
+	std::string (*want)(const std::string &);
+	bool fails;
+};
+
+static std::string raw(const std::string &s) { return s; }
+static std::string strip(const std::string &s) { return rewrite<ansifilter>(s); }
+static std::string panics(const std::string &s) { return grep(s, "panic", false); }
+static std::string calm(const std::string &s) { return rewrite<linededup>(grep(s, "panic", true)); }
+
+static const chain chains[] = {
+	{ "sim:mixed", "mixed", raw, false },
+	{ "sim:short", "short", raw, false },
+	{ "strip,sim:pending", "pending", strip, false },
+	{ "grep:panic,sim:sync", "sync", panics, false },
+	{ "grep-v:panic,dedup,sim:slow", "slow", calm, false },
+	{ "sim:fail", "fail", raw, true },
+};
+
+// The pipe-read loop: a read every READ_NS unless a sink is full, and
+// completions handed to the graph as they come due.
+static bool
+feed(flowgraph &g, const std::string &in) {
+	HANDLE ev[FLOW_MAXSINKS];
+	size_t sent = 0;
+	bool paused = false;
+
+	for (;;) {
+		unsigned ne = g.events(ev);
+
+		for (unsigned i = 0; i < ne; i++) {
+			if (((simevent *)ev[i])->signaled && g.complete(i) != WAITER_SUCCESS)
+				return false;
+		}
+		if (sent == in.size())
+			break;
+		if (!(paused = g.blocked(paused))) {
+			DWORD n = in.size() - sent < ABUFFER_SIZE ? (DWORD)(in.size() - sent) : ABUFFER_SIZE;
+
+			if (g.put((const __int8 *)in.data() + sent, n) != WAITER_SUCCESS)
+				return false;
+			sent += n;
+			sim.now += READ_NS;
+		} else if (!sim_wait()) {
+			sim_fail("stuck with pipe reads stopped and nothing in flight");
+			return false;
+		}
+		while (sim_next() <= sim.now)
+			sim_wait();
+	}
+	return g.finish() == WAITER_SUCCESS;
+}
+
+static bool
+check(const chain &c, const std::string &in, bool drop) {
+	simsink *s = made[c.sink];
+	std::string want = c.want(in);
+	const simfile &f = s->file;
+	bool ok = true;
+
+	for (unsigned char n : f.nwrites)
+		ok &= n == 1;
+	if (c.fails)
+		ok &= s->failed() && f.data.size() < want.size() && want.compare(0, f.data.size(), f.data) == 0;
+	else if (drop && s->queue().dropped() != 0) {
+		// what's there is want, less what was dropped
+		size_t i = 0;
+
+		for (size_t at = 0; at < want.size() && i < f.data.size(); at++) {
+			if (want[at] == f.data[i])
+				i++;
+		}
+		ok &= i == f.data.size() && f.data.size() + s->queue().dropped() == want.size();
+	} else
+		ok &= !s->failed() && s->lost() == 0 && f.data == want;
+	return ok;
+}
+
+static bool
+run(bool drop) {
+	std::string in, why;
+	bool ok = true;
+
+	sim.reset(drop ? 2 : 1);
+	in = make_output(CHECK_BYTES);
+	made.clear();
+	slab_stats() = slabstats{ 0, 0 };
+
+	flowgraph *g = new flowgraph(make_sink, 4 * 1024 * 1024, drop);
+	for (const chain &c : chains) {
+		if (!g->add(c.spec, why)) {
+			printf("%s: %s\n", c.spec, why.c_str());
+			return false;
+		}
+	}
+	if (g->add("strip", why) || g->add("grep,sim:sync", why) || g->add("sim:nosuch", why)) {
+		printf("a bad spec was taken\n");
+		ok = false;
+	}
+
+	auto t0 = std::chrono::steady_clock::now();
+	ok &= feed(*g, in);
+	g->drain();
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+
+	printf("\n%s, %.1f MB of output\n", drop ? "drop when full" : "block when full", in.size() / 1e6);
+	printf("%-30s %-6s %9s %10s %9s\n", "chain", "result", "MB", "written", "dropped");
+	for (const chain &c : chains) {
+		simsink *s = made[c.sink];
+		bool good = check(c, in, drop);
+
+		printf("%-30s %-6s %9.2f %10zu %9llu\n", c.spec, good ? "ok" : "FAIL", s->file.data.size() / 1e6,
+		    s->file.data.size(), s->queue().dropped());
+		ok &= good;
+	}
+
+	// One copy in, plus what strip and dedup made.
+	unsigned long long copied = slab_stats().copied;
+	unsigned long long rewritten = strip(in).size() + calm(in).size();
+
+	printf("simulated %.1f ms, %.2f bytes copied per byte (%.2f expected), %.2f ns per byte\n",
+	    sim.now / 1e6, (double)copied / in.size(), (double)(in.size() + rewritten) / in.size(), ns / in.size());
+	if (copied != in.size() + rewritten) {
+		printf("  copies: %llu, expected %llu\n", copied, in.size() + rewritten);
+		ok = false;
+	}
+	delete g;
+	if (slab_stats().live != 0) {
+		printf("  %ld slabs leaked\n", slab_stats().live);
+		ok = false;
+	}
+	if (!sim.failure.empty()) {
+		printf("  %s\n", sim.failure.c_str());
+		ok = false;
+	}
+	return ok;
+}
+
+int
+main(void) {
+	bool ok = run(false);
+
+	ok &= run(true);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,220 @@
+// hlcheck.cpp : the -H -w scheduler (cus/hlsched.h) against a fake port.
+//
+// Worker threads run the loop headless.cpp does: run what's ready, then
+// wait on the port and post what comes off it to its session. The port
+// hands completions out in random order. As in cus, each session has at
+// most one read and one write in flight, and starts the next of each
+// when it handles the last. Some sessions are slow to handle, so others
+// pile up behind them and get stolen. The handler checks that no session
+// is ever run on two workers at once, that each stream's completions
+// come in order, and that nothing is handled after its session finished.
+// At the end every completion must have been handled exactly once and
+// every session finished exactly once.
+//
+// It prints, per run, the result, the turns run and the sessions stolen.
+// The exit status is non-zero if anything failed.
+
+#include "hlsched.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define KEY_QUIT NULL
+#define NIO 200			// reads, and writes, per session
+
+struct pkt {
+	hltask *key;
+	hldone d;
+};
+
+// A completion port that gives out any of what's queued.
+struct fakeport {
+	std::mutex lock;
+	std::condition_variable cv;
+	std::vector<pkt> q;
+	std::mt19937 rng;
+
+	fakeport(unsigned seed) : rng(seed) {}
+	void put(const pkt &k) {
+		std::lock_guard<std::mutex> g(lock);
+
+		q.push_back(k);
+		cv.notify_one();
+	}
+	pkt get(void) {
+		std::unique_lock<std::mutex> g(lock);
+		size_t i;
+		pkt k;
+
+		cv.wait(g, [&] { return !q.empty(); });
+		i = rng() % q.size();
+		k = q[i];
+		q[i] = q.back();
+		q.pop_back();
+		return k;
+	}
+};
+
+struct task : hltask {
+	unsigned id;
+	bool slow;
+	std::atomic<bool> running;
+	std::atomic<unsigned> finished;
+	unsigned nread, nwrite;		// handled, so the next seq expected
+	unsigned handled;
+
+	task(unsigned i, bool s) : id(i), slow(s), running(false), finished(0), nread(0), nwrite(0), handled(0) {}
+};
+
+static hlsched *sched;
+static fakeport *port;
+static std::vector<task *> tasks;
+static std::atomic<unsigned> nfinished;
+static std::atomic<unsigned> nfail;
+static std::mutex faillock;
+
+static void
+fail(task *t, const char *why) {
+	std::lock_guard<std::mutex> g(faillock);
+
+	if (nfail++ < 10)
+		printf("  session %u: %s\n", t->id, why);
+}
+
+static void
+spin(unsigned us) {
+	auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+
+	while (std::chrono::steady_clock::now() < end)
+		;
+}
+
+// hl_done for a fake session: start the next read or write, and finish
+// once both streams have run out.
+static bool
+handle(hltask *ht, const hldone &d) {
+	task *t = (task *)ht;
+	bool last = false;
+
+	if (t->finished != 0)
+		fail(t, "handled after it finished");
+	if (t->running.exchange(true))
+		fail(t, "running on two workers");
+	spin(t->slow ? 20 : 0);
+	t->handled++;
+	switch (d.kind) {
+	case d.HL_START:
+		if (t->handled != 1)
+			fail(t, "start after I/O");
+		port->put(pkt{ t, hldone{ hldone::HL_READ, TRUE, 0, 0 } });
+		port->put(pkt{ t, hldone{ hldone::HL_WRITE, TRUE, 0, 0 } });
+		break;
+	case d.HL_READ:
+		if (d.n != t->nread)
+			fail(t, "read out of order");
+		if (++t->nread < NIO)
+			port->put(pkt{ t, hldone{ hldone::HL_READ, TRUE, t->nread, 0 } });
+		break;
+	case d.HL_WRITE:
+		if (d.n != t->nwrite)
+			fail(t, "write out of order");
+		if (++t->nwrite < NIO)
+			port->put(pkt{ t, hldone{ hldone::HL_WRITE, TRUE, t->nwrite, 0 } });
+		break;
+	default:
+		fail(t, "unexpected kind");
+	}
+	last = t->nread == NIO && t->nwrite == NIO;
+	t->running = false;
+	if (!last)
+		return false;
+	if (t->finished++ != 0)
+		fail(t, "finished twice");
+	if (++nfinished == tasks.size()) {
+		for (unsigned i = 0; i < sched->nworkers; i++)
+			port->put(pkt{ KEY_QUIT, hldone{} });
+	}
+	return true;
+}
+
+// hl_worker, with the fake port.
+static void
+worker(unsigned self) {
+	for (;;) {
+		hltask *t;
+		pkt k;
+
+		while ((t = sched->next(self)) != NULL)
+			sched->run(self, t, handle);
+
+		sched->workers[self].busy = false;
+		k = port->get();
+		sched->workers[self].busy = true;
+		if (k.key == KEY_QUIT)
+			return;
+		sched->post(self, k.key, k.d);
+	}
+}
+
+static bool
+run(unsigned nw, unsigned nt, unsigned seed) {
+	std::vector<std::thread> threads;
+	unsigned long long runs = 0, steals = 0;
+	bool ok;
+
+	sched = new hlsched();
+	sched->nworkers = nw;
+	port = new fakeport(seed);
+	nfinished = 0;
+	nfail = 0;
+	for (unsigned i = 0; i < nt; i++)
+		tasks.push_back(new task(i, i % 7 == 3));
+
+	// as the command line's "add"s are, before the workers start
+	for (unsigned i = 0; i < nt; i++) {
+		tasks[i]->owner = i % nw;
+		sched->post(0, tasks[i], hldone{ hldone::HL_START, TRUE, 0, 0 });
+	}
+	for (unsigned i = 1; i < nw; i++)
+		threads.emplace_back(worker, i);
+	worker(0);
+	for (auto &t : threads)
+		t.join();
+
+	for (task *t : tasks) {
+		if (t->finished != 1 || t->handled != 2 * NIO + 1)
+			fail(t, "not every completion handled once");
+		delete t;
+	}
+	tasks.clear();
+	for (unsigned i = 0; i < nw; i++) {
+		runs += sched->workers[i].runs;
+		steals += sched->workers[i].steals;
+		if (!sched->workers[i].ready.empty())
+			nfail++;
+	}
+	ok = nfail == 0 && runs == (unsigned long long)nt * (2 * NIO + 1);
+	printf("%7u %8u %-6s %10llu %8llu\n", nw, nt, ok ? "ok" : "FAIL", runs, steals);
+	delete port;
+	delete sched;
+	return ok;
+}
+
+int
+main(void) {
+	static const unsigned nws[] = { 1, 2, 4, 8 };
+	static const unsigned nts[] = { 1, 16, 300 };
+	bool ok = true;
+	unsigned seed = 1;
+
+	printf("%7s %8s %-6s %10s %8s\n", "workers", "sessions", "result", "turns", "stolen");
+	for (unsigned nw : nws) {
+		for (unsigned nt : nts)
+			ok &= run(nw, nt, seed++);
+	}
+	return ok ? 0 : 1;
+}
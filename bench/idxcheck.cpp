@@ -0,0 +1,320 @@
+// idxcheck.cpp : the boot index (cus/bootindex.h) and the printk index
+// (cus/printkidx.h) against a linear scan of the log.
+//
+// A generated log of several boots, with every form of printk line cus
+// knows and lines that aren't printk's, is indexed both ways. The boots
+// are found by scanning odd-sized ranges, so banners fall across range
+// ends, as logidx's threads see them, and the index must survive being
+// written and read back. The printk index is fed the log in pieces of
+// random size, with a host clock that moves between pieces, so lines
+// are split across buffers as cus splits them. Then boots, timestamps
+// and a set of level and time queries, answered from the index blocks
+// as logidx -q does, must match what a walk over every line finds. The
+// exit status is non-zero if anything failed.
+
+#include "bootindex.h"
+#include "printkidx.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+
+#define IDX_BOOTS 6
+#define IDX_BYTES (4 * 1024 * 1024)
+#define IDX_RANGE 65521		// bytes per scan range, prime
+#define IDX_HOST0 1700000000000000ULL	// us since 1970
+#define IDX_TICK 1000		// host us between pieces
+
+static std::mt19937_64 rng(1);
+static bool ok = true;
+
+static unsigned
+rnd(unsigned n) {
+	return (unsigned)(rng() % n);
+}
+
+static void
+check(bool cond, const char *what) {
+	if (!cond) {
+		printf("  %s\n", what);
+		ok = false;
+	}
+}
+
+// One boot's worth of console, guest time from 0.
+static void
+make_boot(std::string &log, unsigned boot, size_t bytes) {
+	static const char *banners[] = {
+		"Linux version 6.1.%u (build@host) #1 SMP\n",
+		"[    0.000000] Linux version 5.15.%u (gcc) #2\n",
+		"<5>Linux version 4.19.%u\n",
+		"Computer is booting, SAC started %u\r\n",
+		"Copyright (c) 1992-2023 The FreeBSD Project. %u\n",
+	};
+	static const char *texts[] = { "eth0: link up", "EXT4-fs (vda1): mounted", "usb 1-1: new device",
+		"random: crng init done", "Out of memory: Kill process", "" };
+	size_t end = log.size() + bytes;
+	double ts = 0;
+	char buf[256];
+
+	snprintf(buf, sizeof(buf), banners[boot % 5], boot);
+	log += buf;
+	while (log.size() < end) {
+		const char *t = texts[rnd(sizeof(texts) / sizeof(texts[0]))];
+		unsigned lv = rnd(8);
+
+		ts += rnd(50000) / 1e6;
+		switch (rnd(8)) {
+		case 0:
+			snprintf(buf, sizeof(buf), "<%u>[%5u.%06u] %s\n", lv, (unsigned)ts, (unsigned)((ts - (unsigned)ts) * 1e6), t);
+			break;
+		case 1:
+		case 2:
+			snprintf(buf, sizeof(buf), "[%5u.%06u] %s\n", (unsigned)ts, (unsigned)((ts - (unsigned)ts) * 1e6), t);
+			break;
+		case 3:
+			snprintf(buf, sizeof(buf), "[%5u.%06u] <%u>%s\r\n", (unsigned)ts, (unsigned)((ts - (unsigned)ts) * 1e6), lv, t);
+			break;
+		case 4:
+			snprintf(buf, sizeof(buf), "<%u>%s\n", lv + 8 * rnd(4), t);
+			break;
+		case 5:
+			snprintf(buf, sizeof(buf), "login: %s [not a ts] <x>\n", t);
+			break;
+		case 6:
+			snprintf(buf, sizeof(buf), "\n");
+			break;
+		default:
+			snprintf(buf, sizeof(buf), "%s\n", t);
+			break;
+		}
+		log += buf;
+	}
+}
+
+// A printk line as the whole-line scan sees it.
+struct pkline {
+	long long gts;		// us, -1 for none
+	unsigned long long hts, off, len;
+	unsigned level;
+};
+
+static bool
+parse_line(const char *p, const char *end, unsigned *level, long long *gts) {
+	double ts;
+	bool hasts;
+
+	*level = PK_NOLEVEL;
+	if (printk_level(p, end, level, &p))
+		hasts = printk_ts(p, end, &ts);
+	else if ((hasts = printk_ts(p, end, &ts))) {
+		const char *q = (const char *)memchr(p, ']', end - p) + 1;
+
+		while (q < end && *q == ' ')
+			q++;
+		printk_level(q, end, level, &q);
+	}
+	*gts = hasts ? (long long)(ts * 1e6 + 0.5) : -1;
+	return hasts || *level != PK_NOLEVEL;
+}
+
+static void
+check_boots(const std::string &log, const std::vector<std::string> &banners) {
+	const char *base = log.data();
+	unsigned long long size = log.size();
+	std::vector<unsigned long long> starts, want;
+	std::vector<bootrec> boots, back;
+	unsigned long long rsize = 0;
+	bool same = true;
+	FILE *f;
+
+	// as logidx does it, the ranges in any order
+	std::vector<unsigned long long> ranges;
+	for (unsigned long long s = 0; s < size; s += IDX_RANGE)
+		ranges.push_back(s);
+	std::shuffle(ranges.begin(), ranges.end(), rng);
+	for (unsigned long long s : ranges)
+		bootidx_scan(base, size, s, std::min(size, s + IDX_RANGE), banners, starts);
+	std::sort(starts.begin(), starts.end());
+	starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+	if (starts.empty() || starts[0] != 0)
+		starts.insert(starts.begin(), 0);
+	for (size_t i = 0; i < starts.size(); i++) {
+		bootrec b;
+
+		b.start = starts[i];
+		b.end = i + 1 < starts.size() ? starts[i + 1] : size;
+		b.hasts = bootidx_firstts(base, b.start, b.end, &b.firstts) && bootidx_lastts(base, b.start, b.end, &b.lastts);
+		boots.push_back(b);
+	}
+
+	// every line, from the top
+	want.push_back(0);
+	for (unsigned long long at = 0; at < size;) {
+		size_t nl = log.find('\n', at);
+		unsigned long long e = nl == std::string::npos ? size : nl + 1;
+		std::string line = log.substr(at, e - at);
+
+		for (auto &b : banners) {
+			if (line.find(b) != std::string::npos && at != 0) {
+				want.push_back(at);
+				break;
+			}
+		}
+		at = e;
+	}
+	check(starts == want, "boot starts differ");
+	for (size_t i = 0; i < boots.size(); i++) {
+		const bootrec &b = boots[i];
+		bool first = true, has = false;
+		double fts = 0, lts = 0, ts;
+
+		for (unsigned long long at = b.start; at < b.end;) {
+			size_t nl = log.find('\n', at);
+			unsigned long long e = nl == std::string::npos ? size : std::min<unsigned long long>(nl + 1, b.end);
+
+			if (printk_ts(base + at, base + e, &ts)) {
+				if (first)
+					fts = ts;
+				first = false;
+				has = true;
+				lts = ts;
+			}
+			at = e;
+		}
+		same &= b.hasts == has && (!has || (b.firstts == fts && b.lastts == lts));
+	}
+	check(same, "boot timestamps differ");
+
+	f = tmpfile();
+	bootidx_write(f, size, boots);
+	rewind(f);
+	check(bootidx_read(f, &rsize, back) && rsize == size && back.size() == boots.size(), "index not read back");
+	fclose(f);
+	for (size_t i = 0; i < back.size() && i < boots.size(); i++) {
+		same &= back[i].start == boots[i].start && back[i].end == boots[i].end && back[i].hasts == boots[i].hasts &&
+			(!back[i].hasts || (fabs(back[i].firstts - boots[i].firstts) < 1e-6 &&
+			fabs(back[i].lastts - boots[i].lastts) < 1e-6));
+	}
+	check(same, "index read back differs");
+	printf("boots: %zu found, %zu expected\n", boots.size(), want.size());
+}
+
+// logidx -q over blocks in memory.
+static std::string
+query_index(const std::string &pk, const std::string &log, const pkquery &q, unsigned *skipped, unsigned *nblocks) {
+	std::vector<unsigned long long> col[PK_NCOLS];
+	std::string out;
+
+	*skipped = *nblocks = 0;
+	for (auto &c : col)
+		c.resize(PK_BLOCKRECS);
+	for (size_t at = 0; at + sizeof(pkblock) <= pk.size();) {
+		pkblock b;
+
+		memcpy(&b, pk.data() + at, sizeof(b));
+		if (memcmp(b.magic, PK_MAGIC, sizeof(b.magic)) != 0 || b.count == 0 || b.count > PK_BLOCKRECS) {
+			check(false, "bad block");
+			break;
+		}
+		(*nblocks)++;
+		if (!pk_maybe(b, q)) {
+			(*skipped)++;
+			at += pk_column(b, PK_NCOLS);
+			continue;
+		}
+		for (int c = 0; c < PK_NCOLS; c++)
+			pk_decode((const unsigned char *)pk.data() + at + pk_column(b, c), b.width[c], b.count, col[c].data());
+		for (unsigned i = 0; i < b.count; i++) {
+			if (pk_match(b, q, col[PK_GTS][i], col[PK_HTS][i], col[PK_LEVEL][i]))
+				out.append(log, col[PK_OFF][i] + b.offbase, col[PK_LEN][i]);
+		}
+		at += pk_column(b, PK_NCOLS);
+	}
+	return out;
+}
+
+static std::string
+query_scan(const std::vector<pkline> &lines, const std::string &log, const pkquery &q) {
+	std::string out;
+
+	for (const pkline &l : lines) {
+		if (q.maxlevel >= 0 && l.level > (unsigned)q.maxlevel)
+			continue;
+		if (q.gts && (l.gts < 0 || l.gts < q.gfrom || l.gts > q.gto))
+			continue;
+		if (q.hts && ((long long)l.hts < q.hfrom || (long long)l.hts > q.hto))
+			continue;
+		out.append(log, l.off, l.len);
+	}
+	return out;
+}
+
+static void
+check_printk(const std::string &log) {
+	pkindex idx;
+	std::string pk;
+	std::vector<unsigned long long> host(log.size() + 1);
+	std::vector<pkline> lines;
+	unsigned long long now = IDX_HOST0, hmid;
+	static const int levels[] = { -1, 0, 3, 7 };
+
+	// the log in random pieces, each at its own host time
+	for (size_t at = 0; at < log.size();) {
+		size_t n = std::min<size_t>(1 + rnd(rnd(8) == 0 ? 200000 : 4096), log.size() - at);
+
+		idx.feed((const __int8 *)log.data() + at, (DWORD)n, now, pk);
+		for (size_t i = at; i < at + n; i++)
+			host[i] = now;
+		at += n;
+		now += IDX_TICK;
+	}
+	idx.flush(pk);
+
+	for (unsigned long long at = 0; at < log.size();) {
+		size_t nl = log.find('\n', at);
+		unsigned long long e = nl == std::string::npos ? log.size() : nl + 1;
+		pkline l;
+
+		if (parse_line(log.data() + at, log.data() + e, &l.level, &l.gts)) {
+			l.hts = host[at];
+			l.off = at;
+			l.len = e - at;
+			lines.push_back(l);
+		}
+		at = e;
+	}
+	check(idx.lines() == lines.size(), "printk line counts differ");
+
+	hmid = (IDX_HOST0 + now) / 2;
+	for (int lv : levels) {
+		for (unsigned r = 0; r < 4; r++) {
+			pkquery q = { lv, r == 1 || r == 3, r == 2 || r == 3, 10000000, 20000000,
+				(long long)hmid, (long long)hmid + 200 * IDX_TICK };
+			unsigned skipped, nblocks;
+			std::string got = query_index(pk, log, q, &skipped, &nblocks);
+			std::string want = query_scan(lines, log, q);
+			bool same = got == want;
+
+			printf("query -l %2d%s%s: %8zu bytes, %3u of %u blocks skipped, %s\n", lv, q.gts ? " -t 10,20" : "",
+				q.hts ? " -T mid" : "", want.size(), skipped, nblocks, same ? "ok" : "FAIL");
+			check(same, "query results differ");
+		}
+	}
+	printf("printk: %zu lines indexed in %.2f MB of blocks\n", lines.size(), pk.size() / 1048576.0);
+}
+
+int
+main(void) {
+	std::vector<std::string> banners(std::begin(bootidx_banners), std::end(bootidx_banners));
+	std::string log = "firmware junk before any banner\n[    1.000000] early\n";
+
+	for (unsigned b = 0; b < IDX_BOOTS; b++)
+		make_boot(log, b, IDX_BYTES / IDX_BOOTS);
+	log += "[  99.000000] cut off mid-line, no newline";
+	check_boots(log, banners);
+	check_printk(log);
+	printf("%s\n", ok ? "ok" : "FAIL");
+	return ok ? 0 : 1;
+}
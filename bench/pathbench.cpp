@@ -0,0 +1,303 @@
+// pathbench.cpp : the pipe output path, asked at each stage or picked once.
+//
+// Before outpath.h, every buffer from the pipe asked, stage by stage,
+// which outputs were on: the scrollback, the console, the recording,
+// -f and -o, then the log's filters, then which log writer, then -k's
+// index. cus now
+// picks an instantiation of outpath() for the session's options at
+// startup. This runs both over the same stand-in stages (each output is
+// an out of line call that sums the bytes, and the filters are the real
+// ansifilter and linededup), with a heap abuffer per read as cus has,
+// for a few common sessions:
+//
+//	generic		outpath() over the _any stages, which branch on the
+//			options as the old pipe_input_helper() did
+//	picked		outpaths<P>::pick() for the options
+//
+// It reports ns per buffer for each and checks that both sent the same
+// bytes everywhere. The exit status is non-zero if they didn't.
+
+#include "simio.h"
+#include "outpath.h"
+#include "ansifilter.h"
+#include "linededup.h"
+
+#include <chrono>
+#include <cstdlib>
+
+#define BENCH_BUFFERS 500000
+#define BENCH_ROUNDS 21
+
+// The session's options, as cus's globals.
+static bool optSback, optRec, optTee, optFlow, optPaused, optDrop, optIndex;
+static ansifilter *optFilter;
+static linededup *optDedup;
+static outlog optLog;
+
+static unsigned long long pipeBytes;
+static std::string cleaned, uniq;
+
+struct out {
+	unsigned long long bytes, sum;
+};
+
+// Out of line, as the real outputs are.
+__attribute__((noinline)) static void
+emit(out &o, const __int8 *p, DWORD n) {
+	o.bytes += n;
+	for (DWORD i = 0; i < n; i += 16)
+		o.sum = o.sum * 31 + (unsigned char)p[i];
+}
+
+struct benchpath {
+	struct ctx {
+		out con, sback, rec, tee, flow, log, idx;
+		bufferqueue q;
+	};
+
+	struct raw_console {
+		static DWORD put(ctx &x, const __int8 *p, DWORD n) {
+			pipeBytes += n;
+			emit(x.con, p, n);
+			return WAITER_SUCCESS;
+		}
+	};
+	struct raw_all {
+		static DWORD put(ctx &x, const __int8 *p, DWORD n) {
+			pipeBytes += n;
+			if (optSback)
+				emit(x.sback, p, n);
+			if (!optFlow && !optPaused)
+				emit(x.con, p, n);
+			if (optRec)
+				emit(x.rec, p, n);
+			if (optTee)
+				emit(x.tee, p, n);
+			if (optFlow)
+				emit(x.flow, p, n);
+			return WAITER_SUCCESS;
+		}
+	};
+
+	struct clean_off {
+		template <class L, class I>
+		static DWORD put(ctx &x, abuffer *abuf) { return L::template put<I>(x, abuf); }
+	};
+	struct clean_on {
+		template <class L, class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			std::string &s = clean(abuf->getptr(), abuf->size());
+
+			delete abuf;
+			return chunks<L, I>(x, s);
+		}
+	};
+
+	struct log_none {
+		template <class I>
+		static DWORD put(ctx &, abuffer *abuf) {
+			delete abuf;
+			return WAITER_SUCCESS;
+		}
+	};
+	// Every write completes at once.
+	struct log_queue {
+		template <class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			I::put(x, abuf->getptr(), abuf->size());
+			x.q.push(abuf);
+			while (!x.q.empty()) {
+				abuffer *b = x.q.front();
+
+				emit(x.log, b->getptr(), b->size());
+				x.q.pop();
+				delete b;
+			}
+			return WAITER_SUCCESS;
+		}
+	};
+	struct log_drop {
+		template <class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			if (x.q.full()) {
+				x.q.dropped(abuf->size());
+				delete abuf;
+				return WAITER_SUCCESS;
+			}
+			return log_queue::put<I>(x, abuf);
+		}
+	};
+	struct log_ring {
+		template <class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			emit(x.log, abuf->getptr(), abuf->size());
+			I::put(x, abuf->getptr(), abuf->size());
+			delete abuf;
+			return WAITER_SUCCESS;
+		}
+	};
+	typedef log_ring log_direct;
+
+	struct index_off {
+		static DWORD put(ctx &, const __int8 *, DWORD) { return WAITER_SUCCESS; }
+	};
+	struct index_on {
+		static DWORD put(ctx &x, const __int8 *p, DWORD n) {
+			emit(x.idx, p, n);
+			return WAITER_SUCCESS;
+		}
+	};
+
+	// The old way: ask each time.
+	struct index_any {
+		static DWORD put(ctx &x, const __int8 *p, DWORD n) {
+			if (optIndex)
+				return index_on::put(x, p, n);
+			return WAITER_SUCCESS;
+		}
+	};
+	struct log_any {
+		template <class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			if (optLog == OUTLOG_RING)
+				return log_ring::put<I>(x, abuf);
+			if (optLog == OUTLOG_DIRECT)
+				return log_direct::put<I>(x, abuf);
+			if (optLog == OUTLOG_NONE)
+				return log_none::put<I>(x, abuf);
+			if (optDrop)
+				return log_drop::put<I>(x, abuf);
+			return log_queue::put<I>(x, abuf);
+		}
+	};
+	struct clean_any {
+		template <class L, class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			if (optFilter == NULL && optDedup == NULL)
+				return L::template put<I>(x, abuf);
+			return clean_on::put<L, I>(x, abuf);
+		}
+	};
+
+	static std::string &clean(const __int8 *p, DWORD n) {
+		if (optFilter != NULL) {
+			optFilter->filter(p, n, cleaned);
+			if (optDedup == NULL)
+				return cleaned;
+			p = (const __int8 *)cleaned.data();
+			n = (DWORD)cleaned.size();
+		}
+		optDedup->filter(p, n, uniq);
+		cleaned.clear();
+		return uniq;
+	}
+
+	template <class L, class I>
+	static DWORD chunks(ctx &x, std::string &bytes) {
+		DWORD ret = abuffer_split((const __int8 *)bytes.data(), (DWORD)bytes.size(),
+			[&](abuffer *abuf) { return L::template put<I>(x, abuf); });
+
+		if (ret == WAITER_SUCCESS)
+			bytes.clear();
+		return ret;
+	}
+};
+
+typedef outpaths<benchpath>::fn pathfn;
+
+struct session {
+	const char *name;
+	bool sback, rec, tee, flow, filter, dedup, drop;
+	outlog log;
+	bool index;
+};
+
+static const session sessions[] = {
+	{ "console", false, false, false, false, false, false, false, OUTLOG_NONE, false },
+	{ "console+log", false, false, false, false, false, false, false, OUTLOG_QUEUE, false },
+	{ "console+log:drop", false, false, false, false, false, false, true, OUTLOG_DROP, false },
+	{ "console+ring log", false, false, false, false, false, false, false, OUTLOG_RING, false },
+	{ "console+log -c -d", false, false, false, false, true, true, false, OUTLOG_QUEUE, false },
+	{ "console+log -k", false, false, false, false, false, false, false, OUTLOG_QUEUE, true },
+	{ "-b+log", true, false, false, false, false, false, false, OUTLOG_QUEUE, false },
+	{ "-b -r -f+log", true, true, true, false, false, false, false, OUTLOG_QUEUE, false },
+};
+
+// A line of boot output, cut into reads as the pipe hands them over.
+static const char text[] =
+    "[    1.234567] \x1b[32m[  OK  ]\x1b[m Started Journal Service.\r\n"
+    "[    1.234890] eth0: link becomes ready\r\n"
+    "[    1.234890] eth0: link becomes ready\r\n"
+    "Loading 42%\rLoading 43%\r\n";
+
+static double
+run(pathfn fn, benchpath::ctx &x) {
+	const size_t tlen = sizeof(text) - 1;
+	size_t at = 0;
+
+	auto t0 = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < BENCH_BUFFERS; i++) {
+		auto abuf = new abuffer();
+		DWORD n = (i % 3 == 0) ? 17 : ABUFFER_SIZE;
+
+		for (DWORD j = 0; j < n; j++) {
+			abuf->add(text[at]);
+			at = at + 1 == tlen ? 0 : at + 1;
+		}
+		if (fn(x, abuf) != WAITER_SUCCESS)
+			abort();
+	}
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / BENCH_BUFFERS;
+}
+
+static bool
+same(const out &a, const out &b) {
+	return a.bytes == b.bytes && a.sum == b.sum;
+}
+
+int
+main(void) {
+	bool ok = true;
+
+	printf("%-20s %10s %10s %8s\n", "session", "generic", "picked", "");
+	for (const session &s : sessions) {
+		optSback = s.sback;
+		optRec = s.rec;
+		optTee = s.tee;
+		optFlow = s.flow;
+		optDrop = s.drop;
+		optLog = s.log;
+		optIndex = s.index;
+
+		bool raw = s.sback || s.rec || s.tee || s.flow;
+		pathfn fns[2] = { outpath<benchpath, benchpath::raw_all, benchpath::clean_any, benchpath::log_any, benchpath::index_any>,
+			outpaths<benchpath>::pick(raw, s.filter || s.dedup, s.log, s.index) };
+		double best[2] = { 1e9, 1e9 };
+		benchpath::ctx x[2];
+
+		// Alternate so drift hurts both alike; keep the best of each.
+		for (int r = 0; r < BENCH_ROUNDS; r++) {
+			for (int k = 0; k < 2; k++) {
+				optFilter = s.filter ? new ansifilter() : NULL;
+				optDedup = s.dedup ? new linededup() : NULL;
+				x[k] = benchpath::ctx();
+				double ns = run(fns[k], x[k]);
+				if (ns < best[k])
+					best[k] = ns;
+				delete optFilter;
+				delete optDedup;
+			}
+		}
+
+		bool good = same(x[0].con, x[1].con) && same(x[0].sback, x[1].sback) && same(x[0].rec, x[1].rec) &&
+		    same(x[0].tee, x[1].tee) && same(x[0].flow, x[1].flow) && same(x[0].log, x[1].log) &&
+		    same(x[0].idx, x[1].idx) && x[0].con.bytes != 0 && (s.log == OUTLOG_NONE) == (x[0].log.bytes == 0) &&
+		    s.index == (x[0].idx.bytes != 0);
+		printf("%-20s %7.1f ns %7.1f ns %7.0f%%%s\n", s.name, best[0], best[1],
+		    100 * (best[0] - best[1]) / best[0], good ? "" : "  FAIL: outputs differ");
+		ok &= good;
+	}
+	printf("ns per %u-byte buffer (a third of reads short), best of %d; %% is the time saved\n", ABUFFER_SIZE,
+	    BENCH_ROUNDS);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+// sbcheck.cpp : the -b scrollback (cus/scrollback.h) against a plain string.
+//
+// Random console output (short, empty, CRLF and very long lines) goes
+// into a 1 MB scrollback in pieces of random size, and every so often
+// line(), linesafter(), findprev() and findnext() are checked, at random
+// places, against the same done by scanning all the output as one string.
+// Then a flood of empty lines, which costs the line index the most,
+// must keep the scrollback's memory within -b, as ordinary text does.
+// The exit status is non-zero if anything failed.
+
+#include "scrollback.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+
+#define SB_MB 1
+#define SB_CAP (SB_MB * 1024 * 1024)
+#define SB_TOTAL (6 * 1024 * 1024)
+#define SB_FLOOD (16 * 1024 * 1024)
+
+static std::mt19937_64 rng(1);
+static unsigned nbad;
+
+static unsigned
+rnd(unsigned n) {
+	return (unsigned)(rng() % n);
+}
+
+static void
+bad(const char *what, unsigned long long at) {
+	if (nbad++ < 10)
+		printf("  %s at %llu\n", what, at);
+}
+
+// The reference: all the output, and what scrollback keeps of it.
+struct naive {
+	std::string all;
+	unsigned long long begin;
+
+	// start of the line containing off, as cus sees it
+	unsigned long long lineat(unsigned long long off) {
+		while (off > begin && all[off - 1] != '\n')
+			off--;
+		return off;
+	}
+	unsigned long long nextline(unsigned long long s) {
+		size_t nl = all.find('\n', s);
+
+		return nl == std::string::npos ? all.size() : nl + 1;
+	}
+	bool match(unsigned long long s, const std::string &pat) {
+		unsigned long long e = nextline(s);
+
+		return all.substr(s, e - s).find(pat) != std::string::npos;
+	}
+};
+
+static std::string
+make_line(void) {
+	static const char *words[] = { "eth0:", "link", "up", "error", "panic", "ok", "[", "]", "\x1b[32m" };
+	std::string l;
+	unsigned r = rnd(100);
+
+	if (r < 10)
+		return "\n";
+	if (r == 10)
+		return std::string(70000 + rnd(100000), 'x') + " long\n";
+	for (unsigned n = rnd(12); n != 0; n--) {
+		l += words[rnd(sizeof(words) / sizeof(words[0]))];
+		l += std::to_string(rnd(1000));
+		l += ' ';
+	}
+	l += r < 30 ? "\r\n" : "\n";
+	return l;
+}
+
+static void
+check(scrollback &sb, naive &nv) {
+	unsigned long long b = sb.begin(), t = sb.end();
+	std::string got;
+
+	nv.begin = b;
+	if (t != nv.all.size())
+		bad("end", t);
+	for (unsigned i = 0; i < 20; i++) {
+		unsigned long long off = b + rng() % (t - b + 1);
+		unsigned long long s = nv.lineat(off), e = nv.nextline(s), found = 0;
+		std::string want = nv.all.substr(s, e - s), pat;
+		size_t after = 0;
+		bool f;
+
+		while (!want.empty() && (want.back() == '\n' || want.back() == '\r'))
+			want.pop_back();
+		sb.line(off, got);
+		if (got != want)
+			bad("line", off);
+		after = std::count(nv.all.begin() + s, nv.all.end(), '\n');
+		if (sb.linesafter(off) != after)
+			bad("linesafter", off);
+
+		pat = want.size() > 4 ? want.substr(rnd((unsigned)want.size() - 4), 1 + rnd(4)) : "panic";
+		f = sb.findprev(pat, off, &found);
+		{
+			unsigned long long q = off > b ? nv.lineat(off - 1) : b;
+			bool nf = false;
+
+			while (off > b) {
+				if ((nf = nv.match(q, pat)))
+					break;
+				if (q == b)
+					break;
+				q = nv.lineat(q - 1);
+			}
+			if (f != nf || (f && found != q))
+				bad("findprev", off);
+		}
+		f = sb.findnext(pat, off, &found);
+		{
+			unsigned long long q = nv.nextline(off);
+			bool nf = false;
+
+			for (; q < t; q = nv.nextline(q)) {
+				if ((nf = nv.match(q, pat)))
+					break;
+			}
+			if (f != nf || (f && found != q))
+				bad("findnext", off);
+		}
+	}
+}
+
+// Output in random pieces, checked as it goes.
+static bool
+random_text(void) {
+	scrollback sb(SB_MB);
+	naive nv;
+	std::string out;
+	unsigned long long peak = 0;
+	unsigned checks = 0;
+
+	while (nv.all.size() < SB_TOTAL) {
+		while (out.size() < 100000)
+			out += make_line();
+		size_t n = 1 + rnd(out.size() < 9000 ? (unsigned)out.size() : 9000);
+
+		sb.append((const __int8 *)out.data(), n);
+		nv.all.append(out, 0, n);
+		out.erase(0, n);
+		peak = std::max(peak, sb.memory());
+		if (rnd(20) == 0) {
+			check(sb, nv);
+			checks++;
+		}
+	}
+	check(sb, nv);
+	printf("text:  %.1f MB kept of %.1f MB, %u checks, peak memory %.2f MB\n", (sb.end() - sb.begin()) / 1048576.0,
+		nv.all.size() / 1048576.0, checks + 1, peak / 1048576.0);
+	return nbad == 0 && peak <= SB_CAP;
+}
+
+// Empty lines, the most index per byte.
+static bool
+flood(void) {
+	scrollback sb(SB_MB);
+	std::string nl(4096, '\n'), got;
+	unsigned long long peak = 0, s;
+	bool ok;
+
+	for (unsigned long long n = 0; n < SB_FLOOD; n += nl.size()) {
+		sb.append((const __int8 *)nl.data(), nl.size());
+		peak = std::max(peak, sb.memory());
+	}
+	sb.append((const __int8 *)"the end\n", 8);
+	ok = peak <= SB_CAP && sb.findprev("end", sb.end(), &s) && s == sb.end() - 8 &&
+		sb.linesafter(sb.begin()) == sb.end() - sb.begin() - 7;
+	sb.line(s, got);
+	ok &= got == "the end";
+	printf("flood: %.1f MB kept of %.1f MB of empty lines, peak memory %.2f MB, %s\n",
+		(sb.end() - sb.begin()) / 1048576.0, sb.end() / 1048576.0, peak / 1048576.0, ok ? "ok" : "FAIL");
+	return ok;
+}
+
+int
+main(void) {
+	bool ok = random_text();
+
+	ok &= flood();
+	printf("%s\n", ok ? "ok" : "FAIL");
+	return ok ? 0 : 1;
+}
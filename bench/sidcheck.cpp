@@ -0,0 +1,164 @@
+// sidcheck.cpp : the -i name cache and JSON (cus/sidcache.h).
+//
+// A fake sidresolver counts its calls per SID and takes a while over
+// each, so lookups pile up on it. Many threads look up the same SIDs at
+// once, and each SID must still be resolved exactly once, with every
+// lookup counted as a hit or a miss. A failed lookup must be cached like
+// any other. pipeacl_json must escape backslashes, quotes and control
+// characters in pipe, account and domain names. The exit status is
+// non-zero if anything failed.
+
+#include "sidcache.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#define NSIDS 50
+#define NTHREADS 16
+#define ERROR_NONE_MAPPED 1332
+
+class fakeresolver : public sidresolver {
+public:
+	std::mutex lock;
+	std::map<std::string, unsigned> calls;
+
+	sidname resolve(const std::string &sid) {
+		{
+			std::lock_guard<std::mutex> g(lock);
+
+			calls[sid]++;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		if (sid[0] == 'F')
+			return sidname{ false, ERROR_NONE_MAPPED, L"S-1-5-21-" + name(sid) };
+		return sidname{ true, 0, L"DOM\\" + name(sid) };
+	}
+	static std::wstring name(const std::string &sid) { return std::wstring(sid.begin(), sid.end()); }
+};
+
+static bool ok = true;
+
+static void
+check(bool cond, const char *what) {
+	if (!cond) {
+		printf("  %s\n", what);
+		ok = false;
+	}
+}
+
+static std::string
+narrow(const std::wstring &w) {
+	return std::string(w.begin(), w.end());
+}
+
+static void
+concurrent(void) {
+	fakeresolver r;
+	sidcache cache(&r);
+	std::vector<std::thread> threads;
+	std::atomic<unsigned> wrong(0);
+	bool once = true;
+
+	for (unsigned t = 0; t < NTHREADS; t++) {
+		threads.emplace_back([&, t] {
+			std::vector<unsigned> order;
+			std::mt19937 rng(t);
+
+			for (unsigned i = 0; i < NSIDS; i++)
+				order.push_back(i);
+			std::shuffle(order.begin(), order.end(), rng);
+			for (unsigned i : order) {
+				std::string sid = (i % 10 == 9 ? "F" : "S") + std::to_string(i);
+				sidname n = cache.lookup(sid);
+
+				if (n.ok != (sid[0] == 'S') || n.name.compare(n.name.size() - sid.size(), sid.size(),
+				    fakeresolver::name(sid)) != 0)
+					wrong++;
+			}
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+	for (auto &c : r.calls)
+		once &= c.second == 1;
+	printf("concurrent: %zu SIDs resolved, %lu hits, %lu misses\n", r.calls.size(), cache.hits(), cache.misses());
+	check(r.calls.size() == NSIDS && once, "a SID resolved more than once");
+	check(cache.misses() == NSIDS && cache.hits() == (NTHREADS - 1) * NSIDS, "wrong hit and miss counts");
+	check(wrong == 0, "a lookup got the wrong name");
+}
+
+static void
+failures(void) {
+	fakeresolver r;
+	sidcache cache(&r);
+	sidname a = cache.lookup("F1"), b = cache.lookup("F1");
+
+	printf("failures: %u resolves, %lu hits, %lu misses\n", r.calls["F1"], cache.hits(), cache.misses());
+	check(!a.ok && a.error == ERROR_NONE_MAPPED && a.name == L"S-1-5-21-F1", "failure not reported");
+	check(!b.ok && b.error == a.error && b.name == a.name, "failure not cached as it was");
+	check(r.calls["F1"] == 1 && cache.hits() == 1 && cache.misses() == 1, "failure resolved again");
+}
+
+// Names with the characters JSON needs escaped.
+class quoteresolver : public sidresolver {
+public:
+	sidname resolve(const std::string &sid) {
+		if (sid == "O")
+			return sidname{ true, 0, L"BUILTIN\\Administrators" };
+		if (sid == "G")
+			return sidname{ true, 0, L"DOM\"AIN\\us\"er\x01" };
+		return sidname{ false, ERROR_NONE_MAPPED, L"S-1-5-21-1" };
+	}
+};
+
+static void
+json(void) {
+	quoteresolver r;
+	sidcache cache(&r);
+	pipeacl acl;
+	std::wstring got;
+	unsigned good = 0;
+	static const wchar_t *want[] = {
+		LR"({"pipe":"\\\\.\\pipe\\a\"b","owner":"BUILTIN\\Administrators","group":"DOM\"AIN\\us\"er\u0001",)"
+		LR"("revision":2,"dacl":[{"type":0,"flags":0,"access":"allowed","mask":3,"rights":["read","write"],)"
+		LR"("sid":"DOM\"AIN\\us\"er\u0001"},{"type":1,"flags":3,"access":"denied","mask":65536,)"
+		LR"("rights":["delete"],"sid":"S-1-5-21-1"},{"type":9,"flags":2}]})",
+		LR"({"pipe":"\\\\.\\pipe\\a\"b","owner":"BUILTIN\\Administrators","group":"DOM\"AIN\\us\"er\u0001",)"
+		LR"("dacl":null})",
+		LR"({"pipe":"\\\\.\\pipe\\a\"b","error":5})",
+	};
+
+	acl.pipe = L"\\\\.\\pipe\\a\"b";
+	acl.error = 0;
+	acl.owner = "O";
+	acl.group = "G";
+	acl.hasdacl = true;
+	acl.revision = 2;
+	acl.dacl.push_back(aceinfo{ ACE_TYPE_ALLOWED, 0, 3, "G" });
+	acl.dacl.push_back(aceinfo{ ACE_TYPE_DENIED, 3, 0x10000, "X" });
+	acl.dacl.push_back(aceinfo{ 9, 2, 0, "" });
+	for (unsigned i = 0; i < 3; i++) {
+		if (i == 1)
+			acl.hasdacl = false;
+		if (i == 2)
+			acl.error = 5;
+		got = pipeacl_json(acl, cache);
+		if (got != want[i])
+			printf("  got  %s\n  want %s\n", narrow(got).c_str(), narrow(want[i]).c_str());
+		good += got == want[i];
+	}
+	printf("json: %u of 3 as expected\n", good);
+	check(good == 3, "JSON not as expected");
+}
+
+int
+main(void) {
+	concurrent();
+	failures();
+	json();
+	printf("%s\n", ok ? "ok" : "FAIL");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,333 @@
+// simio.h : simulated Win32 file I/O, for running cus's overlapped
+// writer (asyncout.h) on Linux, deterministically.
+//
+// A HANDLE is a simfile or a simevent. Each WriteFile takes its outcome
+// from the file's script (sync, short, pending, error) and, once that
+// runs out, from a seeded generator weighted by the file's mix.
+// Pending writes complete on a virtual clock: sim_wait() jumps to the
+// next completion, copies the data into the file at the write's offset
+// (so a buffer freed or changed while in flight shows up as wrong
+// contents), and signals the OVERLAPPED's event, as Windows would.
+// Every byte's write count is kept, so gaps and overlaps are caught as
+// well as wrong bytes. Misuse that Windows would punish (a second write
+// on a busy OVERLAPPED) fails the run, and a caller that goes past
+// sim.limit calls throws simstuck, to get out of a loop that makes no
+// progress. WaitForSingleObject and GetTickCount64 run on the same
+// clock. A write with no OVERLAPPED, as to the console, goes at the
+// end of the file and can only be sync, short or fail.
+
+#pragma once
+
+#include "compat.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+typedef void *HANDLE;
+typedef uintptr_t ULONG_PTR;
+typedef unsigned long long ULONGLONG;
+
+struct OVERLAPPED {
+	ULONG_PTR Internal;		// status
+	ULONG_PTR InternalHigh;		// bytes transferred
+	DWORD Offset, OffsetHigh;
+	HANDLE hEvent;
+};
+
+union ULARGE_INTEGER {
+	struct {
+		DWORD LowPart, HighPart;
+	};
+	unsigned long long QuadPart;
+};
+
+#define ERROR_SUCCESS 0
+#define ERROR_BROKEN_PIPE 109
+#define ERROR_DISK_FULL 112
+#define ERROR_IO_INCOMPLETE 996
+#define ERROR_IO_PENDING 997
+#define SIM_STATUS_PENDING 0x103
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+
+enum simkind { SIM_SYNC, SIM_SHORT, SIM_PENDING, SIM_PENDING_SHORT, SIM_ERROR, SIM_PENDING_ERROR, SIM_NKINDS };
+
+struct simstep {
+	simkind kind;
+	unsigned long long ns;		// SIM_PENDING*: time to complete
+};
+
+struct simevent {
+	bool signaled;
+};
+
+struct simfile {
+	const char *name;
+	std::string data;
+	std::vector<unsigned char> nwrites;	// per byte
+	std::deque<simstep> script;
+	unsigned mix[SIM_NKINDS];		// weights once the script is done
+	unsigned long long latency;		// of pending writes, in ns
+	unsigned long long syncNs;		// what a synchronous write costs
+	DWORD error;				// for SIM_ERROR and SIM_PENDING_ERROR
+
+	explicit simfile(const char *n) : name(n), mix{ 1, 0, 0, 0, 0, 0 }, latency(100000), syncNs(2000), error(ERROR_DISK_FULL) {}
+};
+
+// A write in flight.
+struct simop {
+	simfile *f;
+	OVERLAPPED *ov;
+	const char *p;
+	DWORD len;
+	unsigned long long off, at;
+	DWORD error;
+};
+
+struct simworld {
+	unsigned long long now;		// virtual ns
+	unsigned long long rng;
+	unsigned long long calls;	// WriteFile and GetOverlappedResult
+	unsigned long long limit;	// on calls; 0 for none
+	std::vector<simop> inflight;
+	DWORD lastError;
+	std::string failure;		// the first thing that went wrong
+
+	void reset(unsigned long long seed) {
+		now = calls = limit = 0;
+		rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+		inflight.clear();
+		lastError = 0;
+		failure.clear();
+	}
+	unsigned long long next(void) {	// xorshift64*
+		rng ^= rng >> 12;
+		rng ^= rng << 25;
+		rng ^= rng >> 27;
+		return rng * 0x2545f4914f6cdd1dULL;
+	}
+};
+
+inline simworld sim;
+
+struct simstuck {};
+
+static inline void
+sim_call(void) {
+	if (++sim.calls > sim.limit && sim.limit != 0)
+		throw simstuck();
+}
+
+static inline void
+sim_fail(const char *fmt, ...) {
+	char buf[256];
+	va_list ap;
+
+	if (!sim.failure.empty())
+		return;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	sim.failure = buf;
+}
+
+static inline void
+sim_store(simfile *f, unsigned long long off, const char *p, DWORD n) {
+	if (f->data.size() < off + n) {
+		f->data.resize(off + n);
+		f->nwrites.resize(off + n);
+	}
+	memcpy(&f->data[off], p, n);
+	for (DWORD i = 0; i < n; i++)
+		f->nwrites[off + i]++;
+}
+
+static inline void
+sim_finish(OVERLAPPED *ov, DWORD error, DWORD n) {
+	if (ov == NULL)
+		return;
+	ov->Internal = error;
+	ov->InternalHigh = n;
+	if (ov->hEvent != NULL)
+		((simevent *)ov->hEvent)->signaled = true;
+}
+
+static inline simstep
+sim_outcome(simfile *f) {
+	simstep s;
+	unsigned total = 0, r;
+
+	if (!f->script.empty()) {
+		s = f->script.front();
+		f->script.pop_front();
+		return s;
+	}
+	for (unsigned k = 0; k < SIM_NKINDS; k++)
+		total += f->mix[k];
+	r = (unsigned)(sim.next() % total);
+	for (unsigned k = 0; k < SIM_NKINDS; k++) {
+		if (r < f->mix[k]) {
+			s.kind = (simkind)k;
+			break;
+		}
+		r -= f->mix[k];
+	}
+	// pending writes finish between half and one and a half latencies
+	s.ns = f->latency / 2 + sim.next() % (f->latency + 1);
+	return s;
+}
+
+static inline DWORD
+GetLastError(void) {
+	return sim.lastError;
+}
+
+static inline void
+SetLastError(DWORD e) {
+	sim.lastError = e;
+}
+
+static inline BOOL
+ResetEvent(HANDLE h) {
+	((simevent *)h)->signaled = false;
+	return TRUE;
+}
+
+static inline BOOL
+SetEvent(HANDLE h) {
+	((simevent *)h)->signaled = true;
+	return TRUE;
+}
+
+static inline BOOL
+WriteFile(HANDLE h, const void *buf, DWORD n, DWORD *nlen, OVERLAPPED *ov) {
+	simfile *f = (simfile *)h;
+	unsigned long long off = ov != NULL ? (unsigned long long)ov->OffsetHigh << 32 | ov->Offset : f->data.size();
+	simstep s;
+	DWORD k;
+
+	sim_call();
+	*nlen = 0;
+	for (const simop &op : sim.inflight) {
+		if (ov != NULL && op.ov == ov) {
+			sim_fail("%s: WriteFile on an OVERLAPPED with a write in flight", f->name);
+			SetLastError(ERROR_IO_PENDING);
+			return FALSE;
+		}
+	}
+	if (ov != NULL && ov->hEvent != NULL)
+		ResetEvent(ov->hEvent);
+	s = sim_outcome(f);
+	if (ov == NULL && s.kind != SIM_SYNC && s.kind != SIM_SHORT && s.kind != SIM_ERROR) {
+		sim_fail("%s: pending write with no OVERLAPPED", f->name);
+		SetLastError(f->error);
+		return FALSE;
+	}
+	k = n;
+	if ((s.kind == SIM_SHORT || s.kind == SIM_PENDING_SHORT) && n > 1)
+		k = 1 + (DWORD)(sim.next() % (n - 1));
+
+	switch (s.kind) {
+	case SIM_SYNC:
+	case SIM_SHORT:
+		sim_store(f, off, (const char *)buf, k);
+		sim_finish(ov, ERROR_SUCCESS, k);
+		sim.now += f->syncNs;
+		*nlen = k;
+		return TRUE;
+	case SIM_PENDING:
+	case SIM_PENDING_SHORT:
+	case SIM_PENDING_ERROR:
+		ov->Internal = SIM_STATUS_PENDING;
+		sim.inflight.push_back(simop{ f, ov, (const char *)buf, k, off, sim.now + s.ns,
+			s.kind == SIM_PENDING_ERROR ? f->error : ERROR_SUCCESS });
+		SetLastError(ERROR_IO_PENDING);
+		return FALSE;
+	default:
+		SetLastError(f->error);
+		return FALSE;
+	}
+}
+
+// Complete in-flight write i: its bytes land now.
+static inline void
+sim_complete(size_t i) {
+	simop op = sim.inflight[i];
+
+	sim.inflight.erase(sim.inflight.begin() + i);
+	if (op.at > sim.now)
+		sim.now = op.at;
+	if (op.error == ERROR_SUCCESS)
+		sim_store(op.f, op.off, op.p, op.len);
+	sim_finish(op.ov, op.error, op.error == ERROR_SUCCESS ? op.len : 0);
+}
+
+// The time of the next completion, or ~0 if nothing is in flight.
+static inline unsigned long long
+sim_next(void) {
+	unsigned long long t = ~0ULL;
+
+	for (const simop &op : sim.inflight)
+		if (op.at < t)
+			t = op.at;
+	return t;
+}
+
+// Move the clock to the next completion and complete it.
+static inline bool
+sim_wait(void) {
+	size_t best = 0;
+
+	if (sim.inflight.empty())
+		return false;
+	for (size_t i = 1; i < sim.inflight.size(); i++)
+		if (sim.inflight[i].at < sim.inflight[best].at)
+			best = i;
+	sim_complete(best);
+	return true;
+}
+
+static inline BOOL
+GetOverlappedResult(HANDLE h, OVERLAPPED *ov, DWORD *nlen, BOOL wait) {
+	sim_call();
+	for (size_t i = 0; i < sim.inflight.size(); i++) {
+		if (sim.inflight[i].ov != ov)
+			continue;
+		if (!wait) {
+			SetLastError(ERROR_IO_INCOMPLETE);
+			return FALSE;
+		}
+		sim_complete(i);
+		break;
+	}
+	*nlen = (DWORD)ov->InternalHigh;
+	if (ov->Internal != ERROR_SUCCESS) {
+		SetLastError((DWORD)ov->Internal);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static inline ULONGLONG
+GetTickCount64(void) {
+	return sim.now / 1000000;
+}
+
+// Complete writes in time order until h is signalled or ms have gone.
+static inline DWORD
+WaitForSingleObject(HANDLE h, DWORD ms) {
+	unsigned long long deadline = sim.now + (unsigned long long)ms * 1000000;
+
+	while (!((simevent *)h)->signaled) {
+		if (sim_next() > deadline) {
+			sim.now = deadline;
+			return WAIT_TIMEOUT;
+		}
+		sim_wait();
+	}
+	return WAIT_OBJECT_0;
+}
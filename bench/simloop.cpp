@@ -0,0 +1,264 @@
+// simloop.cpp : cus's output path run against simulated I/O (simio.h).
+//
+// Guest output arrives ABUFFER_SIZE at a time, as cus reads it. Each
+// buffer is written from the abuffer to a simulated console, whose
+// writes are synchronous and may be short, as cus's WriteFileAll()
+// does, and then queued for the log with start_async_out(). The loop then waits for whichever comes first,
+// the next log completion or the next input, and hands completions to
+// handle_async_out(), as cus's event loop does. A bounded queue stops
+// the reads until it is half empty (-q). The session runs until the
+// log has caught up, or in the exit scenarios it ends (~.) as soon as
+// the input does, with writes still in flight. Then drain_log()
+// finishes the log.
+//
+// Each scenario sets how the log's writes turn out and runs with
+// several seeds. A run passes if the log and the console hold exactly
+// the output, every byte written once. In the error scenarios it
+// passes if the error surfaces, nothing hangs, and what did reach the
+// log is a clean prefix of the output.
+//
+// For each scenario we report the simulated time, MB and writer calls
+// per simulated second, and the real ns per call. So a change that
+// costs more calls or more CPU per byte shows up, as well as a wrong
+// byte. The exit status is non-zero if any run failed.
+
+#include "simio.h"
+#include "asyncout.h"
+
+#include <chrono>
+#include <cstdlib>
+
+#define SIM_BYTES (4 * 1024 * 1024)
+#define SIM_SEEDS 8
+
+struct scenario {
+	const char *name;
+	unsigned mix[SIM_NKINDS];	// sync, short, pending, pending short, error, pending error
+	unsigned long long latency;	// ns
+	unsigned long long rate;	// guest output in bytes/s; 0 for a flood
+	size_t queue;			// in abuffers; 0 for no limit
+	bool failing;			// an error is expected
+	bool exit;			// the session ends with the input
+	bool drainFails;		// every write after the session ends fails
+};
+
+static const scenario scenarios[] = {
+	{ "sync", { 1, 0, 0, 0, 0, 0 }, 100000, 0, 0, false, false, false },
+	{ "short", { 1, 3, 0, 0, 0, 0 }, 100000, 0, 0, false, false, false },
+	{ "pending", { 0, 0, 1, 0, 0, 0 }, 50000, 0, 0, false, false, false },
+	{ "pend-short", { 0, 0, 1, 3, 0, 0 }, 50000, 0, 0, false, false, false },
+	{ "mixed", { 4, 2, 4, 2, 0, 0 }, 100000, 0, 0, false, false, false },
+	{ "paced", { 4, 2, 4, 2, 0, 0 }, 100000, 2000000, 0, false, false, false },
+	{ "stall", { 64, 0, 1, 0, 0, 0 }, 20000000, 20000000, 1024, false, false, false },
+	{ "exit", { 1, 1, 4, 4, 0, 0 }, 1000000, 0, 0, false, true, false },
+	{ "error", { 400, 100, 400, 100, 1, 0 }, 100000, 0, 0, true, false, false },
+	{ "async-err", { 400, 100, 400, 100, 0, 1 }, 100000, 0, 0, true, false, false },
+	{ "drain-err", { 0, 0, 1, 0, 0, 0 }, 1000000, 0, 0, true, true, true },
+};
+
+struct result {
+	bool ok;
+	bool errored;			// the error surfaced
+	unsigned long long ns;		// simulated
+	unsigned long long calls;
+	double wallns;
+};
+
+// When byte off of the output arrives.
+static unsigned long long
+arrival(const scenario &sc, size_t off) {
+	return sc.rate == 0 ? 0 : (unsigned long long)((double)off * 1e9 / sc.rate);
+}
+
+// f holds nothing but a prefix of want, each byte written once.
+static bool
+clean_prefix(const simfile &f, const std::string &want, bool whole) {
+	if (whole && f.data.size() != want.size())
+		return false;
+	if (f.data.size() > want.size() || memcmp(f.data.data(), want.data(), f.data.size()) != 0)
+		return false;
+	for (unsigned char n : f.nwrites)
+		if (n != 1)
+			return false;
+	return true;
+}
+
+static unsigned long long conCalls;
+static double conWall;
+
+// As cus writes the console: synchronous, looping over short writes.
+// Its calls and time aren't the log writer's, so they aren't counted.
+static BOOL
+con_write(simfile *con, const __int8 *p, DWORD n) {
+	unsigned long long calls = sim.calls;
+	auto t0 = std::chrono::steady_clock::now();
+	DWORD nlen;
+
+	while (n != 0) {
+		if (!WriteFile(con, p, n, &nlen, NULL))
+			break;
+		p += nlen;
+		n -= nlen;
+	}
+	conCalls += sim.calls - calls;
+	conWall += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+	return n == 0;
+}
+
+static void
+check(const scenario &sc, result &r, const simfile &log, const simfile &con, const std::string &want) {
+	if (!sim.failure.empty()) {
+		printf("  %s: %s\n", sc.name, sim.failure.c_str());
+		r.ok = false;
+		return;
+	}
+	if (!clean_prefix(con, want, true)) {
+		printf("  %s: console output differs\n", sc.name);
+		r.ok = false;
+	}
+	if (!clean_prefix(log, want, !sc.failing)) {
+		size_t i = 0;
+
+		while (i < log.data.size() && i < want.size() && log.data[i] == want[i] && log.nwrites[i] == 1)
+			i++;
+		printf("  %s: log differs from byte %zu (log %zu bytes, output %zu)\n", sc.name, i,
+		    log.data.size(), want.size());
+		r.ok = false;
+	}
+	if (sc.failing && !r.errored) {
+		printf("  %s: no error surfaced\n", sc.name);
+		r.ok = false;
+	}
+}
+
+static result
+run(const scenario &sc, unsigned seed) {
+	simfile log("log"), con("console");
+	simevent ev = { false };
+	OVERLAPPED ov;
+	bufferqueue q(sc.queue);
+	std::string want(SIM_BYTES, 0);
+	DWORD ret = WAITER_SUCCESS;
+	size_t sent = 0;
+	bool paused = false;
+	result r = { true, false, 0, 0, 0 };
+
+	sim.reset(seed);
+	conCalls = 0;
+	conWall = 0;
+	sim.limit = 64ULL * SIM_BYTES;
+	for (size_t i = 0; i < want.size(); i++)
+		want[i] = (char)(sim.next() >> 56);
+	memcpy(log.mix, sc.mix, sizeof(log.mix));
+	log.latency = sc.latency;
+	con.mix[SIM_SHORT] = 1;
+	con.syncNs = 0;		// the log's timing is what's measured
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = &ev;
+
+	auto t0 = std::chrono::steady_clock::now();
+	try {
+		for (;;) {
+			// what has arrived, unless the log's queue is full
+			while (sent < want.size() && !(paused = q.blocked(paused)) && arrival(sc, sent) <= sim.now) {
+				auto abuf = new abuffer();
+				DWORD n = want.size() - sent < ABUFFER_SIZE ? (DWORD)(want.size() - sent) : ABUFFER_SIZE;
+
+				memcpy(abuf->getptr(), want.data() + sent, n);
+				abuf->size(n);
+				sent += n;
+				if (!con_write(&con, abuf->getptr(), n)) {
+					sim_fail("console write failed");
+					delete abuf;
+					break;
+				}
+				if ((ret = start_async_out(&log, &ov, &q, abuf)) != WAITER_SUCCESS)
+					break;
+			}
+			if (ret != WAITER_SUCCESS || (sent == want.size() && (sc.exit || q.empty())))
+				break;
+
+			if (ev.signaled) {
+				if ((ret = handle_async_out(&log, &ov, &q)) != WAITER_SUCCESS)
+					break;
+				continue;
+			}
+			unsigned long long in = paused || sent == want.size() ? ~0ULL : arrival(sc, sent);
+
+			if (sim_next() == ~0ULL && in == ~0ULL) {
+				sim_fail("stuck with %zu buffers queued and nothing in flight", q.size());
+				break;
+			}
+			if (in < sim_next())
+				sim.now = in;
+			else
+				sim_wait();
+		}
+		if (ret != WAITER_SUCCESS)
+			r.errored = true;
+		else {
+			// the session ends; the rest of the log goes out
+			if (sc.drainFails) {
+				memset(log.mix, 0, sizeof(log.mix));
+				log.mix[SIM_ERROR] = 1;
+				r.errored = !q.empty();
+			}
+			drain_log(&log, &ov, &q);
+			if (!q.empty() && !sc.drainFails)
+				sim_fail("drain_log left %zu buffers", q.size());
+		}
+	} catch (simstuck &) {
+		sim_fail("no progress after %llu calls", sim.calls);
+	}
+	r.wallns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() - conWall;
+	r.ns = sim.now;
+	r.calls = sim.calls - conCalls;
+
+	while (!q.empty()) {
+		delete q.front();
+		q.pop();
+	}
+	if (sc.failing) {
+		// only what was sent can have reached the log
+		want.resize(sent);
+	}
+	check(sc, r, log, con, want);
+	return r;
+}
+
+int
+main(int argc, char *argv[]) {
+	unsigned seeds = SIM_SEEDS;
+	bool failed = false;
+
+	if (argc > 1)
+		seeds = (unsigned)strtoul(argv[1], NULL, 0);
+	if (seeds == 0) {
+		fprintf(stderr, "usage: %s [seeds]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-12s %-6s %10s %10s %12s %8s\n", "scenario", "result", "sim ms", "MB/sim-s", "calls/sim-s", "ns/call");
+	for (const scenario &sc : scenarios) {
+		unsigned long long ns = 0, calls = 0;
+		double wall = 0;
+		unsigned bad = 0;
+
+		for (unsigned seed = 1; seed <= seeds; seed++) {
+			result r = run(sc, seed);
+
+			if (!r.ok) {
+				printf("  %s: seed %u failed\n", sc.name, seed);
+				bad++;
+			}
+			ns += r.ns;
+			calls += r.calls;
+			wall += r.wallns;
+		}
+		failed |= bad != 0;
+		printf("%-12s %-6s %10.1f %10.1f %12.0f %8.1f\n", sc.name, bad == 0 ? "ok" : "FAIL",
+		    ns / 1e6 / seeds, ns != 0 ? SIM_BYTES * (double)seeds / 1e6 / (ns / 1e9) : 0.0,
+		    ns != 0 ? calls / (ns / 1e9) : 0.0, calls != 0 ? wall / calls : 0.0);
+	}
+	return failed ? 1 : 0;
+}
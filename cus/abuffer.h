@@ -0,0 +1,94 @@
+// abuffer.h : the fixed-size I/O buffer and the queue of them that
+// every data path in cus is built from.
+
+#pragma once
+
+#include "compat.h"
+#include <queue>
+#include <stddef.h>
+#include <string.h>
+
+#define ABUFFER_SIZE 64
+
+struct abuffer {
+private:
+	DWORD len;
+	__int8 buf[ABUFFER_SIZE];
+	__int8 *ptr;
+public:
+	abuffer();
+	void advance(DWORD);
+	void add(__int8);
+	bool full() { return len == ABUFFER_SIZE; }
+	bool empty() { return len == 0; }
+	DWORD size() { return len; }
+	void size(DWORD n) { len = n; }
+	__int8 *getptr() { return ptr; }
+	__int8 at(DWORD i) { return buf[i]; }
+};
+
+inline
+abuffer::abuffer() {
+	len = 0;
+	ptr = &buf[0];
+}
+
+inline void
+abuffer::advance(DWORD n) {
+	len -= n;
+	ptr += n;
+}
+
+inline void
+abuffer::add(__int8 c) {
+	buf[len++] = c;
+}
+
+// Copy a run of bytes into new buffers, ABUFFER_SIZE at a time, and hand
+// each to put(), which takes it over. Stops at the first put() that
+// doesn't return 0 (WAITER_SUCCESS) and returns what it did.
+template <class F>
+DWORD
+abuffer_split(const __int8 *p, DWORD len, F put) {
+	for (DWORD off = 0; off < len;) {
+		auto abuf = new abuffer();
+		DWORD n = len - off < ABUFFER_SIZE ? len - off : ABUFFER_SIZE;
+		DWORD ret;
+
+		memcpy(abuf->getptr(), p + off, n);
+		abuf->size(n);
+		off += n;
+		if ((ret = put(abuf)) != 0)
+			return ret;
+	}
+	return 0;
+}
+
+// The buffers waiting for one async writer. A limit (in buffers; 0 for
+// none) bounds its memory: producers check full() before adding and
+// either stop or drop, and blocked() tells a stopped producer when to
+// start again (at half full). Occupancy is counted in whole buffers,
+// since that is the memory.
+class bufferqueue : public std::queue<abuffer *> {
+private:
+	size_t max;
+	size_t hiwater;
+	unsigned long long ndropped;
+public:
+	explicit bufferqueue(size_t limit = 0) : max(limit), hiwater(0), ndropped(0) {}
+	void push(abuffer *b);
+	abuffer *at(size_t i) { return c[i]; }	// from the front, for gathered writes
+	size_t limit() { return max; }
+	size_t peak() { return hiwater; }
+	bool full() { return max != 0 && size() >= max; }
+	bool blocked(bool stopped) { return max != 0 && (stopped ? size() > max / 2 : size() >= max); }
+	void dropped(DWORD n) { ndropped += n; }
+	unsigned long long dropped() { return ndropped; }
+};
+
+inline void
+bufferqueue::push(abuffer *b) {
+	std::queue<abuffer *>::push(b);
+	if (size() > hiwater)
+		hiwater = size();
+}
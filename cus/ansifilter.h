@@ -0,0 +1,233 @@
+// ansifilter.h : strip terminal escapes and carriage-return redraws.
+//
+// Used for clean logs (-c): CSI and OSC/DCS-style sequences are dropped
+// and a bare \r moves back to the start of the line, so a progress bar
+// redrawn a thousand times ends up as its final state. Lines are held
+// until their newline (or ANSIFILTER_LINEMAX bytes) so the overwrites
+// can be applied. Parser state carries across calls, so sequences may
+// be split between abuffers.
+
+#pragma once
+
+#include "compat.h"
+#include "simd.h"
+#include <string>
+
+#define ANSIFILTER_LINEMAX 65536
+
+#define ANSI_BEL	0x07
+#define ANSI_BS		0x08
+#define ANSI_LF		0x0a
+#define ANSI_CR		0x0d
+#define ANSI_ESC	0x1b
+
+// Offset of the first byte the filter has to look at (ESC, CR, LF, BS
+// or BEL), or n if the whole run can be copied as is.
+static inline size_t
+ansi_scan(const unsigned char *p, size_t n) {
+	size_t i = 0;
+
+#ifdef CUS_SSE2
+	const __m128i esc = _mm_set1_epi8(ANSI_ESC);
+	const __m128i cr = _mm_set1_epi8(ANSI_CR);
+	const __m128i lf = _mm_set1_epi8(ANSI_LF);
+	const __m128i bs = _mm_set1_epi8(ANSI_BS);
+	const __m128i bel = _mm_set1_epi8(ANSI_BEL);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i m = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, esc), _mm_cmpeq_epi8(v, cr)),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, lf),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, bs), _mm_cmpeq_epi8(v, bel))));
+		unsigned bits = (unsigned)_mm_movemask_epi8(m);
+
+		if (bits != 0)
+			return i + ctz32(bits);
+	}
+#endif
+	for (; i < n; i++) {
+		switch (p[i]) {
+		case ANSI_ESC:
+		case ANSI_CR:
+		case ANSI_LF:
+		case ANSI_BS:
+		case ANSI_BEL:
+			return i;
+		}
+	}
+	return n;
+}
+
+class ansifilter {
+private:
+	enum State {
+		ANSI_GROUND,
+		ANSI_ESCAPE,	// saw ESC
+		ANSI_INTER,	// ESC + intermediate bytes, e.g. ESC ( B
+		ANSI_CSI,	// ESC [ params... final
+		ANSI_STRING,	// ESC ] / P / X / ^ / _ ... BEL or ST
+		ANSI_STRESC	// ESC inside a string, maybe ST
+	} state;
+	std::string line;	// the line being built
+	size_t col;		// cursor position within it
+	bool cr;		// saw \r, waiting to see if \n follows
+	unsigned csiarg;	// CSI's first parameter, 0 if none
+	bool csinext;		// past it, at the ones after a ';'
+
+	void put(const __int8 *p, size_t n);
+	void endline(std::string &out, bool crlf);
+	void erase(unsigned how);
+public:
+	ansifilter() : state(ANSI_GROUND), col(0), cr(false), csiarg(0), csinext(false) {}
+	void filter(const __int8 *p, DWORD n, std::string &out);
+	void flush(std::string &out);
+};
+
+// Write text at the cursor, overwriting anything a \r left behind.
+inline void
+ansifilter::put(const __int8 *p, size_t n) {
+	if (col == line.size())
+		line.append((const char *)p, n);
+	else {
+		if (col + n > line.size())
+			line.resize(col + n, ' ');
+		line.replace(col, n, (const char *)p, n);
+	}
+	col += n;
+}
+
+// Erase in line (ESC [ K): 0 from the cursor on, 1 up to and including
+// it, 2 all of it. The cursor stays where it is.
+inline void
+ansifilter::erase(unsigned how) {
+	size_t n = col < line.size() ? col + 1 : line.size();
+
+	switch (how) {
+	case 0:
+		if (col < line.size())
+			line.resize(col);
+		break;
+	case 1:
+		line.replace(0, n, n, ' ');
+		break;
+	case 2:
+		line.assign(col, ' ');
+		break;
+	}
+}
+
+inline void
+ansifilter::endline(std::string &out, bool crlf) {
+	out.append(line);
+	if (crlf)
+		out.push_back(ANSI_CR);
+	out.push_back(ANSI_LF);
+	line.clear();
+	col = 0;
+}
+
+inline void
+ansifilter::filter(const __int8 *p, DWORD n, std::string &out) {
+	const unsigned char *up = (const unsigned char *)p;
+	DWORD i = 0;
+
+	while (i < n) {
+		unsigned char c = up[i];
+
+		if (cr) {
+			cr = false;
+			if (c == ANSI_LF) {
+				endline(out, true);
+				i++;
+				continue;
+			}
+			col = 0;
+		}
+
+		switch (state) {
+		case ANSI_GROUND: {
+			size_t run = ansi_scan(up + i, n - i);
+
+			if (run != 0) {
+				put(p + i, run);
+				i += (DWORD)run;
+				if (line.size() >= ANSIFILTER_LINEMAX) {
+					out.append(line);
+					line.clear();
+					col = 0;
+				}
+				continue;
+			}
+			switch (c) {
+			case ANSI_ESC:
+				state = ANSI_ESCAPE;
+				break;
+			case ANSI_CR:
+				cr = true;
+				break;
+			case ANSI_LF:
+				endline(out, false);
+				break;
+			case ANSI_BS:
+				if (col > 0)
+					col--;
+				break;
+			case ANSI_BEL:
+				break;
+			}
+			break;
+		}
+		case ANSI_ESCAPE:
+			if (c == '[') {
+				state = ANSI_CSI;
+				csiarg = 0;
+				csinext = false;
+			} else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+				state = ANSI_STRING;
+			else if (c >= 0x20 && c <= 0x2f)
+				state = ANSI_INTER;
+			else if (c == ANSI_ESC)
+				state = ANSI_ESCAPE;
+			else
+				state = ANSI_GROUND;
+			break;
+		case ANSI_INTER:
+			if (c >= 0x30 && c <= 0x7e)
+				state = ANSI_GROUND;
+			break;
+		case ANSI_CSI:
+			if (c >= 0x40 && c <= 0x7e) {
+				if (c == 'K')
+					erase(csiarg);
+				state = ANSI_GROUND;
+			} else if (c >= '0' && c <= '9') {
+				if (!csinext && csiarg < 1000)
+					csiarg = csiarg * 10 + (c - '0');
+			} else if (c == ';')
+				csinext = true;
+			else if (c == ANSI_ESC)
+				state = ANSI_ESCAPE;
+			break;
+		case ANSI_STRING:
+			if (c == ANSI_BEL)
+				state = ANSI_GROUND;
+			else if (c == ANSI_ESC)
+				state = ANSI_STRESC;
+			break;
+		case ANSI_STRESC:
+			state = (c == '\\') ? ANSI_GROUND : ANSI_STRING;
+			break;
+		}
+		i++;
+	}
+}
+
+// Emit whatever is left of the current line (at exit).
+inline void
+ansifilter::flush(std::string &out) {
+	out.append(line);
+	line.clear();
+	col = 0;
+	cr = false;
+}
@@ -0,0 +1,144 @@
+// asyncout.h : the overlapped writer behind every output queue.
+//
+// Each output (the pipe, the log, the recording, the filter) is a
+// bufferqueue drained through one OVERLAPPED. start_async_out() writes
+// from the front of the queue until a write pends (async_out() is the
+// same for an output known to be open), and handle_async_out()
+// finishes that write when the event fires and starts the next.
+// drain_log() finishes everything at exit. The file offset lives in
+// the OVERLAPPED and add_offset() moves it on as writes complete. Only
+// WriteFile, GetOverlappedResult and ResetEvent are used, so
+// bench/simloop.cpp runs this same code against simulated I/O.
+
+#pragma once
+
+#include "abuffer.h"
+
+#define WAITER_SUCCESS 0
+#define WAITER_IO_ERROR 1
+#define WAITER_EXIT_NORMAL 2
+
+// Move olap past the off bytes just written.
+inline void
+add_offset(DWORD off, OVERLAPPED *olap) {
+	ULARGE_INTEGER pos;
+
+	pos.LowPart = olap->Offset;
+	pos.HighPart = olap->OffsetHigh;
+	pos.QuadPart += off;
+	olap->Offset = pos.LowPart;
+	olap->OffsetHigh = pos.HighPart;
+}
+
+// Queue abuf (may be NULL) on bufq and write from the front until a
+// write pends or the queue is empty.
+inline DWORD
+async_out(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq, abuffer *abuf) {
+	DWORD nlen;
+
+	if (abuf != NULL && !bufq->empty()) {
+		// already chewing on something, queue and go.
+		bufq->push(abuf);
+		return WAITER_SUCCESS;
+	}
+
+	if (abuf != NULL)
+		bufq->push(abuf);
+	while (!bufq->empty()) {
+		abuf = bufq->front();
+		
+		if (!WriteFile(h, abuf->getptr(), abuf->size(), &nlen, olap)) {
+			DWORD error = GetLastError();
+			if (error == ERROR_IO_PENDING)
+				return WAITER_SUCCESS;
+			return WAITER_IO_ERROR;
+		}
+
+		// Write completed synchronously
+		add_offset(nlen, olap);
+		abuf->advance(nlen);
+		if (abuf->empty()) {
+			bufq->pop();
+			delete abuf;
+		}
+	}
+
+	// If we're here, all our writes are done, relax
+	if (!ResetEvent(olap->hEvent))
+		return WAITER_IO_ERROR;
+	return WAITER_SUCCESS;
+}
+
+// async_out(), where a NULL h (no such output) just frees abuf.
+inline DWORD
+start_async_out(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq, abuffer *abuf) {
+	if (h == NULL) {
+		delete abuf;
+		return WAITER_SUCCESS;
+	}
+	return async_out(h, olap, bufq, abuf);
+}
+
+// olap's event fired: finish the pending write and start the next.
+inline DWORD
+handle_async_out(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq) {
+	DWORD len;
+
+	if (bufq->empty()) {
+		if (!ResetEvent(olap->hEvent))
+			return WAITER_IO_ERROR;
+		return WAITER_SUCCESS;
+	}
+
+	if (!GetOverlappedResult(h, olap, &len, FALSE))
+		return WAITER_IO_ERROR;
+	add_offset(len, olap);
+
+	auto abuf = bufq->front();
+	abuf->advance(len);
+	if (abuf->empty()) {
+		bufq->pop();
+		delete abuf;
+	}
+
+	return start_async_out(h, olap, bufq, NULL);
+}
+
+// At exit: finish the pending write, then write the rest synchronously.
+inline void
+drain_log(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq) {
+	DWORD len;
+
+	if (!bufq->empty()) {
+		auto abuf = bufq->front();
+
+		// There's an I/O pending, so compelete it.
+		if (!GetOverlappedResult(h, olap, &len, TRUE))
+			return;
+		add_offset(len, olap);
+		abuf->advance(len);
+		if (abuf->empty()) {
+			bufq->pop();
+			delete abuf;
+		}
+	}
+
+	// Now, drain the remaining buffers
+	while (!bufq->empty()) {
+		auto abuf = bufq->front();
+
+		// A failed write wrote nothing; trying it again forever won't help.
+		if (!WriteFile(h, abuf->getptr(), abuf->size(), &len, olap)) {
+			if (GetLastError() != ERROR_IO_PENDING)
+				return;
+			if (!GetOverlappedResult(h, olap, &len, TRUE))
+				return;
+		}
+		add_offset(len, olap);
+		abuf->advance(len);
+		if (abuf->empty()) {
+			bufq->pop();
+			delete abuf;
+		}
+	}
+}
@@ -0,0 +1,161 @@
+// bootindex.h : split a console log into boots (tools/logidx).
+//
+// A boot starts at the beginning of a line containing one of a set of
+// banner strings ("Linux version ", the Windows SAC banner, ...); any
+// output before the first banner is boot 0. Finding the banners is the
+// only full pass over the data and can be split into ranges scanned in
+// parallel. The first and last printk timestamps of a boot are then
+// found by scanning lines forward from its start and backward from its
+// end, which normally stops after a few lines.
+//
+// The index is a text file, one boot per line:
+//
+//	# cus boot index v1 <log size>
+//	<boot> <start> <end> <first ts|-> <last ts|->
+//
+// Offsets are bytes; end is exclusive. Timestamps are printk seconds.
+
+#pragma once
+
+#include "simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define BOOTIDX_MAGIC "# cus boot index v1"
+
+static const char *const bootidx_banners[] = {
+	"Linux version ",
+	"Computer is booting, SAC started",	// Windows EMS
+	"Copyright (c) 1992-",			// FreeBSD
+};
+
+struct bootrec {
+	unsigned long long start, end;
+	bool hasts;
+	double firstts, lastts;
+};
+
+// Start of the line holding offset off.
+static inline unsigned long long
+bootidx_linestart(const char *base, unsigned long long off) {
+	while (off > 0 && base[off - 1] != '\n')
+		off--;
+	return off;
+}
+
+// Boot boundaries (line starts) for banners that begin in [start, end).
+// Matches may run past end, so a banner split between two ranges is
+// found by exactly one of them. Results are unsorted and may repeat.
+static inline void
+bootidx_scan(const char *base, unsigned long long size, unsigned long long start, unsigned long long end,
+    const std::vector<std::string> &banners, std::vector<unsigned long long> &out) {
+	for (auto &b : banners) {
+		unsigned long long lim = end + b.size() - 1 < size ? end + b.size() - 1 : size;
+		unsigned long long off = start;
+
+		while (off < lim) {
+			size_t at = simd_memmem(base + off, (size_t)(lim - off), b.data(), b.size());
+
+			if (at == (size_t)-1)
+				break;
+			out.push_back(bootidx_linestart(base, off + at));
+			off += at + 1;
+		}
+	}
+}
+
+// A printk timestamp ("[   12.345678]") at the start of a line. Parsed
+// by hand: the log is mapped, and strtod could read past its end.
+static inline bool
+printk_ts(const char *p, const char *end, double *ts) {
+	const char *q = p + 1;
+	double v = 0, scale = 1;
+	bool digits = false;
+
+	if (p >= end || *p != '[')
+		return false;
+	while (q < end && *q == ' ')
+		q++;
+	for (; q < end && *q >= '0' && *q <= '9'; q++, digits = true)
+		v = v * 10 + (*q - '0');
+	if (q < end && *q == '.')
+		for (q++; q < end && *q >= '0' && *q <= '9'; q++)
+			v += (*q - '0') * (scale /= 10);
+	if (!digits || q == end || *q != ']')
+		return false;
+	*ts = v;
+	return true;
+}
+
+static inline bool
+bootidx_firstts(const char *base, unsigned long long start, unsigned long long end, double *ts) {
+	for (unsigned long long off = start; off < end;) {
+		const char *nl = (const char *)memchr(base + off, '\n', (size_t)(end - off));
+
+		if (printk_ts(base + off, nl != NULL ? nl : base + end, ts))
+			return true;
+		if (nl == NULL)
+			break;
+		off = nl - base + 1;
+	}
+	return false;
+}
+
+static inline bool
+bootidx_lastts(const char *base, unsigned long long start, unsigned long long end, double *ts) {
+	unsigned long long lend = end;
+
+	while (lend > start) {
+		unsigned long long ls = lend - 1;
+
+		// lend is one past a line's '\n' (or the end); find its start
+		while (ls > start && base[ls - 1] != '\n')
+			ls--;
+		if (printk_ts(base + ls, base + lend, ts))
+			return true;
+		lend = ls;
+	}
+	return false;
+}
+
+static inline void
+bootidx_write(FILE *f, unsigned long long size, const std::vector<bootrec> &boots) {
+	fprintf(f, "%s %llu\n", BOOTIDX_MAGIC, size);
+	for (size_t i = 0; i < boots.size(); i++) {
+		const bootrec &b = boots[i];
+
+		fprintf(f, "%zu %llu %llu ", i, b.start, b.end);
+		if (b.hasts)
+			fprintf(f, "%.6f %.6f\n", b.firstts, b.lastts);
+		else
+			fprintf(f, "- -\n");
+	}
+}
+
+// Returns false if f isn't an index.
+static inline bool
+bootidx_read(FILE *f, unsigned long long *size, std::vector<bootrec> &boots) {
+	char line[256];
+
+	if (fgets(line, sizeof(line), f) == NULL ||
+	    strncmp(line, BOOTIDX_MAGIC " ", sizeof(BOOTIDX_MAGIC)) != 0)
+		return false;
+	*size = strtoull(line + sizeof(BOOTIDX_MAGIC), NULL, 10);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		bootrec b;
+		char first[64], last[64];
+		size_t n;
+
+		if (sscanf(line, "%zu %llu %llu %63s %63s", &n, &b.start, &b.end, first, last) != 5 ||
+		    n != boots.size() || b.end < b.start)
+			return false;
+		b.hasts = strcmp(first, "-") != 0;
+		b.firstts = b.hasts ? strtod(first, NULL) : 0;
+		b.lastts = b.hasts ? strtod(last, NULL) : 0;
+		boots.push_back(b);
+	}
+	return true;
+}
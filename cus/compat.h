@@ -0,0 +1,21 @@
+// compat.h : Win32 type shims for the portable parts of cus.
+//
+// The buffer, ring and filter code is shared with the Linux builds
+// (bench, tools), so it only uses these few Win32 names.
+
+#pragma once
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <stdint.h>
+
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef signed char __int8;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+#endif
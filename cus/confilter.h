@@ -0,0 +1,237 @@
+// confilter.h : what the console leaves out of the guest output (-L, -X, ~0-~8).
+//
+// A debug kernel (loglevel=8) writes more than the console can show,
+// though the log wants all of it. This takes lines out of what the
+// console gets: those with a printk level ("<7>", also after a
+// "[ts] ") not below the threshold, as the kernel's console_loglevel
+// does, and those whose text, after any level and timestamp, starts
+// with an excluded prefix. Lines with no level pass the threshold.
+//
+// A line is decided on its first bytes, which are held back only while
+// they could still be a level, a timestamp or an excluded prefix, at
+// most CF_HEADMAX of them; a prompt that is neither shows at once. The
+// rest of the line is passed on in place, or skipped, without being
+// looked at past the newline.
+
+#pragma once
+
+#include "compat.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define CF_ALL 8		// threshold that shows every level
+#define CF_NOLEVEL 8
+#define CF_PATMAX 32
+#define CF_HEADMAX (32 + CF_PATMAX)
+
+enum { CF_MORE, CF_KEEP, CF_DROP };
+
+// A "<N>" at p: 1 with its level and end, 0 if it isn't one, -1 if the
+// bytes so far could still be one.
+static inline int
+cf_level(const char *p, const char *end, unsigned *level, const char **after) {
+	const char *q = p + 1;
+	unsigned v = 0;
+
+	if (p == end)
+		return -1;
+	if (*p != '<')
+		return 0;
+	for (; q < end && *q >= '0' && *q <= '9' && q - p <= 3; q++)
+		v = v * 10 + (*q - '0');
+	if (q == end)
+		return -1;
+	if (q == p + 1 || *q != '>')
+		return 0;
+	*level = v & 7;
+	*after = q + 1;
+	return 1;
+}
+
+// The same for a "[ssss.uuuuuu]" timestamp, as printk_ts() reads them.
+static inline int
+cf_ts(const char *p, const char *end, const char **after) {
+	const char *q = p + 1;
+	bool digits = false;
+
+	if (p == end)
+		return -1;
+	if (*p != '[')
+		return 0;
+	while (q < end && *q == ' ')
+		q++;
+	for (; q < end && *q >= '0' && *q <= '9'; q++)
+		digits = true;
+	if (q < end && *q == '.')
+		for (q++; q < end && *q >= '0' && *q <= '9'; q++)
+			;
+	if (q == end)
+		return -1;
+	if (!digits || *q != ']')
+		return 0;
+	*after = q + 1;
+	return 1;
+}
+
+class confilter {
+private:
+	unsigned threshold;
+	std::vector<std::string> pats;
+	enum { LINE_HEAD, LINE_KEEP, LINE_DROP } state;
+	char head[CF_HEADMAX];
+	unsigned headlen;
+	unsigned long long ndropped;
+
+	int decide(bool whole);
+public:
+	confilter() : threshold(CF_ALL), state(LINE_HEAD), headlen(0), ndropped(0) {}
+	void setlevel(unsigned level) { threshold = level; }
+	unsigned level(void) { return threshold; }
+	// false if it's too long to be decided on the first bytes
+	bool exclude(const std::string &pat);
+	bool active(void) { return threshold < CF_ALL || !pats.empty(); }
+	unsigned long long dropped(void) { return ndropped; }
+
+	// n more bytes of output; emit(p, n) gets the runs of it that are
+	// kept, returning false on an error, which filter() then returns.
+	template <class E> bool filter(const __int8 *p, DWORD n, E emit);
+	// At the end: a line held back that never finished.
+	template <class E> bool flush(E emit);
+};
+
+inline bool
+confilter::exclude(const std::string &pat) {
+	if (pat.empty() || pat.size() > CF_PATMAX)
+		return false;
+	pats.push_back(pat);
+	return true;
+}
+
+// Whether the line that starts with head goes. whole: there is no more
+// of it to wait for.
+inline int
+confilter::decide(bool whole) {
+	const char *q = head, *end = head + headlen, *r;
+	unsigned lv = CF_NOLEVEL;
+	bool partial = false;
+	int k;
+
+	if ((k = cf_level(q, end, &lv, &r)) < 0 && !whole)
+		return CF_MORE;
+	if (k > 0) {
+		if (lv >= threshold)
+			return CF_DROP;
+		q = r;
+	}
+	if ((k = cf_ts(q, end, &r)) < 0 && !whole)
+		return CF_MORE;
+	if (k > 0) {
+		// "[ts] <6>", as some consoles put it
+		for (q = r; q < end && *q == ' '; q++)
+			;
+		if (lv == CF_NOLEVEL) {
+			if ((k = cf_level(q, end, &lv, &r)) < 0 && !whole)
+				return CF_MORE;
+			if (k > 0) {
+				if (lv >= threshold)
+					return CF_DROP;
+				q = r;
+			}
+		}
+	}
+	if (pats.empty())
+		return CF_KEEP;
+	while (q < end && *q == ' ')
+		q++;
+	if (q == end && !whole)
+		return CF_MORE;
+	for (const std::string &pat : pats) {
+		size_t n = (size_t)(end - q) < pat.size() ? (size_t)(end - q) : pat.size();
+
+		if (memcmp(q, pat.data(), n) != 0)
+			continue;
+		if (n == pat.size())
+			return CF_DROP;
+		partial = true;
+	}
+	return partial && !whole ? CF_MORE : CF_KEEP;
+}
+
+template <class E>
+inline bool
+confilter::filter(const __int8 *p, DWORD n, E emit) {
+	const __int8 *end = p + n, *run = NULL, *ls;
+	// the kept bytes up to at, passed on in place
+	auto cut = [&](const __int8 *at) {
+		bool ok = run == NULL || at == run || emit(run, (DWORD)(at - run));
+
+		run = NULL;
+		return ok;
+	};
+
+	if (!active()) {
+		// Pass it all, but keep track of where lines start, for when
+		// there's a threshold again.
+		if (headlen != 0 && !emit((const __int8 *)head, headlen))
+			return false;
+		headlen = 0;
+		if (n != 0)
+			state = end[-1] == '\n' ? LINE_HEAD : LINE_KEEP;
+		return n == 0 || emit(p, n);
+	}
+	while (p < end) {
+		const __int8 *nl;
+
+		if (state == LINE_HEAD) {
+			int d = CF_MORE;
+
+			ls = headlen == 0 ? p : NULL;	// where the line starts, if in p
+			while (d == CF_MORE && p < end) {
+				head[headlen++] = *p++;
+				d = decide(p[-1] == '\n' || headlen == CF_HEADMAX);
+			}
+			if (d == CF_MORE)
+				return cut(ls != NULL ? ls : p);
+			if (d == CF_DROP) {
+				if (!cut(ls != NULL ? ls : p))
+					return false;
+				ndropped++;
+				state = LINE_DROP;
+			} else if (ls != NULL) {
+				if (run == NULL)
+					run = ls;
+				state = LINE_KEEP;
+			} else {
+				// held over from the last buffer
+				if (!emit((const __int8 *)head, headlen))
+					return false;
+				run = p;
+				state = LINE_KEEP;
+			}
+			headlen = 0;
+			if (p[-1] == '\n')
+				state = LINE_HEAD;
+			continue;
+		}
+		nl = (const __int8 *)memchr(p, '\n', end - p);
+		if (state == LINE_KEEP && run == NULL)
+			run = p;
+		p = nl != NULL ? nl + 1 : end;
+		if (nl != NULL)
+			state = LINE_HEAD;
+	}
+	return cut(p);
+}
+
+template <class E>
+inline bool
+confilter::flush(E emit) {
+	bool ok = true;
+
+	if (headlen != 0 && decide(true) == CF_KEEP)
+		ok = emit((const __int8 *)head, headlen);
+	headlen = 0;
+	state = LINE_HEAD;
+	return ok;
+}
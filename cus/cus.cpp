@@ -35,12 +35,29 @@
 // manually.
 
 // TODO
-// - switch to unicode consistently
+// - switch the diagnostics to unicode consistently
 //		fprintf, etc.
 // - allocate buffers based on pipe dimensions
 
 #include "stdafx.h"
-#include <queue>
+#include "abuffer.h"
+#include "spscring.h"
+#include "ansifilter.h"
+#include "utf8.h"
+#include "sidcache.h"
+#include "recording.h"
+#include "scrollback.h"
+#include "linededup.h"
+#include "latency.h"
+#include "directlog.h"
+#include "escape.h"
+#include "hexdump.h"
+#include "asyncout.h"
+#include "flow.h"
+#include "outpath.h"
+#include "printkidx.h"
+#include "confilter.h"
+#include <thread>
 
 VOID ErrorExit(LPCWSTR msg);
 void restore_terminal(void);
@@ -52,67 +69,373 @@ DWORD fdwStdoutSavedmode;
 HANDLE hStdin, hStdout;
 HANDLE hPipe, hLog;
 
-#define ABUFFER_SIZE 64
+// stdout that isn't a console (a file or pipe) gets the raw bytes,
+// gathered into large writes: the buffer goes out when it fills and
+// whenever the event loop is about to wait.
+#define STDOUT_BUFSIZE (64 * 1024)
+bool stdoutConsole;
+std::string stdoutBuf;
+
+// stdin that isn't a console is read by a thread, STDIN_BUFSIZE at a
+// time, and handed over in stdinChunk: hStdinReady when it's there,
+// hStdinTaken once the event loop has queued it. It goes to the pipe
+// as is, with no ~ escapes; end of file ends the session once what was
+// read has been written.
+#define STDIN_BUFSIZE (64 * 1024)
+bool stdinConsole;
+HANDLE hStdinThread, hStdinReady, hStdinTaken;
+std::string stdinChunk;
+bool stdinEof, stdinClosed;
+DWORD stdinError;
+
+// With -t the log is written by its own thread, fed through logRing.
+#define LOGRING_SIZE (1024 * 1024)
+#define LOGTHREAD_IDLE_MS 250
+#define LOGTHREAD_DRAIN_MS 2000
+
+spscring *logRing;
+HANDLE hLogThread, hLogWake;
+std::atomic<bool> logStop;
+DWORD logError;
+
+// -y: how hard to push the log to disk. FlushFileBuffers runs on its
+// own thread, either every syncMs (periodic) or once per group of
+// writes completing within syncMs of each other (group commit).
+enum SyncMode { SYNC_NONE, SYNC_PERIODIC, SYNC_GROUP } syncMode;
+DWORD syncMs;
+#define SYNC_PERIODIC_MS 1000
+#define SYNC_GROUP_MS 5
+
+HANDLE hFlushThread, hFlushWake;
+std::atomic<unsigned long long> logDone;	// bytes the log writer has finished
+std::atomic<bool> flushIdle, flushStop;
+DWORD flushError;
+lathist flushLatency;
+
+// -u: the log is unbuffered, written from aligned staging buffers (see
+// directlog.h). Writes complete as APCs (WriteFileEx) during the main
+// loop's alertable wait, so any number can be in flight without a wait
+// handle each. The partial buffer is written as a tail once output has
+// been quiet for DIO_TAIL_MS.
+#define DIO_TAIL_MS 200
+
+struct diowrite {
+	OVERLAPPED ov;		// first, so APCs can cast back
+	diobuf *b;
+};
 
-struct abuffer {
+directlog *dioLog;
+diowrite dioWrites[DIO_NBUFS + 1];
+HANDLE hDioTimer;
+bool dioTimerArmed;
+ULONGLONG dioLastPut;
+DWORD dioError;
+
+// With -c the log gets a cleaned copy of the output; logClean is the
+// filter's scratch output.
+ansifilter *logFilter;
+std::string logClean;
+
+// With -d runs of repeated lines are collapsed in the log (after -c).
+linededup *logDedup;
+std::string logUniq;
+
+// Pipe output is UTF-8, the console wants UTF-16.
+utf8decoder conDecoder;
+std::u16string conWide;
+
+// With -r the session is also recorded with timestamps, see recording.h.
+recwriter *recorder;
+HANDLE hRec;
+OVERLAPPED recOverlap;
+bufferqueue *recOutQueue;
+std::string recScratch;
+LARGE_INTEGER recFreq, recStart;
+
+// With -k the log's printk lines are indexed into log.pk (printkidx.h)
+// for tools/logidx -q. The index is fed what the log writer takes, so
+// its offsets are the log's. Blocks are queued whole, or dropped whole
+// under -q :drop, so the file stays readable.
+pkindex *pkIndex;
+HANDLE hPk;
+OVERLAPPED pkOverlap;
+bufferqueue *pkOutQueue;
+std::string pkScratch;
+
+// With -b the guest output is also kept in memory for ~/ to search.
+// While a search is on screen, output goes only to the scrollback and
+// is shown when the search ends.
+scrollback *sback;
+bool conPaused;
+unsigned long long conPausedAt;
+std::string searchPat;
+unsigned long long searchAt;	// start of the line shown
+
+// ~x shows guest output as hex dump lines (hexdump.h) instead of text,
+// for binary output that would garble the console; the log and the
+// rest still get the raw bytes. pipeBytes counts the output so far,
+// for the offsets.
+hexdump *hexView;
+unsigned long long pipeBytes;
+
+// -L and -X take lines out of what the console shows (confilter.h), and
+// ~0 to ~8 change -L as it runs; the log and the rest still get them.
+// With ~x the console shows everything.
+confilter *conFilter;
+
+// With -f/-F every byte from the pipe is also written to the stdin of a
+// filter process. Its queue is bounded: -f drops output the filter
+// can't keep up with, -F stops reading the pipe until it catches up.
+#define TEE_QUEUE_BUFS 4096	// abuffers, i.e. 256 KB
+#define TEE_DRAIN_MS 2000
+
+HANDLE hTee, hTeeProc;
+OVERLAPPED teeOverlap;
+bufferqueue *teeQueue;
+bool teeBlock;
+unsigned long long teeDropped;
+
+// -o adds outputs, each a chain of filters ending in a sink (flow.h):
+// file:PATH, cmd:COMMAND, tcp:HOST:PORT or con. Their queues follow
+// -q. A con sink takes the console over from pipe_input_helper, so
+// what's shown can be filtered; while ~/ is up it holds the output back
+// and shows it afterwards.
+class consink : public flowsink {
 private:
-	DWORD len;
-	__int8 buf[ABUFFER_SIZE];
-	__int8 *ptr;
+	unsigned long long told;	// of the drops, those already owned up to
 public:
-	abuffer();
-	void advance(DWORD);
-	void add(__int8);
-	bool full() { return len == ABUFFER_SIZE; }
-	bool empty() { return len == 0; }
-	DWORD size() { return len; }
-	void size(DWORD n) { len = n; }
-	__int8 *getptr() { return ptr; }
-	__int8 at(DWORD i) { return buf[i]; }
+	explicit consink(size_t limit) : flowsink("con", limit, true), told(0) {}
+	DWORD put(const slice &s);
+	void resume(void);
 };
 
-abuffer::abuffer() {
-	len = 0;
-	ptr = &buf[0];
-}
+flowgraph *flow;
+consink *flowCon;
 
-void
-abuffer::advance(DWORD n) {
-	len -= n;
-	ptr += n;
-}
+// -q: every other writer queue (log, pipe, recording) is limited to
+// queueLimit buffers. By default a full queue stops its producer: pipe
+// reads stop for the log or recording, keyboard reads for the pipe or
+// recording, each until the queue is down to half. With :drop new data
+// for a full queue is thrown away instead. ~q shows the queues. (-t and
+// -u have fixed buffers of their own.)
+#define QUEUE_LIMIT_KB 4096
 
-void
-abuffer::add(__int8 c) {
-	buf[len++] = c;
-}
+enum QueuePolicy { QUEUE_BLOCK, QUEUE_DROP } queuePolicy;
+size_t queueLimit = QUEUE_LIMIT_KB * 1024 / ABUFFER_SIZE;
+bufferqueue *logOutQueue, *pipeOutQueue;
+bool pipeInPaused, stdinPaused;
+HANDLE hStdinIdle;	// never signalled; waited on instead of stdin when paused
 
-typedef std::queue<abuffer *> bufferqueue;
+// Replay maps this much of a recording at a time.
+#define REC_WINDOW (64 * 1024 * 1024)
 
 DWORD pipe_input_helper(HANDLE hOutput, HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq, abuffer *abuf);
+BOOL console_write(HANDLE hOutput, const __int8 *p, DWORD n);
+BOOL con_output(HANDLE hOutput, const __int8 *p, DWORD n);
+BOOL con_guest(HANDLE hOutput, const __int8 *p, DWORD n);
+void con_level(unsigned level);
+void hex_toggle(void);
+BOOL stdout_flush(void);
+void ui_write(const __int8 *p, DWORD n);
+void start_stdin_thread(void);
+DWORD WINAPI stdin_thread(LPVOID arg);
+DWORD handle_stdin_redirected(HANDLE hOutput, OVERLAPPED *olap, bufferqueue *bufq);
+DWORD queue_bytes(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq, const std::string &bytes);
+DWORD log_buffer(HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq, abuffer *abuf);
+DWORD log_bytes(HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq, std::string &bytes);
+DWORD log_filtered(HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq, const __int8 *p, DWORD n, bool last);
+std::string &log_clean(const __int8 *p, DWORD n, bool last);
+DWORD raw_output(HANDLE hOutput, const __int8 *p, DWORD n);
 DWORD start_pipe_input(HANDLE hInput, OVERLAPPED *inlap, bufferqueue *inq, HANDLE hOutput, HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq);
 DWORD handle_pipe_input(HANDLE hInput, OVERLAPPED *inlap, bufferqueue *inq, HANDLE hOutput, HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq);
-DWORD start_async_out(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq, abuffer *);
-DWORD handle_async_out(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq);
 DWORD handle_stdin(HANDLE hInput, HANDLE hOutput, OVERLAPPED *olap, bufferqueue *bufq);
-void add_offset(DWORD off, OVERLAPPED *olap);
-void drain_log(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq);
+void setup_console_output(void);
+void start_recording(const wchar_t *name);
+DWORD rec_chunk(int dir, const __int8 *p, DWORD n);
+void start_index(const wchar_t *logName);
+DWORD pk_log(const __int8 *p, DWORD n);
+void finish_index(void);
+bool search_start(void);
+void search_end(void);
+void search_show(unsigned long long start);
+void con_puts(const char *s);
+void finish_recording(void);
+void start_tee(const wchar_t *cmd);
+DWORD tee_chunk(const __int8 *p, DWORD n);
+void tee_failed(void);
+void stop_tee(void);
+HANDLE start_child(const wchar_t *cmd, HANDLE *proc);
+flowsink *make_sink(const std::string &kind, const std::string &arg, size_t limit, bool drop, std::string &why);
+HANDLE tcp_connect(const std::string &arg, std::string &why);
+std::string to_utf8(const wchar_t *s);
+std::wstring from_utf8(const std::string &s);
+void flow_status(std::string &s);
+void flow_report(void);
+int replay(const wchar_t *name, double speed, double start);
+int headless(const wchar_t *ctlname, unsigned nworkers, int argc, wchar_t *argv[]);
+void start_log_thread(void);
+void stop_log_thread(void);
+DWORD WINAPI log_thread(LPVOID);
+bool parse_sync(const wchar_t *arg);
+bool parse_queue(const wchar_t *arg);
+bool pipe_in_blocked(void);
+bool stdin_blocked(void);
+void queue_status(void);
+void queue_report(void);
+void log_progress(unsigned long long done);
+void start_flush_thread(void);
+void stop_flush_thread(void);
+DWORD WINAPI flush_thread(LPVOID);
+unsigned long long log_written(OVERLAPPED *olap);
+DWORD dio_put(const __int8 *p, DWORD n);
+BOOL dio_arm(DWORD ms);
+void dio_kick(void);
+void dio_write(diobuf *b);
+VOID CALLBACK dio_done(DWORD error, DWORD n, LPOVERLAPPED ov);
+void dio_set_eof(unsigned long long end);
+void dio_drain(void);
 void usage(const wchar_t *name);
 int pipeinfo(LPCTSTR);
+int pipescan(LPCTSTR pattern);
+pipeacl get_pipeacl(LPCTSTR pipename);
+std::string sid_bytes(PSID pSid);
 void get_acctName(LPCTSTR name, PSID pSid);
 void show_acl(LPCTSTR name, PACL acl);
 void show_mask(DWORD mask);
+void pick_output(void);
+
+// The stages of the pipe output path (outpath.h), as cus has them.
+// pipeOut is the path for the session's options, picked in wmain, and
+// again if ~0-~8 adds a console filter.
+struct cuspath {
+	struct ctx {
+		HANDLE hOutput, hLog;
+		OVERLAPPED *outlap;
+		bufferqueue *outq;
+	};
+
+	// Nothing but the console, which nothing can pause (~/ needs -b).
+	struct raw_console {
+		static DWORD put(ctx &x, const __int8 *p, DWORD n) {
+			pipeBytes += n;
+			return con_output(x.hOutput, p, n) ? WAITER_SUCCESS : WAITER_IO_ERROR;
+		}
+	};
+	struct raw_all {
+		static DWORD put(ctx &x, const __int8 *p, DWORD n) { return raw_output(x.hOutput, p, n); }
+	};
+
+	struct clean_off {
+		template <class L, class I>
+		static DWORD put(ctx &x, abuffer *abuf) { return L::template put<I>(x, abuf); }
+	};
+	// The console got the raw bytes, the log gets them filtered.
+	struct clean_on {
+		template <class L, class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			std::string &out = log_clean(abuf->getptr(), abuf->size(), false);
+
+			delete abuf;
+			return chunks<L, I>(x, out);
+		}
+	};
+
+	struct log_none {
+		template <class I>
+		static DWORD put(ctx &, abuffer *abuf) {
+			delete abuf;
+			return WAITER_SUCCESS;
+		}
+	};
+	struct log_queue {
+		template <class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			if (I::put(x, abuf->getptr(), abuf->size()) != WAITER_SUCCESS)
+				return WAITER_IO_ERROR;
+			return async_out(x.hLog, x.outlap, x.outq, abuf);
+		}
+	};
+	struct log_drop {
+		template <class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			if (x.outq->full()) {
+				x.outq->dropped(abuf->size());
+				delete abuf;
+				return WAITER_SUCCESS;
+			}
+			return log_queue::put<I>(x, abuf);
+		}
+	};
+	// One copy into the ring; the log thread takes it from there.
+	struct log_ring {
+		template <class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			bool wasempty;
+			DWORD kept = logRing->put(abuf->getptr(), abuf->size(), &wasempty);
+			DWORD ret = I::put(x, abuf->getptr(), kept);
+
+			delete abuf;
+			if (wasempty && !SetEvent(hLogWake))
+				return WAITER_IO_ERROR;
+			return ret;
+		}
+	};
+	struct log_direct {
+		template <class I>
+		static DWORD put(ctx &x, abuffer *abuf) {
+			DWORD ret = dio_put(abuf->getptr(), abuf->size());
+
+			if (ret == WAITER_SUCCESS)
+				ret = I::put(x, abuf->getptr(), abuf->size());
+			delete abuf;
+			return ret;
+		}
+	};
+	// Whichever of those is in use, asked each time, with index_any.
+	struct log_any {
+		template <class I>
+		static DWORD put(ctx &x, abuffer *abuf) { return log_buffer(x.hLog, x.outlap, x.outq, abuf); }
+	};
+
+	// What the log writer took, to the -k index.
+	struct index_off {
+		static DWORD put(ctx &, const __int8 *, DWORD) { return WAITER_SUCCESS; }
+	};
+	struct index_on {
+		static DWORD put(ctx &, const __int8 *p, DWORD n) { return pk_log(p, n); }
+	};
+	struct index_any {
+		static DWORD put(ctx &x, const __int8 *p, DWORD n) {
+			return pkIndex != NULL ? index_on::put(x, p, n) : index_off::put(x, p, n);
+		}
+	};
+
+	// A run of bytes (e.g. filter output) to L, a buffer at a time;
+	// empties the string.
+	template <class L, class I>
+	static DWORD chunks(ctx &x, std::string &bytes) {
+		DWORD ret = abuffer_split((const __int8 *)bytes.data(), (DWORD)bytes.size(),
+			[&](abuffer *abuf) { return L::template put<I>(x, abuf); });
 
-#define WAITER_SUCCESS 0
-#define WAITER_IO_ERROR 1
-#define WAITER_EXIT_NORMAL 2
+		if (ret == WAITER_SUCCESS)
+			bytes.clear();
+		return ret;
+	}
+};
+
+outpaths<cuspath>::fn pipeOut;
 
 int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 {
 	DWORD flags;
 	int c;
 	const wchar_t *logName = NULL, *pipeName = NULL, *progname;
-	bool iFlag = false;
+	const wchar_t *recName = NULL, *playName = NULL, *teeCmd = NULL, *ctlName = NULL;
+	bool iFlag = false, tFlag = false, cFlag = false, dFlag = false, uFlag = false, kFlag = false;
+	double speed = 1.0, start = 0.0;
+	unsigned long sbMB = 0, nWorkers = 0, conLevel;
+	wchar_t *end;
+	std::vector<std::string> flowSpecs;
 
 	progname = argv[0];
 
@@ -124,8 +447,33 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 	if (hStdout == INVALID_HANDLE_VALUE)
 		ErrorExit(TEXT("GetStdHandle(stdout)"));
 
-	while ((c = getopt(argc, argv, L"il:")) != -1) {
+	while ((c = getopt(argc, argv, L"b:cdf:F:H:ikl:L:o:p:q:r:s:S:tuw:X:y:")) != -1) {
 		switch (c) {
+		case 'b':
+			sbMB = wcstoul(optarg, &end, 10);
+			if (end == optarg || *end != 0 || sbMB == 0 || sbMB > 4096) {
+				usage(progname);
+				return (1);
+			}
+			break;
+		case 'c':
+			cFlag = true;
+			break;
+		case 'd':
+			dFlag = true;
+			break;
+		case 'f':
+		case 'F':
+			if (teeCmd != NULL) {
+				usage(progname);
+				return (1);
+			}
+			teeCmd = optarg;
+			teeBlock = (c == 'F');
+			break;
+		case 'H':
+			ctlName = optarg;
+			break;
 		case 'i':
 			if (iFlag) {
 				usage(progname);
@@ -133,6 +481,9 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 			}
 			iFlag = true;
 			break;
+		case 'k':
+			kFlag = true;
+			break;
 		case 'l':
 			if (logName != NULL) {
 				usage(progname);
@@ -140,6 +491,73 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 			}
 			logName = optarg;
 			break;
+		case 'L':
+			conLevel = wcstoul(optarg, &end, 10);
+			if (end == optarg || *end != 0 || conLevel > CF_ALL) {
+				usage(progname);
+				return (1);
+			}
+			if (conFilter == NULL)
+				conFilter = new confilter();
+			conFilter->setlevel(conLevel);
+			break;
+		case 'o':
+			flowSpecs.push_back(to_utf8(optarg));
+			break;
+		case 'p':
+			playName = optarg;
+			break;
+		case 'q':
+			if (!parse_queue(optarg)) {
+				usage(progname);
+				return (1);
+			}
+			break;
+		case 'r':
+			recName = optarg;
+			break;
+		case 's':
+			speed = wcstod(optarg, &end);
+			if (end == optarg || *end != 0 || speed < 0) {
+				usage(progname);
+				return (1);
+			}
+			break;
+		case 'S':
+			start = wcstod(optarg, &end);
+			if (end == optarg || *end != 0 || start < 0) {
+				usage(progname);
+				return (1);
+			}
+			break;
+		case 't':
+			tFlag = true;
+			break;
+		case 'u':
+			uFlag = true;
+			break;
+		case 'w':
+			// workers for -H, up to HL_MAXWORKERS in headless.cpp
+			nWorkers = wcstoul(optarg, &end, 10);
+			if (end == optarg || *end != 0 || nWorkers == 0 || nWorkers > 64) {
+				usage(progname);
+				return (1);
+			}
+			break;
+		case 'X':
+			if (conFilter == NULL)
+				conFilter = new confilter();
+			if (!conFilter->exclude(to_utf8(optarg))) {
+				usage(progname);
+				return (1);
+			}
+			break;
+		case 'y':
+			if (!parse_sync(optarg)) {
+				usage(progname);
+				return (1);
+			}
+			break;
 		default:
 			usage(progname);
 			return (1);
@@ -148,7 +566,25 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1 || (logName && iFlag)) {
+	if (playName != NULL) {
+		if (argc != 0 || logName || iFlag || recName || sbMB || teeCmd || ctlName || nWorkers || conFilter || !flowSpecs.empty()) {
+			usage(progname);
+			return (1);
+		}
+		return replay(playName, speed, start);
+	}
+
+	// No console needed: sessions are pipe/log pairs.
+	if (ctlName != NULL) {
+		if (argc % 2 != 0 || logName || iFlag || recName || sbMB || teeCmd || tFlag || cFlag || dFlag || uFlag || kFlag || syncMode ||
+		    conFilter || !flowSpecs.empty()) {
+			usage(progname);
+			return (1);
+		}
+		return headless(ctlName, nWorkers ? nWorkers : 1, argc, argv);
+	}
+
+	if (argc != 1 || nWorkers || (logName && iFlag) || ((tFlag || cFlag || dFlag || uFlag || kFlag || syncMode) && logName == NULL) || (tFlag && uFlag) || ((sbMB || teeCmd || conFilter || !flowSpecs.empty()) && iFlag)) {
 		usage(progname);
 		return (1);
 	}
@@ -164,33 +600,85 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 
 	hLog = NULL;
 	if (logName != NULL) {
+		// The log thread does plain blocking writes.
 		hLog = CreateFile(logName, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE, NULL,
-			OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+			OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | (tFlag ? 0 : FILE_FLAG_OVERLAPPED) |
+			(uFlag ? FILE_FLAG_NO_BUFFERING : 0), NULL);
 		if (hLog == INVALID_HANDLE_VALUE)
 			ErrorExit(logName);
+		if (tFlag)
+			start_log_thread();
+		if (uFlag)
+			dioLog = new directlog();
+		if (syncMode != SYNC_NONE)
+			start_flush_thread();
+		if (cFlag)
+			logFilter = new ansifilter();
+		if (dFlag)
+			logDedup = new linededup();
 	}
 
-	if (!GetConsoleMode(hStdin, &fdwStdinSavedmode))
-		ErrorExit(TEXT("GetConsoleMode"));
-	stdinModesaved = true;
-	flags = fdwStdinSavedmode;
-	flags |= ENABLE_VIRTUAL_TERMINAL_INPUT | ENABLE_EXTENDED_FLAGS;
-	flags &= ~(ENABLE_ECHO_INPUT |
-		ENABLE_LINE_INPUT |
-		ENABLE_MOUSE_INPUT |
-		ENABLE_WINDOW_INPUT);
-	if (!SetConsoleMode(hStdin, flags))
-		ErrorExit(TEXT("SetConsoleMode(stdin)"));
-
-	if (!GetConsoleMode(hStdout, &fdwStdoutSavedmode))
-		ErrorExit(TEXT("GetConsoleMode(stdout"));
-	stdoutModesaved = true;
-	flags = fdwStdoutSavedmode;
-	flags |= ENABLE_VIRTUAL_TERMINAL_PROCESSING |
-		DISABLE_NEWLINE_AUTO_RETURN |
-		ENABLE_WRAP_AT_EOL_OUTPUT;
-	if (!SetConsoleMode(hStdout, flags))
-		ErrorExit(TEXT("SetConsoleMode(stdout)"));
+	ZeroMemory(&pkOverlap, sizeof(pkOverlap));
+	pkOverlap.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (pkOverlap.hEvent == NULL)
+		ErrorExit(TEXT("CreateEvent(index)"));
+	pkOutQueue = new bufferqueue(queueLimit);
+	if (kFlag)
+		start_index(logName);
+
+	hDioTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+	if (hDioTimer == NULL)
+		ErrorExit(TEXT("CreateWaitableTimer"));
+
+	ZeroMemory(&recOverlap, sizeof(recOverlap));
+	recOverlap.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (recOverlap.hEvent == NULL)
+		ErrorExit(TEXT("CreateEvent(rec)"));
+	recOutQueue = new bufferqueue(queueLimit);
+	if (recName != NULL)
+		start_recording(recName);
+	if (sbMB != 0)
+		sback = new scrollback(sbMB);
+
+	ZeroMemory(&teeOverlap, sizeof(teeOverlap));
+	teeOverlap.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (teeOverlap.hEvent == NULL)
+		ErrorExit(TEXT("CreateEvent(tee)"));
+	teeQueue = new bufferqueue(TEE_QUEUE_BUFS);
+	if (teeCmd != NULL)
+		start_tee(teeCmd);
+
+	if (!flowSpecs.empty()) {
+		std::string why;
+
+		flow = new flowgraph(make_sink, queueLimit * ABUFFER_SIZE, queuePolicy == QUEUE_DROP);
+		for (const std::string &spec : flowSpecs) {
+			if (!flow->add(spec, why)) {
+				fwprintf(stderr, L"-o %hs: %hs\n", spec.c_str(), why.c_str());
+				return (1);
+			}
+		}
+		if (flowCon != NULL && conFilter != NULL) {
+			fwprintf(stderr, L"-L and -X don't apply to an -o con chain; use grep-v in it\n");
+			return (1);
+		}
+	}
+
+	stdinConsole = GetConsoleMode(hStdin, &fdwStdinSavedmode) != FALSE;
+	if (stdinConsole) {
+		stdinModesaved = true;
+		flags = fdwStdinSavedmode;
+		flags |= ENABLE_VIRTUAL_TERMINAL_INPUT | ENABLE_EXTENDED_FLAGS;
+		flags &= ~(ENABLE_ECHO_INPUT |
+			ENABLE_LINE_INPUT |
+			ENABLE_MOUSE_INPUT |
+			ENABLE_WINDOW_INPUT);
+		if (!SetConsoleMode(hStdin, flags))
+			ErrorExit(TEXT("SetConsoleMode(stdin)"));
+	} else
+		start_stdin_thread();
+
+	setup_console_output();
 
 	OVERLAPPED pipeInOverlap;
 	ZeroMemory(&pipeInOverlap, sizeof(pipeInOverlap));
@@ -210,26 +698,48 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 	if (logOutOverlap.hEvent == NULL)
 		ErrorExit(TEXT("CreateEvent(logout)"));
 
-	auto logOutQueue = new bufferqueue();
+	hStdinIdle = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (hStdinIdle == NULL)
+		ErrorExit(TEXT("CreateEvent(stdin)"));
+
+	logOutQueue = new bufferqueue(queueLimit);
+	pipeOutQueue = new bufferqueue(queueLimit);
 	auto pipeInQueue = new bufferqueue();
-	auto pipeOutQueue = new bufferqueue();
 	pipeInQueue->push(new abuffer());
+
+	pick_output();
 	start_pipe_input(hPipe, &pipeInOverlap, pipeInQueue, hStdout, hLog, &logOutOverlap, logOutQueue);
 
 	for (;;) {
-		HANDLE hWaiters[4];
-		DWORD wait;
+		HANDLE hWaiters[8 + FLOW_MAXSINKS];
+		DWORD nwait = 8, wait;
 
-		hWaiters[0] = hStdin;					// stdin
+		hWaiters[0] = stdinPaused || stdinClosed ? hStdinIdle :	// stdin
+			stdinConsole ? hStdin : hStdinReady;
 		hWaiters[1] = pipeInOverlap.hEvent;		// pipe input
 		hWaiters[2] = pipeOutOverlap.hEvent;	// pipe output
 		hWaiters[3] = logOutOverlap.hEvent;		// log output
-
-		wait = WaitForMultipleObjects(sizeof(hWaiters)/sizeof(hWaiters[0]), hWaiters, FALSE, INFINITE);
+		hWaiters[4] = recOverlap.hEvent;		// recording output
+		hWaiters[5] = teeOverlap.hEvent;		// filter output
+		hWaiters[6] = hDioTimer;				// -u tail write
+		hWaiters[7] = pkOverlap.hEvent;		// -k index output
+		if (flow != NULL)
+			nwait += flow->events(&hWaiters[8]);	// -o sinks
+
+		if (hexView != NULL && stdoutConsole)
+			hexView->partial(stdoutBuf);	// shown until its line fills
+		if (!stdout_flush())
+			ErrorExit(TEXT("WriteFile(stdout)"));
+
+		// alertable, for -u's write completions
+		wait = WaitForMultipleObjectsEx(nwait, hWaiters, FALSE, INFINITE, TRUE);
 		switch (wait) {
 		case WAIT_OBJECT_0 + 0:
 			// stdin
-			wait = handle_stdin(hStdin, hPipe, &pipeOutOverlap, pipeOutQueue);
+			if (stdinConsole)
+				wait = handle_stdin(hStdin, hPipe, &pipeOutOverlap, pipeOutQueue);
+			else
+				wait = handle_stdin_redirected(hPipe, &pipeOutOverlap, pipeOutQueue);
 			break;
 		case WAIT_OBJECT_0 + 1:
 			// pipe input
@@ -243,6 +753,36 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 			// log output
 			wait = handle_async_out(hLog, &logOutOverlap, logOutQueue);
 			break;
+		case WAIT_OBJECT_0 + 4:
+			// recording output
+			wait = handle_async_out(hRec, &recOverlap, recOutQueue);
+			break;
+		case WAIT_OBJECT_0 + 5:
+			// filter output; losing the filter doesn't end the session
+			if (handle_async_out(hTee, &teeOverlap, teeQueue) != WAITER_SUCCESS)
+				tee_failed();
+			wait = WAITER_SUCCESS;
+			break;
+		case WAIT_OBJECT_0 + 6: {
+			// get the partial buffer out once output has gone quiet
+			ULONGLONG quiet = GetTickCount64() - dioLastPut;
+			diobuf *b;
+
+			dioTimerArmed = false;
+			wait = WAITER_SUCCESS;
+			if (quiet < DIO_TAIL_MS)
+				wait = dio_arm((DWORD)(DIO_TAIL_MS - quiet)) ? WAITER_SUCCESS : WAITER_IO_ERROR;
+			else if ((b = dioLog->tail()) != NULL)
+				dio_write(b);
+			break;
+		}
+		case WAIT_OBJECT_0 + 7:
+			// index output
+			wait = handle_async_out(hPk, &pkOverlap, pkOutQueue);
+			break;
+		case WAIT_IO_COMPLETION:
+			wait = WAITER_SUCCESS;
+			break;
 		case WAIT_TIMEOUT:
 			ErrorExit(TEXT("wait timeout\n"));
 			break;
@@ -251,24 +791,102 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 			ErrorExit(TEXT("wait failed"));
 			break;
 		default:
+			// an -o sink's write; a sink that fails just stops
+			if (wait >= WAIT_OBJECT_0 + 8 && wait < WAIT_OBJECT_0 + nwait) {
+				wait = flow->complete(wait - WAIT_OBJECT_0 - 8);
+				break;
+			}
 			ErrorExit(TEXT("wait dunno"));
 			break;
 		}
 
+		if (dioError != 0) {
+			SetLastError(dioError);
+			ErrorExit(TEXT("log write"));
+		}
 		if (wait == WAITER_IO_ERROR)
 			ErrorExit(TEXT("IOWAITER error"));
 		if (wait == WAITER_EXIT_NORMAL)
 			break;
+
+		// start reading again once full queues have drained
+		if (pipeInPaused && !pipe_in_blocked()) {
+			pipeInPaused = false;
+			if (start_pipe_input(hPipe, &pipeInOverlap, pipeInQueue, hStdout, hLog, &logOutOverlap, logOutQueue) != WAITER_SUCCESS)
+				ErrorExit(TEXT("IOWAITER error"));
+		}
+		stdinPaused = stdin_blocked();
+		if (stdinClosed && pipeOutQueue->empty())
+			break;
+
+		// log writes that completed, for -y (-t does its own)
+		if (hFlushThread != NULL && logRing == NULL)
+			log_progress(log_written(&logOutOverlap));
+	}
+
+	// what the -o filters hold, which may be for the console
+	if (flow != NULL)
+		flow->finish();
+	if (hexView != NULL)
+		hexView->flush(stdoutBuf);
+	else if (conFilter != NULL)
+		conFilter->flush([](const __int8 *p, DWORD n) { return con_output(hStdout, p, n) != FALSE; });
+
+	// the last, unterminated line
+	if (logFilter != NULL || logDedup != NULL)
+		log_filtered(hLog, &logOutOverlap, logOutQueue, NULL, 0, true);
+	if (pkIndex != NULL) {
+		finish_index();
+		drain_log(hPk, &pkOverlap, pkOutQueue);
+	}
+
+	if (recorder != NULL) {
+		finish_recording();
+		drain_log(hRec, &recOverlap, recOutQueue);
 	}
 
-	drain_log(hLog, &logOutOverlap, logOutQueue);
+	stdout_flush();
 	restore_terminal();
+	if (hTee != NULL)
+		stop_tee();
+	if (flow != NULL)
+		flow->drain();
+	if (logRing != NULL)
+		stop_log_thread();
+	else {
+		if (dioLog != NULL)
+			dio_drain();
+		else
+			drain_log(hLog, &logOutOverlap, logOutQueue);
+		if (hFlushThread != NULL)
+			log_progress(log_written(&logOutOverlap));
+	}
+	if (hFlushThread != NULL)
+		stop_flush_thread();
+	queue_report();
 	return (0);
 }
 
+// The stages for the session's options (see cuspath). -f can fail
+// later, which raw_all copes with.
+void
+pick_output(void) {
+	pipeOut = outpaths<cuspath>::pick(sback != NULL || recorder != NULL || hTee != NULL || flow != NULL || conFilter != NULL,
+		logFilter != NULL || logDedup != NULL,
+		hLog == NULL ? OUTLOG_NONE : logRing != NULL ? OUTLOG_RING : dioLog != NULL ? OUTLOG_DIRECT :
+		queuePolicy == QUEUE_DROP ? OUTLOG_DROP : OUTLOG_QUEUE,
+		pkIndex != NULL);
+}
+
 void
 usage(const wchar_t *name) {
-	fwprintf(stderr, L"%s [-l log] pipe\n%s -i pipe\n", name, name);
+	fwprintf(stderr, L"%s [-b MB] [-l log [-cdktu] [-y sync]] [-r recording] [-f|-F filter] [-o spec]... [-q KB[:drop]]\n"
+		L"    [-L level] [-X prefix]... pipe\n%s -i pipe|pattern\n"
+		L"%s -p recording [-s speed] [-S seconds]\n%s -H control [-w workers] [pipe log]...\n"
+		L"-o [filter,...]sink adds an output; filters are strip, dedup, grep:text and grep-v:text,\n"
+		L"sinks are file:path, cmd:command, tcp:host:port and con\n"
+		L"-L shows the console lines with a printk level below level, -X hides those starting with prefix\n",
+		name, name, name, name);
 }
 
 BOOL
@@ -336,6 +954,22 @@ ErrorExit(LPCWSTR lpszMessage)
 	ExitProcess(1);
 }
 
+void
+setup_console_output(void) {
+	DWORD flags;
+
+	stdoutConsole = GetConsoleMode(hStdout, &fdwStdoutSavedmode) != FALSE;
+	if (!stdoutConsole)
+		return;
+	stdoutModesaved = true;
+	flags = fdwStdoutSavedmode;
+	flags |= ENABLE_VIRTUAL_TERMINAL_PROCESSING |
+		DISABLE_NEWLINE_AUTO_RETURN |
+		ENABLE_WRAP_AT_EOL_OUTPUT;
+	if (!SetConsoleMode(hStdout, flags))
+		ErrorExit(TEXT("SetConsoleMode(stdout)"));
+}
+
 void
 restore_terminal(void) {
 	if (stdinModesaved)
@@ -344,29 +978,42 @@ restore_terminal(void) {
 		SetConsoleMode(hStdout, fdwStdoutSavedmode);
 }
 
-enum TermState {
-	STATE_INIT,
-	STATE_NEWLINE,
-	STATE_TILDE,
-	STATE_DOT
-};
+TermState search_key(TermState state, char k);
 
 DWORD handle_stdin(HANDLE hInput, HANDLE hOutput, OVERLAPPED *olap, bufferqueue *bufq) {
 	static TermState state = STATE_NEWLINE;
+	static WCHAR surrogate;
 	INPUT_RECORD inrecs[ABUFFER_SIZE];
-	DWORD nlen, rlen;
+	std::string keys;
+	DWORD nlen;
 
 	if (!ReadConsoleInput(hInput, inrecs, ABUFFER_SIZE, &nlen))
 		return WAITER_IO_ERROR;
 
-	auto abuf = new abuffer();
-	rlen = 0;
 	for (DWORD i = 0; i < nlen; i++) {
 		switch (inrecs[i].EventType) {
-		case KEY_EVENT:
-			if (inrecs[i].Event.KeyEvent.bKeyDown && inrecs[i].Event.KeyEvent.uChar.AsciiChar != 0)
-				abuf->add(inrecs[i].Event.KeyEvent.uChar.AsciiChar);
+		case KEY_EVENT: {
+			WCHAR wc = inrecs[i].Event.KeyEvent.uChar.UnicodeChar;
+			unsigned cp;
+			char u8[4];
+
+			if (!inrecs[i].Event.KeyEvent.bKeyDown || wc == 0)
+				break;
+			// Characters outside the BMP arrive as two key events.
+			if (wc >= 0xd800 && wc <= 0xdbff) {
+				surrogate = wc;
+				break;
+			}
+			if (wc >= 0xdc00 && wc <= 0xdfff) {
+				if (surrogate == 0)
+					break;
+				cp = 0x10000 + ((surrogate - 0xd800) << 10) + (wc - 0xdc00);
+			} else
+				cp = wc;
+			surrogate = 0;
+			keys.append(u8, utf8_encode(cp, u8));
 			break;
+		}
 		case MOUSE_EVENT:
 		case WINDOW_BUFFER_SIZE_EVENT:
 		case FOCUS_EVENT:
@@ -377,38 +1024,177 @@ DWORD handle_stdin(HANDLE hInput, HANDLE hOutput, OVERLAPPED *olap, bufferqueue
 		}
 	}
 
-	if (abuf->empty()) {
-		delete abuf;
+	if (keys.empty())
 		return WAITER_SUCCESS;
-	}
 
-	for (DWORD i = 0; i < abuf->size(); i++) {
-		switch (state) {
-		case STATE_INIT:
-			if (abuf->at(i) == '\r')
-				state = STATE_NEWLINE;
+	// ~. exits, ~/ searches, ~q shows the queues, ~x switches between
+	// text and hex, ~0 to ~8 set -L (see escape.h).
+	std::string out;
+	for (DWORD i = 0; i < keys.size(); i++) {
+		char k = keys[i];
+
+		if (state == STATE_SEARCH || state == STATE_BROWSE) {
+			state = search_key(state, k);
+			continue;
+		}
+		switch (esc_step(&state, k, "./qx012345678", out)) {
+		case '.':
+			return WAITER_EXIT_NORMAL;
+		case '/':
+			if (search_start())
+				state = STATE_SEARCH;
 			break;
-		case STATE_NEWLINE:
-			if (abuf->at(i) == '~')
-				state = STATE_TILDE;
-			else if (abuf->at(i) == '\r')
-				state = STATE_NEWLINE;
-			else
-				state = STATE_INIT;
+		case 'q':
+			queue_status();
 			break;
-		case STATE_TILDE:
-			if (abuf->at(i) == '.') {
-				delete abuf;
-				return WAITER_EXIT_NORMAL;
+		case 'x':
+			hex_toggle();
+			break;
+		case 0:
+			break;
+		default:
+			con_level(k - '0');
+			break;
+		}
+	}
+
+	if (out.empty())
+		return WAITER_SUCCESS;
+	if (queuePolicy == QUEUE_DROP && bufq->full()) {
+		bufq->dropped((DWORD)out.size());
+		return WAITER_SUCCESS;
+	}
+	if (rec_chunk(REC_DIR_IN, (const __int8 *)out.data(), (DWORD)out.size()) != WAITER_SUCCESS)
+		return WAITER_IO_ERROR;
+	return queue_bytes(hOutput, olap, bufq, out);
+}
+
+// Console output for ~/ itself.
+void con_puts(const char *s) {
+	ui_write((const __int8 *)s, (DWORD)strlen(s));
+}
+
+// Messages for the user go to the console, which is stderr if stdout
+// has been redirected.
+void ui_write(const __int8 *p, DWORD n) {
+	DWORD nlen;
+
+	if (stdoutConsole)
+		console_write(hStdout, p, n);
+	else
+		WriteFileAll(GetStdHandle(STD_ERROR_HANDLE), p, n, &nlen);
+}
+
+bool search_start(void) {
+	if (sback == NULL) {
+		con_puts("\r\n[no scrollback, see -b]\r\n");
+		return false;
+	}
+	conPaused = true;
+	conPausedAt = sback->end();
+	searchPat.clear();
+	con_puts("\r\n\x1b[7m/\x1b[m");
+	return true;
+}
+
+// Leave the search and catch the console up on what it missed.
+void search_end(void) {
+	std::string missed;
+
+	con_puts("\r\n");
+	conPaused = false;
+	if (flowCon != NULL) {
+		flowCon->resume();
+		return;
+	}
+	if (conPausedAt < sback->begin())
+		con_puts("[scrollback overrun; some output not shown]\r\n");
+	for (unsigned long long off = conPausedAt; off < sback->end(); off += missed.size()) {
+		missed.clear();
+		sback->copy(off, SB_CHUNK, missed);
+		if (off < sback->begin())
+			off = sback->begin();
+		con_guest(hStdout, (const __int8 *)missed.data(), (DWORD)missed.size());
+	}
+}
+
+// Show a matching line with the match highlighted.
+void search_show(unsigned long long start) {
+	std::string line, out;
+	char hdr[64];
+	size_t at;
+
+	searchAt = start;
+	sback->line(start, line);
+	at = simd_memmem(line.data(), line.size(), searchPat.data(), searchPat.size());
+	snprintf(hdr, sizeof(hdr), "\r\n\x1b[7m[-%zu]\x1b[m ", sback->linesafter(start));
+	out = hdr;
+	out.append(line, 0, at);
+	out.append("\x1b[7m");
+	out.append(searchPat);
+	out.append("\x1b[m");
+	out.append(line, at + searchPat.size(), std::string::npos);
+	ui_write((const __int8 *)out.data(), (DWORD)out.size());
+}
+
+// Keys while ~/ is active: type a pattern and Enter, then n/N for the
+// next older/newer match; any other key (or Esc while typing) ends it.
+TermState search_key(TermState state, char k) {
+	unsigned long long start;
+
+	if (state == STATE_SEARCH) {
+		if (k == '\r') {
+			if (searchPat.empty()) {
+				search_end();
+				return STATE_NEWLINE;
 			}
-			if (abuf->at(i) == '\r')
-				state = STATE_NEWLINE;
-			else
-				state = STATE_INIT;
+			if (!sback->findprev(searchPat, sback->end(), &start)) {
+				con_puts("\r\n[not found]");
+				search_end();
+				return STATE_NEWLINE;
+			}
+			search_show(start);
+			return STATE_BROWSE;
+		}
+		if (k == '\x1b') {
+			search_end();
+			return STATE_NEWLINE;
+		}
+		if (k == '\b' || k == '\x7f') {
+			if (searchPat.empty())
+				return state;
+			// drop a whole UTF-8 character
+			while (searchPat.size() > 1 && (searchPat.back() & 0xc0) == 0x80)
+				searchPat.pop_back();
+			searchPat.pop_back();
+			con_puts("\b \b");
+			return state;
+		}
+		if ((unsigned char)k >= 0x20) {
+			char echo[2] = { k, 0 };
+
+			searchPat.push_back(k);
+			con_puts(echo);
 		}
+		return state;
 	}
 
-	return start_async_out(hOutput, olap, bufq, abuf);
+	if (k == 'n') {
+		if (sback->findprev(searchPat, searchAt, &start))
+			search_show(start);
+		else
+			con_puts("\r\n[no older match]");
+		return state;
+	}
+	if (k == 'N') {
+		if (sback->findnext(searchPat, searchAt, &start))
+			search_show(start);
+		else
+			con_puts("\r\n[no newer match]");
+		return state;
+	}
+	search_end();
+	return STATE_NEWLINE;
 }
 
 DWORD start_pipe_input(HANDLE hInput, OVERLAPPED *inlap, bufferqueue *inq, HANDLE hOutput, HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq) {
@@ -418,6 +1204,14 @@ DWORD start_pipe_input(HANDLE hInput, OVERLAPPED *inlap, bufferqueue *inq, HANDL
 		if (inq->empty() == 0)
 			inq->push(new abuffer());
 
+		// Leave the data in the pipe until full queues catch up.
+		if (pipe_in_blocked()) {
+			pipeInPaused = true;
+			if (!ResetEvent(inlap->hEvent))
+				return WAITER_IO_ERROR;
+			return WAITER_SUCCESS;
+		}
+
 		auto abuf = inq->front();
 		if (!ReadFile(hInput, abuf->getptr(), ABUFFER_SIZE, &dwLen, inlap)) {
 			DWORD error = GetLastError();
@@ -435,19 +1229,165 @@ DWORD start_pipe_input(HANDLE hInput, OVERLAPPED *inlap, bufferqueue *inq, HANDL
 	}
 }
 
+// A buffer from the pipe, down the session's output path.
 DWORD pipe_input_helper(HANDLE hOutput, HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq, abuffer *abuf) {
+	cuspath::ctx x = { hOutput, hLog, outlap, outq };
+
+	return pipeOut(x, abuf);
+}
+
+// Everything that gets the raw output, when there's more than the
+// console.
+DWORD raw_output(HANDLE hOutput, const __int8 *p, DWORD n) {
+	pipeBytes += n;
+	if (sback != NULL)
+		sback->append(p, n);
+
+	// Synchronous write to stdout, unless an -o chain has the console
+	if (flowCon == NULL && !conPaused && !con_guest(hOutput, p, n))
+		return WAITER_IO_ERROR;
+	if (rec_chunk(REC_DIR_OUT, p, n) != WAITER_SUCCESS)
+		return WAITER_IO_ERROR;
+	tee_chunk(p, n);
+	if (flow != NULL && flow->put(p, n) != WAITER_SUCCESS)
+		return WAITER_IO_ERROR;
+	return WAITER_SUCCESS;
+}
+
+// Log output through -c and/or -d. last flushes whatever they hold.
+DWORD log_filtered(HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq, const __int8 *p, DWORD n, bool last) {
+	return log_bytes(hLog, outlap, outq, log_clean(p, n, last));
+}
+
+// What -c and/or -d make of n more bytes, to be logged and cleared.
+std::string &
+log_clean(const __int8 *p, DWORD n, bool last) {
+	if (logFilter != NULL) {
+		logFilter->filter(p, n, logClean);
+		if (last)
+			logFilter->flush(logClean);
+		if (logDedup == NULL)
+			return logClean;
+		p = (const __int8 *)logClean.data();
+		n = (DWORD)logClean.size();
+	}
+	logDedup->filter(p, n, logUniq);
+	if (last)
+		logDedup->flush(logUniq);
+	logClean.clear();
+	return logUniq;
+}
+
+// Write guest output to the console. ASCII goes out as is; anything
+// else is validated and transcoded to UTF-16 so the console shows it
+// regardless of its code page.
+BOOL console_write(HANDLE hOutput, const __int8 *p, DWORD n) {
 	DWORD nlen;
 
-	if (abuf->empty()) {
-		delete abuf;
-		return WAITER_SUCCESS;
+	if (!stdoutConsole) {
+		stdoutBuf.append((const char *)p, n);
+		return stdoutBuf.size() < STDOUT_BUFSIZE || stdout_flush();
 	}
+	if (conDecoder.passthrough(p, n))
+		return WriteFileAll(hOutput, p, n, &nlen);
 
-	// Synchronous write to stdout
-	if (!WriteFileAll(hOutput, abuf->getptr(), abuf->size(), &nlen))
-		return WAITER_IO_ERROR;
+	conWide.clear();
+	conDecoder.decode(p, n, conWide);
+	for (DWORD off = 0; off < conWide.size(); off += nlen) {
+		if (!WriteConsoleW(hOutput, conWide.data() + off, (DWORD)conWide.size() - off, &nlen, NULL))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+// Guest output for the console: text, or with ~x hex dump lines. Those
+// are gathered in stdoutBuf, so a flood goes out in large writes.
+BOOL con_output(HANDLE hOutput, const __int8 *p, DWORD n) {
+	if (hexView == NULL)
+		return console_write(hOutput, p, n);
+	hexView->format(p, n, stdoutBuf);
+	return stdoutBuf.size() < STDOUT_BUFSIZE || stdout_flush();
+}
+
+// Guest output for the console, less what -L and -X take out.
+BOOL con_guest(HANDLE hOutput, const __int8 *p, DWORD n) {
+	if (conFilter == NULL || hexView != NULL)
+		return con_output(hOutput, p, n);
+	return conFilter->filter(p, n, [hOutput](const __int8 *q, DWORD m) { return con_output(hOutput, q, m) != FALSE; });
+}
+
+// ~0 to ~8
+void con_level(unsigned level) {
+	char buf[96];
+
+	if (flowCon != NULL) {
+		con_puts("\r\n[the console is an -o chain; see grep-v]\r\n");
+		return;
+	}
+	if (conFilter == NULL) {
+		conFilter = new confilter();
+		pick_output();
+	}
+	conFilter->setlevel(level);
+	if (level == CF_ALL)
+		snprintf(buf, sizeof(buf), "\r\n[console: all levels, %llu lines hidden]\r\n", conFilter->dropped());
+	else
+		snprintf(buf, sizeof(buf), "\r\n[console: levels below %u, %llu lines hidden]\r\n", level, conFilter->dropped());
+	con_puts(buf);
+}
+
+// ~x
+void hex_toggle(void) {
+	if (hexView == NULL) {
+		hexView = new hexdump(pipeBytes);
+		con_puts("\x1b[m\r\n[hex]\r\n");	// out of any colours the output left set
+		return;
+	}
+	hexView->flush(stdoutBuf);
+	delete hexView;
+	hexView = NULL;
+	stdout_flush();
+	con_puts("[text]\r\n");
+}
+
+// Write out what redirected stdout (or ~x) has gathered.
+BOOL stdout_flush(void) {
+	DWORD nlen;
+
+	if (stdoutBuf.empty())
+		return TRUE;
+	if (!WriteFileAll(hStdout, stdoutBuf.data(), (DWORD)stdoutBuf.size(), &nlen))
+		return FALSE;
+	stdoutBuf.clear();
+	return TRUE;
+}
+
+// Queue a run of bytes for an async writer, ABUFFER_SIZE at a time.
+DWORD queue_bytes(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq, const std::string &bytes) {
+	return abuffer_split((const __int8 *)bytes.data(), (DWORD)bytes.size(),
+		[&](abuffer *abuf) { return start_async_out(h, olap, bufq, abuf); });
+}
+
+// Hand a buffer to whichever log writer and index are in use.
+DWORD log_buffer(HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq, abuffer *abuf) {
+	cuspath::ctx x = { NULL, hLog, outlap, outq };
+
+	if (logRing != NULL)
+		return cuspath::log_ring::put<cuspath::index_any>(x, abuf);
+	if (dioLog != NULL)
+		return cuspath::log_direct::put<cuspath::index_any>(x, abuf);
+	if (hLog == NULL)
+		return cuspath::log_none::put<cuspath::index_any>(x, abuf);
+	if (queuePolicy == QUEUE_DROP)
+		return cuspath::log_drop::put<cuspath::index_any>(x, abuf);
+	return cuspath::log_queue::put<cuspath::index_any>(x, abuf);
+}
 
-	return start_async_out(hLog, outlap, outq, abuf);
+// Log a run of bytes (e.g. filter output) and empty the string.
+DWORD log_bytes(HANDLE hLog, OVERLAPPED *outlap, bufferqueue *outq, std::string &bytes) {
+	cuspath::ctx x = { NULL, hLog, outlap, outq };
+
+	return cuspath::chunks<cuspath::log_any, cuspath::index_any>(x, bytes);
 }
 
 // handle pipe input:
@@ -471,118 +1411,834 @@ DWORD handle_pipe_input(HANDLE hInput, OVERLAPPED *inlap, bufferqueue *inq, HAND
 	return start_pipe_input(hInput, inlap, inq, hOutput, hLog, outlap, outq);
 }
 
-DWORD start_async_out(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq, abuffer *abuf) {
-	DWORD nlen;
+// -q KB[:block|:drop]
+bool
+parse_queue(const wchar_t *arg) {
+	unsigned long kb;
+	wchar_t *end;
+
+	kb = wcstoul(arg, &end, 10);
+	if (end == arg || kb == 0 || kb > 4 * 1024 * 1024)
+		return false;
+	if (wcscmp(end, L":drop") == 0)
+		queuePolicy = QUEUE_DROP;
+	else if (*end == 0 || wcscmp(end, L":block") == 0)
+		queuePolicy = QUEUE_BLOCK;
+	else
+		return false;
+	queueLimit = ((size_t)kb * 1024 + ABUFFER_SIZE - 1) / ABUFFER_SIZE;
+	return true;
+}
+
+// Whether pipe reads should stop (or stay stopped): -F's filter, or
+// with -q block the log, recording or an -o sink, is behind.
+bool
+pipe_in_blocked(void) {
+	if (teeBlock && hTee != NULL && teeQueue->blocked(pipeInPaused))
+		return true;
+	if (flow != NULL && flow->blocked(pipeInPaused))
+		return true;
+	if (queuePolicy != QUEUE_BLOCK)
+		return false;
+	return logOutQueue->blocked(pipeInPaused) || (recorder != NULL && recOutQueue->blocked(pipeInPaused)) ||
+		(pkIndex != NULL && pkOutQueue->blocked(pipeInPaused));
+}
+
+// The same for keyboard input, which feeds the pipe and the recording.
+bool
+stdin_blocked(void) {
+	if (queuePolicy != QUEUE_BLOCK)
+		return false;
+	return pipeOutQueue->blocked(stdinPaused) || (recorder != NULL && recOutQueue->blocked(stdinPaused));
+}
+
+static void
+queue_line(std::string &s, const char *name, bufferqueue *q) {
+	char buf[128];
 
-	if (h == NULL) {
-		delete abuf;
+	snprintf(buf, sizeof(buf), "\r\n  %-9s %7zu KB of %zu KB, peak %zu KB", name,
+		q->size() * ABUFFER_SIZE / 1024, q->limit() * ABUFFER_SIZE / 1024, q->peak() * ABUFFER_SIZE / 1024);
+	s += buf;
+	if (q->dropped() != 0) {
+		snprintf(buf, sizeof(buf), ", %llu bytes dropped", q->dropped());
+		s += buf;
+	}
+}
+
+// ~q: how full each writer's buffers are, and what's been lost.
+void
+queue_status(void) {
+	std::string s = "\r\n[queues, ";
+	char buf[128];
+
+	s += queuePolicy == QUEUE_DROP ? "drop when full" : "block when full";
+	if (pipeInPaused)
+		s += ", pipe reads stopped";
+	s += "]";
+	queue_line(s, "pipe", pipeOutQueue);
+	if (logRing != NULL) {
+		snprintf(buf, sizeof(buf), "\r\n  %-9s %7llu KB of %u KB (-t), %llu bytes dropped", "log",
+			logRing->pending() / 1024, LOGRING_SIZE / 1024, logRing->lost());
+		s += buf;
+	} else if (dioLog != NULL) {
+		snprintf(buf, sizeof(buf), "\r\n  %-9s %7llu KB of %u KB (-u)", "log",
+			(dioLog->size() - dioLog->written()) / 1024, DIO_NBUFS * DIO_BUFSIZE / 1024);
+		s += buf;
+	} else if (hLog != NULL)
+		queue_line(s, "log", logOutQueue);
+	if (recorder != NULL)
+		queue_line(s, "recording", recOutQueue);
+	if (pkIndex != NULL)
+		queue_line(s, "index", pkOutQueue);
+	if (hTee != NULL) {
+		queue_line(s, "filter", teeQueue);
+		if (teeDropped != 0) {
+			snprintf(buf, sizeof(buf), ", %llu bytes dropped", teeDropped);
+			s += buf;
+		}
+	}
+	if (flow != NULL)
+		flow_status(s);
+	s += "\r\n";
+	con_puts(s.c_str());
+}
+
+// At exit: what -q drop threw away.
+void
+queue_report(void) {
+	if (pipeOutQueue->dropped() != 0)
+		fwprintf(stderr, L"pipe: queue full, %llu bytes of input dropped\n", pipeOutQueue->dropped());
+	if (logOutQueue->dropped() != 0)
+		fwprintf(stderr, L"log: queue full, %llu bytes dropped\n", logOutQueue->dropped());
+	if (recOutQueue->dropped() != 0)
+		fwprintf(stderr, L"recording: queue full, %llu bytes of chunks dropped\n", recOutQueue->dropped());
+	if (pkOutQueue->dropped() != 0)
+		fwprintf(stderr, L"index: queue full, %llu bytes of blocks dropped\n", pkOutQueue->dropped());
+	if (flow != NULL)
+		flow_report();
+}
+
+void
+start_recording(const wchar_t *name) {
+	FILETIME ft;
+	ULARGE_INTEGER now;
+
+	hRec = CreateFile(name, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (hRec == INVALID_HANDLE_VALUE)
+		ErrorExit(name);
+	QueryPerformanceFrequency(&recFreq);
+	QueryPerformanceCounter(&recStart);
+
+	// FILETIME counts 100ns from 1601; the header wants us from 1970.
+	GetSystemTimeAsFileTime(&ft);
+	now.LowPart = ft.dwLowDateTime;
+	now.HighPart = ft.dwHighDateTime;
+
+	recorder = new recwriter();
+	recorder->start((now.QuadPart - 116444736000000000ULL) / 10, recScratch);
+	queue_bytes(hRec, &recOverlap, recOutQueue, recScratch);
+	recScratch.clear();
+}
+
+// Record a chunk in either direction, stamped with the time since start.
+DWORD
+rec_chunk(int dir, const __int8 *p, DWORD n) {
+	LARGE_INTEGER t;
+	DWORD ret;
+
+	if (recorder == NULL)
+		return WAITER_SUCCESS;
+	// Drop whole records, so the file stays readable.
+	if (queuePolicy == QUEUE_DROP && recOutQueue->full()) {
+		recOutQueue->dropped(n);
 		return WAITER_SUCCESS;
 	}
+	QueryPerformanceCounter(&t);
+	t.QuadPart -= recStart.QuadPart;
+	recorder->record((t.QuadPart / recFreq.QuadPart) * 1000000 +
+		(t.QuadPart % recFreq.QuadPart) * 1000000 / recFreq.QuadPart, dir, p, n, recScratch);
+	ret = queue_bytes(hRec, &recOverlap, recOutQueue, recScratch);
+	recScratch.clear();
+	return ret;
+}
+
+void
+finish_recording(void) {
+	recorder->finish(recScratch);
+	queue_bytes(hRec, &recOverlap, recOutQueue, recScratch);
+	recScratch.clear();
+}
+
+void
+start_index(const wchar_t *logName) {
+	std::wstring name = std::wstring(logName) + L".pk";
+
+	hPk = CreateFile(name.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (hPk == INVALID_HANDLE_VALUE)
+		ErrorExit(name.c_str());
+	pkIndex = new pkindex();
+}
+
+// Index n bytes the log has taken, stamped with the time now.
+DWORD
+pk_log(const __int8 *p, DWORD n) {
+	FILETIME ft;
+	ULARGE_INTEGER now;
+	DWORD ret;
 
-	if (abuf != NULL && !bufq->empty()) {
-		// already chewing on something, queue and go.
-		bufq->push(abuf);
+	if (n == 0)
+		return WAITER_SUCCESS;
+	GetSystemTimeAsFileTime(&ft);
+	now.LowPart = ft.dwLowDateTime;
+	now.HighPart = ft.dwHighDateTime;
+	pkIndex->feed(p, n, (now.QuadPart - 116444736000000000ULL) / 10, pkScratch);
+	if (pkScratch.empty())
+		return WAITER_SUCCESS;
+	// Drop whole blocks, so the file stays readable.
+	if (queuePolicy == QUEUE_DROP && pkOutQueue->full()) {
+		pkOutQueue->dropped((DWORD)pkScratch.size());
+		pkScratch.clear();
 		return WAITER_SUCCESS;
 	}
+	ret = queue_bytes(hPk, &pkOverlap, pkOutQueue, pkScratch);
+	pkScratch.clear();
+	return ret;
+}
 
-	if (abuf != NULL)
-		bufq->push(abuf);
-	while (!bufq->empty()) {
-		abuf = bufq->front();
-		
-		if (!WriteFile(h, abuf->getptr(), abuf->size(), &nlen, olap)) {
-			DWORD error = GetLastError();
-			if (error == ERROR_IO_PENDING)
-				return WAITER_SUCCESS;
-			return WAITER_IO_ERROR;
-		}
+void
+finish_index(void) {
+	pkIndex->flush(pkScratch);
+	queue_bytes(hPk, &pkOverlap, pkOutQueue, pkScratch);
+	pkScratch.clear();
+}
 
-		// Write completed synchronously
-		add_offset(nlen, olap);
-		abuf->advance(nlen);
-		if (abuf->empty()) {
-			bufq->pop();
-			delete abuf;
-		}
+// A sliding read-only view of a file, so replay can walk recordings of
+// any size without mapping (or reading) all of them at once.
+struct mapwindow {
+	HANDLE hMap;
+	ULONGLONG size;
+	const unsigned char *view;
+	ULONGLONG base;
+	SIZE_T len;
+	DWORD gran;
+
+	const unsigned char *at(ULONGLONG off, SIZE_T *avail);
+};
+
+// Bytes at off, with at least a whole record's worth behind them unless
+// the file ends first. The pointer is good until the next call.
+const unsigned char *
+mapwindow::at(ULONGLONG off, SIZE_T *avail) {
+	if (view == NULL || off < base ||
+	    (off + REC_MAXRECORD + 32 > base + len && base + len < size)) {
+		ULARGE_INTEGER nb;
+
+		if (view != NULL)
+			UnmapViewOfFile(view);
+		nb.QuadPart = off - off % gran;
+		base = nb.QuadPart;
+		len = (SIZE_T)(size - base < REC_WINDOW ? size - base : REC_WINDOW);
+		view = (const unsigned char *)MapViewOfFile(hMap, FILE_MAP_READ, nb.HighPart, nb.LowPart, len);
+		if (view == NULL)
+			ErrorExit(TEXT("MapViewOfFile"));
 	}
+	*avail = (SIZE_T)(base + len - off);
+	return view + (off - base);
+}
 
-	// If we're here, all our writes are done, relax
-	if (!ResetEvent(olap->hEvent))
-		return WAITER_IO_ERROR;
+void
+start_tee(const wchar_t *cmd) {
+	hTee = start_child(cmd, &hTeeProc);
+}
+
+// Start cmd with its stdin on a pipe we write asynchronously, for -f
+// and -o cmd:. Anonymous pipes can't do overlapped I/O, so this is a
+// named pipe with a single instance; the child shares our console.
+// Returns our end of the pipe.
+HANDLE
+start_child(const wchar_t *cmd, HANDLE *proc) {
+	static unsigned nchild;
+	SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+	STARTUPINFO si;
+	PROCESS_INFORMATION pi;
+	wchar_t name[64];
+	HANDLE hOurs, hChild;
+	std::wstring cmdline(cmd);
+
+	swprintf(name, sizeof(name) / sizeof(name[0]), L"\\\\.\\pipe\\cus-filter-%u-%u", GetCurrentProcessId(), nchild++);
+	hOurs = CreateNamedPipe(name, PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_REJECT_REMOTE_CLIENTS, 1, ABUFFER_SIZE * 64, 0, 0, NULL);
+	if (hOurs == INVALID_HANDLE_VALUE)
+		ErrorExit(TEXT("CreateNamedPipe(filter)"));
+	hChild = CreateFile(name, GENERIC_READ, 0, &sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hChild == INVALID_HANDLE_VALUE)
+		ErrorExit(TEXT("CreateFile(filter)"));
+
+	ZeroMemory(&si, sizeof(si));
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = hChild;
+	si.hStdOutput = hStdout;
+	si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+	SetHandleInformation(si.hStdOutput, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+	SetHandleInformation(si.hStdError, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+	if (!CreateProcess(NULL, &cmdline[0], NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+		ErrorExit(cmd);
+	CloseHandle(hChild);
+	CloseHandle(pi.hThread);
+	*proc = pi.hProcess;
+	return hOurs;
+}
+
+// Copy pipe output to the filter. In -f mode a full queue drops the
+// chunk; in -F mode start_pipe_input stops reading before it fills.
+DWORD
+tee_chunk(const __int8 *p, DWORD n) {
+	if (hTee == NULL)
+		return WAITER_SUCCESS;
+	if (!teeBlock && teeQueue->full()) {
+		teeDropped += n;
+		return WAITER_SUCCESS;
+	}
+
+	auto abuf = new abuffer();
+	memcpy(abuf->getptr(), p, n);
+	abuf->size(n);
+	if (start_async_out(hTee, &teeOverlap, teeQueue, abuf) != WAITER_SUCCESS)
+		tee_failed();
 	return WAITER_SUCCESS;
 }
 
-DWORD handle_async_out(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq) {
+// The filter went away (or its pipe broke): carry on without it.
+void
+tee_failed(void) {
+	fwprintf(stderr, L"\r\nfilter: write failed (error %u), no longer filtering\r\n", GetLastError());
+	CancelIo(hTee);
+	CloseHandle(hTee);
+	hTee = NULL;
+	while (!teeQueue->empty()) {
+		delete teeQueue->front();
+		teeQueue->pop();
+	}
+	ResetEvent(teeOverlap.hEvent);
+}
+
+// Give the filter a moment to take the rest and finish, so its last
+// output lands before we exit.
+void
+stop_tee(void) {
+	ULONGLONG deadline = GetTickCount64() + TEE_DRAIN_MS;
 	DWORD len;
 
-	if (bufq->empty()) {
-		if (!ResetEvent(olap->hEvent))
-			return WAITER_IO_ERROR;
-		return WAITER_SUCCESS;
+	while (!teeQueue->empty()) {
+		ULONGLONG now = GetTickCount64();
+
+		if (now >= deadline ||
+		    WaitForSingleObject(teeOverlap.hEvent, (DWORD)(deadline - now)) != WAIT_OBJECT_0 ||
+		    handle_async_out(hTee, &teeOverlap, teeQueue) != WAITER_SUCCESS)
+			break;
+	}
+	if (!teeQueue->empty()) {
+		fwprintf(stderr, L"filter: gave up with %zu buffers unwritten\n", teeQueue->size());
+		CancelIo(hTee);
+		GetOverlappedResult(hTee, &teeOverlap, &len, TRUE);
 	}
+	CloseHandle(hTee);
+	WaitForSingleObject(hTeeProc, TEE_DRAIN_MS);
+	if (teeDropped != 0)
+		fwprintf(stderr, L"filter: fell behind, %llu bytes dropped\n", teeDropped);
+}
 
-	if (!GetOverlappedResult(h, olap, &len, FALSE))
-		return WAITER_IO_ERROR;
-	add_offset(len, olap);
+// A file, process or socket written by an -o chain.
+class winsink : public ovsink {
+private:
+	HANDLE proc;		// cmd: the process, given a moment to finish
+	bool sock;
+public:
+	winsink(const std::string &n, HANDLE file, HANDLE p, bool s, HANDLE ev, size_t limit, bool d) :
+	    ovsink(n, file, ev, limit, d), proc(p), sock(s) {}
+	void close(void);
+};
+
+void
+winsink::close(void) {
+	DWORD len;
 
-	auto abuf = bufq->front();
-	abuf->advance(len);
-	if (abuf->empty()) {
-		bufq->pop();
-		delete abuf;
+	if (h == NULL)
+		return;
+	if (broken)
+		fwprintf(stderr, L"\r\n%hs: write failed (error %u), no longer written\r\n", name.c_str(), err);
+	CancelIo(h);
+	GetOverlappedResult(h, &ov, &len, TRUE);
+	if (sock)
+		closesocket((SOCKET)h);
+	else
+		CloseHandle(h);
+	h = NULL;
+	if (proc != NULL) {
+		WaitForSingleObject(proc, FLOW_DRAIN_MS);
+		CloseHandle(proc);
+		proc = NULL;
 	}
+}
 
-	return start_async_out(h, olap, bufq, NULL);
+DWORD
+consink::put(const slice &s) {
+	if (!conPaused)
+		return con_output(hStdout, s.data(), s.size()) ? WAITER_SUCCESS : WAITER_IO_ERROR;
+	if (q.full()) {
+		q.dropped(s.size());
+		return WAITER_SUCCESS;
+	}
+	q.push(s);
+	return WAITER_SUCCESS;
 }
 
+// ~/ has ended: show what came meanwhile.
 void
-add_offset(DWORD off, OVERLAPPED *olap) {
-	ULARGE_INTEGER pos;
+consink::resume(void) {
+	char buf[64];
+
+	while (!q.empty()) {
+		con_output(hStdout, q.front().data(), q.front().size());
+		q.advance(q.front().size());
+	}
+	if (q.dropped() != told) {
+		snprintf(buf, sizeof(buf), "[%llu bytes of output not shown]\r\n", q.dropped() - told);
+		con_puts(buf);
+		told = q.dropped();
+	}
+}
+
+// The sinks -o can end in. Files, processes and sockets that can't be
+// opened end cus, as -l and -r do; why is for specs that make no sense.
+flowsink *
+make_sink(const std::string &kind, const std::string &arg, size_t limit, bool drop, std::string &why) {
+	HANDLE h, proc = NULL, ev;
+	std::wstring warg = from_utf8(arg);
+
+	if (kind == "con") {
+		if (!arg.empty() || flowCon != NULL) {
+			why = "con takes no argument and comes once";
+			return NULL;
+		}
+		flowCon = new consink(limit);
+		return flowCon;
+	}
+	if (kind != "file" && kind != "cmd" && kind != "tcp") {
+		why = "no filter or sink called " + kind;
+		return NULL;
+	}
+	if (arg.empty()) {
+		why = kind + " needs an argument";
+		return NULL;
+	}
+	if (kind == "file") {
+		h = CreateFile(warg.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+		if (h == INVALID_HANDLE_VALUE)
+			ErrorExit(warg.c_str());
+	} else if (kind == "cmd")
+		h = start_child(warg.c_str(), &proc);
+	else if ((h = tcp_connect(arg, why)) == NULL)
+		return NULL;
+
+	ev = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (ev == NULL)
+		ErrorExit(TEXT("CreateEvent(-o)"));
+	return new winsink(kind + ":" + arg, h, proc, kind == "tcp", ev, limit, drop);
+}
+
+// tcp:HOST:PORT, HOST a name or an IPv4 or IPv6 address, the latter in
+// brackets. Each address the name has is tried in turn. Sockets from
+// socket() take overlapped WriteFile like any other handle.
+HANDLE
+tcp_connect(const std::string &arg, std::string &why) {
+	static bool started;
+	size_t colon = arg.rfind(':');
+	std::string host = arg.substr(0, colon), service;
+	struct addrinfo hints, *res, *ai;
+	unsigned long port;
+	char *end;
+	SOCKET s = INVALID_SOCKET;
+	WSADATA wsa;
+	int err = 0;
+
+	port = colon == std::string::npos ? 0 : strtoul(arg.c_str() + colon + 1, &end, 10);
+	if (port == 0 || port > 65535 || *end != 0 || host.empty()) {
+		why = "tcp needs host:port";
+		return NULL;
+	}
+	if (host.size() > 2 && host[0] == '[' && host.back() == ']')
+		host = host.substr(1, host.size() - 2);
+	if (!started) {
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+			ErrorExit(TEXT("WSAStartup"));
+		started = true;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	service = std::to_string(port);
+	if (getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0) {
+		fwprintf(stderr, L"%hs: unknown host\n", host.c_str());
+		ExitProcess(1);
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == INVALID_SOCKET) {
+			err = WSAGetLastError();
+			continue;
+		}
+		if (connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0)
+			break;
+		err = WSAGetLastError();
+		closesocket(s);
+		s = INVALID_SOCKET;
+	}
+	freeaddrinfo(res);
+	if (s == INVALID_SOCKET) {
+		SetLastError(err);	// the last address's
+		ErrorExit(from_utf8(arg).c_str());
+	}
+	return (HANDLE)s;
+}
+
+std::string
+to_utf8(const wchar_t *s) {
+	int n = WideCharToMultiByte(CP_UTF8, 0, s, -1, NULL, 0, NULL, NULL);
+	std::string out(n > 0 ? n : 1, 0);
+
+	WideCharToMultiByte(CP_UTF8, 0, s, -1, &out[0], n, NULL, NULL);
+	out.resize(out.size() - 1);
+	return out;
+}
 
-	pos.LowPart = olap->Offset;
-	pos.HighPart = olap->OffsetHigh;
-	pos.QuadPart += off;
-	olap->Offset = pos.LowPart;
-	olap->OffsetHigh = pos.HighPart;
+std::wstring
+from_utf8(const std::string &s) {
+	int n = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, NULL, 0);
+	std::wstring out(n > 0 ? n : 1, 0);
+
+	MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, &out[0], n);
+	out.resize(out.size() - 1);
+	return out;
 }
 
+// ~q: a line per -o sink.
 void
-drain_log(HANDLE h, OVERLAPPED *olap, bufferqueue *bufq) {
-	DWORD len;
+flow_status(std::string &s) {
+	char buf[160];
+
+	for (size_t i = 0; i < flow->nsinks(); i++) {
+		flowsink *k = flow->sink(i);
+		slicequeue &q = k->queue();
+
+		snprintf(buf, sizeof(buf), "\r\n  %-9s %7zu KB of %zu KB, peak %zu KB", k->name.c_str(),
+			q.size() / 1024, q.limit() / 1024, q.peak() / 1024);
+		s += buf;
+		if (q.dropped() != 0) {
+			snprintf(buf, sizeof(buf), ", %llu bytes dropped", q.dropped());
+			s += buf;
+		}
+		if (k->failed()) {
+			snprintf(buf, sizeof(buf), ", failed (error %u)", k->error());
+			s += buf;
+		}
+	}
+	snprintf(buf, sizeof(buf), "\r\n  %-9s %ld slabs, %llu KB copied in", "-o", slab_stats().live,
+		slab_stats().copied / 1024);
+	s += buf;
+}
+
+// At exit: what the -o sinks lost.
+void
+flow_report(void) {
+	for (size_t i = 0; i < flow->nsinks(); i++) {
+		flowsink *k = flow->sink(i);
+
+		if (k->queue().dropped() != 0)
+			fwprintf(stderr, L"%hs: queue full, %llu bytes dropped\n", k->name.c_str(), k->queue().dropped());
+		if (k->lost() != 0)
+			fwprintf(stderr, L"%hs: gave up with %zu bytes unwritten\n", k->name.c_str(), k->lost());
+	}
+}
 
-	if (!bufq->empty()) {
-		auto abuf = bufq->front();
+// Play a recording back to the console at speed x real time (0 means
+// as fast as possible), starting start seconds in.
+int
+replay(const wchar_t *name, double speed, double start) {
+	ULONGLONG off = REC_HDRLEN, end, clock = 0, clock0 = 0, target;
+	unsigned long long idxoff, count = 0;
+	std::vector<unsigned char> index;
+	LARGE_INTEGER fsize, freq, t0, t;
+	const unsigned char *p;
+	SYSTEM_INFO si;
+	mapwindow w;
+	recrecord rec;
+	bool started = false;
+	SIZE_T avail;
+	int r;
+
+	HANDLE hFile = CreateFile(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		ErrorExit(name);
+	if (!GetFileSizeEx(hFile, &fsize))
+		ErrorExit(TEXT("GetFileSizeEx"));
+	if (fsize.QuadPart < REC_HDRLEN) {
+		fwprintf(stderr, L"%s: not a recording\n", name);
+		return (1);
+	}
 
-		// There's an I/O pending, so compelete it.
-		if (!GetOverlappedResult(h, olap, &len, TRUE))
-			return;
-		add_offset(len, olap);
-		abuf->advance(len);
-		if (abuf->empty()) {
-			bufq->pop();
-			delete abuf;
+	GetSystemInfo(&si);
+	w.hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (w.hMap == NULL)
+		ErrorExit(TEXT("CreateFileMapping"));
+	w.size = fsize.QuadPart;
+	w.view = NULL;
+	w.base = w.len = 0;
+	w.gran = si.dwAllocationGranularity;
+
+	p = w.at(0, &avail);
+	if (memcmp(p, REC_MAGIC, 8) != 0) {
+		fwprintf(stderr, L"%s: not a recording\n", name);
+		return (1);
+	}
+
+	// A complete recording ends with an index; without one (cus was
+	// killed) play everything up to the end of the file.
+	end = w.size;
+	if (w.size >= REC_HDRLEN + REC_TRAILERLEN) {
+		p = w.at(w.size - REC_TRAILERLEN, &avail);
+		if (rec_trailer(p, w.size, &idxoff, &count)) {
+			end = idxoff;
+			index.resize((size_t)(count * 16));
+			for (ULONGLONG i = 0; i < count * 16; i += avail) {
+				p = w.at(idxoff + i, &avail);
+				if (avail > count * 16 - i)
+					avail = (SIZE_T)(count * 16 - i);
+				memcpy(&index[(size_t)i], p, avail);
+			}
 		}
 	}
 
-	// Now, drain the remaining buffers
-	while (!bufq->empty()) {
-		auto abuf = bufq->front();
+	target = (ULONGLONG)(start * 1000000);
+	if (target != 0 && count != 0) {
+		unsigned long long e = rec_seek(index.data(), count, target);
+
+		clock = rec_get64(&index[(size_t)(e * 16)]);
+		off = rec_get64(&index[(size_t)(e * 16 + 8)]);
+	}
 
-		if (!WriteFile(h, abuf->getptr(), abuf->size(), &len, olap)) {
-			if (GetLastError() == ERROR_IO_PENDING) {
-				if (!GetOverlappedResult(h, olap, &len, TRUE))
-					return;
+	setup_console_output();
+	QueryPerformanceFrequency(&freq);
+	while (off < end) {
+		p = w.at(off, &avail);
+		if (avail > end - off)
+			avail = (SIZE_T)(end - off);
+		if ((r = rec_decode(p, avail, &rec)) <= 0)
+			break;		// truncated or damaged tail
+		off += r;
+		clock += rec.delta;
+		if (clock < target)
+			continue;	// still seeking
+		if (!started) {
+			started = true;
+			clock0 = clock;
+			QueryPerformanceCounter(&t0);
+		}
+		if (speed > 0) {
+			double due = (clock - clock0) / speed / 1000000.0;
+
+			QueryPerformanceCounter(&t);
+			double now = (double)(t.QuadPart - t0.QuadPart) / freq.QuadPart;
+			if (due > now) {
+				if (!stdout_flush())
+					ErrorExit(TEXT("WriteFile(stdout)"));
+				Sleep((DWORD)((due - now) * 1000));
 			}
 		}
-		add_offset(len, olap);
-		abuf->advance(len);
-		if (abuf->empty()) {
-			bufq->pop();
-			delete abuf;
+		if (rec.dir == REC_DIR_OUT && !console_write(hStdout, rec.data, rec.len))
+			ErrorExit(TEXT("WriteConsole"));
+	}
+
+	if (!stdout_flush())
+		ErrorExit(TEXT("WriteFile(stdout)"));
+	restore_terminal();
+	UnmapViewOfFile(w.view);
+	CloseHandle(w.hMap);
+	CloseHandle(hFile);
+	return (0);
+}
+
+void
+start_stdin_thread(void) {
+	hStdinReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+	hStdinTaken = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (hStdinReady == NULL || hStdinTaken == NULL)
+		ErrorExit(TEXT("CreateEvent(stdin)"));
+	hStdinThread = CreateThread(NULL, 0, stdin_thread, NULL, 0, NULL);
+	if (hStdinThread == NULL)
+		ErrorExit(TEXT("CreateThread(stdin)"));
+}
+
+// Blocking reads of redirected stdin, one chunk in hand at a time. A
+// pipe whose writer has gone reads as ERROR_BROKEN_PIPE, i.e. EOF.
+DWORD WINAPI
+stdin_thread(LPVOID arg) {
+	for (;;) {
+		DWORD len;
+		BOOL ok;
+
+		stdinChunk.resize(STDIN_BUFSIZE);
+		ok = ReadFile(hStdin, &stdinChunk[0], STDIN_BUFSIZE, &len, NULL);
+		if (!ok || len == 0) {
+			DWORD error = ok ? 0 : GetLastError();
+
+			stdinError = error == ERROR_BROKEN_PIPE ? 0 : error;
+			stdinEof = true;
+			SetEvent(hStdinReady);
+			return 0;
 		}
+		stdinChunk.resize(len);
+		SetEvent(hStdinReady);
+		WaitForSingleObject(hStdinTaken, INFINITE);
 	}
 }
 
+// A chunk from the stdin thread: straight to the pipe (and recording).
+DWORD
+handle_stdin_redirected(HANDLE hOutput, OVERLAPPED *olap, bufferqueue *bufq) {
+	DWORD ret = WAITER_SUCCESS;
+
+	if (stdinEof) {
+		if (stdinError != 0) {
+			SetLastError(stdinError);
+			return WAITER_IO_ERROR;
+		}
+		stdinClosed = true;
+		return WAITER_SUCCESS;
+	}
+	if (queuePolicy == QUEUE_DROP && bufq->full())
+		bufq->dropped((DWORD)stdinChunk.size());
+	else if ((ret = rec_chunk(REC_DIR_IN, (const __int8 *)stdinChunk.data(), (DWORD)stdinChunk.size())) == WAITER_SUCCESS)
+		ret = queue_bytes(hOutput, olap, bufq, stdinChunk);
+	if (!SetEvent(hStdinTaken))
+		return WAITER_IO_ERROR;
+	return ret;
+}
+
+void
+start_log_thread(void) {
+	logRing = new spscring(LOGRING_SIZE);
+	hLogWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (hLogWake == NULL)
+		ErrorExit(TEXT("CreateEvent(logwake)"));
+	hLogThread = CreateThread(NULL, 0, log_thread, NULL, 0, NULL);
+	if (hLogThread == NULL)
+		ErrorExit(TEXT("CreateThread(log)"));
+}
+
+// The log writer: drain the ring to disk, sleep until the event loop
+// says there is more. The event loop never waits for this thread
+// except at exit, and then only for LOGTHREAD_DRAIN_MS.
+DWORD WINAPI
+log_thread(LPVOID arg) {
+	unsigned long long written = 0;
+
+	for (;;) {
+		const __int8 *p;
+		DWORD len, nlen;
+		bool stopping = logStop.load();
+
+		while ((len = logRing->peek(&p)) != 0) {
+			if (!WriteFileAll(hLog, p, len, &nlen)) {
+				logError = GetLastError();
+				return 1;
+			}
+			logRing->consume(len);
+			written += len;
+			if (hFlushThread != NULL)
+				log_progress(written);
+		}
+		if (stopping)
+			return 0;
+		WaitForSingleObject(hLogWake, LOGTHREAD_IDLE_MS);
+	}
+}
+
+void
+stop_log_thread(void) {
+	DWORD status;
+
+	logStop.store(true);
+	SetEvent(hLogWake);
+	if (WaitForSingleObject(hLogThread, LOGTHREAD_DRAIN_MS) != WAIT_OBJECT_0)
+		fwprintf(stderr, L"log: gave up with %llu bytes unwritten\n", logRing->pending());
+	else if (GetExitCodeThread(hLogThread, &status) && status != 0)
+		fwprintf(stderr, L"log: write failed (error %u), %llu bytes unwritten\n",
+			logError, logRing->pending());
+	if (logRing->overflows() != 0)
+		fwprintf(stderr, L"log: ring overflowed %llu times, %llu bytes lost\n",
+			logRing->overflows(), logRing->lost());
+}
+
+// -i looks up account names through sidCache.
+class win_sidresolver : public sidresolver {
+public:
+	sidname resolve(const std::string &sid);
+};
+
+win_sidresolver sidResolver;
+sidcache sidCache(&sidResolver);
+
+#define SCAN_THREADS 8
+
+sidname
+win_sidresolver::resolve(const std::string &sid) {
+	WCHAR acct[256], domain[256];
+	DWORD dwAcctName = 256, dwDomainName = 256;
+	SID_NAME_USE eUse = SidTypeUnknown;
+	PSID pSid = (PSID)sid.data();
+	LPWSTR str;
+	sidname r;
+
+	r.ok = false;
+	r.error = ERROR_SUCCESS;
+	if (sid.empty())
+		return r;
+
+	// Almost every name fits on the stack: one round trip, no allocation.
+	if (LookupAccountSid(NULL, pSid, acct, &dwAcctName, domain, &dwDomainName, &eUse)) {
+		r.ok = true;
+		r.name = std::wstring(domain) + L"\\" + acct;
+	} else if ((r.error = GetLastError()) == ERROR_INSUFFICIENT_BUFFER) {
+		std::wstring a(dwAcctName, 0), d(dwDomainName, 0);
+
+		if (LookupAccountSid(NULL, pSid, &a[0], &dwAcctName, &d[0], &dwDomainName, &eUse)) {
+			r.ok = true;
+			r.error = ERROR_SUCCESS;
+			r.name = std::wstring(d.c_str()) + L"\\" + a.c_str();
+		} else
+			r.error = GetLastError();
+	}
+
+	if (!r.ok && ConvertSidToStringSid(pSid, &str)) {
+		r.name = str;
+		LocalFree(str);
+	}
+	return r;
+}
+
+std::string
+sid_bytes(PSID pSid) {
+	if (pSid == NULL)
+		return std::string();
+	return std::string((const char *)pSid, GetLengthSid(pSid));
+}
+
 int
 pipeinfo(LPCTSTR pipename) {
 	DWORD dwRet, dwAcctName = 0, dwDomainName = 0;
@@ -592,6 +2248,9 @@ pipeinfo(LPCTSTR pipename) {
 	SID_NAME_USE eUse = SidTypeUnknown;
 	PACL pDacl = NULL, pSacl = NULL;
 
+	if (wcspbrk(pipename, L"*?") != NULL)
+		return pipescan(pipename);
+
 	HANDLE hPipe = CreateFile(pipename, FILE_READ_ATTRIBUTES | FILE_READ_EA | STANDARD_RIGHTS_READ | READ_CONTROL, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (hPipe == INVALID_HANDLE_VALUE)
 		ErrorExit(L"CreateFile");
@@ -614,35 +2273,117 @@ pipeinfo(LPCTSTR pipename) {
 	return 0;
 }
 
-void
-get_acctName(LPCTSTR name, PSID pSid) {
-	DWORD dwAcctName = 0, dwDomainName = 0;
+// Scan every pipe matching a wildcard and print one JSON object per
+// pipe. The pipes are examined, and their SIDs resolved, in parallel.
+int
+pipescan(LPCTSTR pattern) {
+	const std::wstring prefix(TEXT("\\\\.\\pipe\\"));
+	bool fullpath = wcsncmp(pattern, TEXT("\\\\"), 2) == 0;
+	std::vector<std::wstring> names;
+	WIN32_FIND_DATA fd;
+
+	HANDLE hFind = FindFirstFile(TEXT("\\\\.\\pipe\\*"), &fd);
+	if (hFind == INVALID_HANDLE_VALUE)
+		ErrorExit(TEXT("FindFirstFile"));
+	do {
+		std::wstring path = prefix + fd.cFileName;
+
+		if (globmatch(pattern, fullpath ? path.c_str() : fd.cFileName))
+			names.push_back(path);
+	} while (FindNextFile(hFind, &fd));
+	FindClose(hFind);
+
+	std::vector<std::wstring> lines(names.size());
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next(0);
+
+	for (size_t t = 0; t < SCAN_THREADS && t < names.size(); t++) {
+		workers.emplace_back([&]() {
+			for (size_t i; (i = next++) < names.size();)
+				lines[i] = pipeacl_json(get_pipeacl(names[i].c_str()), sidCache);
+		});
+	}
+	for (auto &w : workers)
+		w.join();
+
+	for (auto &line : lines)
+		_tprintf(TEXT("%s\n"), line.c_str());
+	return 0;
+}
+
+pipeacl
+get_pipeacl(LPCTSTR pipename) {
+	PSID pSidOwner = NULL, pSidGroup = NULL;
 	PSECURITY_DESCRIPTOR pSD = NULL;
-	LPTSTR pstrAcctName = NULL, pstrDomainName = NULL;
-	SID_NAME_USE eUse = SidTypeUnknown;
+	PACL pDacl = NULL;
+	pipeacl acl;
+	DWORD dwRet;
 
-	if (!LookupAccountSid(NULL, pSid, pstrAcctName, &dwAcctName, pstrDomainName, &dwDomainName, &eUse)) {
-		if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
-			ErrorExit(L"LookupAccountSid");
-	}
+	acl.pipe = pipename;
+	acl.error = ERROR_SUCCESS;
+	acl.hasdacl = false;
+	acl.revision = 0;
 
-	pstrAcctName = (LPWSTR)GlobalAlloc(GMEM_FIXED, dwAcctName * sizeof(TCHAR));
-	if (pstrAcctName == NULL)
-		ErrorExit(L"GlobalAlloc");
+	HANDLE hPipe = CreateFile(pipename, FILE_READ_ATTRIBUTES | FILE_READ_EA | STANDARD_RIGHTS_READ | READ_CONTROL, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hPipe == INVALID_HANDLE_VALUE) {
+		acl.error = GetLastError();
+		return acl;
+	}
+	dwRet = GetSecurityInfo(hPipe, SE_KERNEL_OBJECT, OWNER_SECURITY_INFORMATION |
+		GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION, &pSidOwner, &pSidGroup, &pDacl, NULL, &pSD);
+	CloseHandle(hPipe);
+	if (dwRet != ERROR_SUCCESS) {
+		acl.error = dwRet;
+		return acl;
+	}
 
-	pstrDomainName = (LPWSTR)GlobalAlloc(GMEM_FIXED, dwDomainName * sizeof(TCHAR));
-	if (pstrDomainName == NULL)
-		ErrorExit(L"GlobalAlloc");
+	acl.owner = sid_bytes(pSidOwner);
+	acl.group = sid_bytes(pSidGroup);
+	if (pDacl != NULL) {
+		ACL_REVISION_INFORMATION revinfo;
+		ACL_SIZE_INFORMATION sizeinfo;
+
+		if (GetAclInformation(pDacl, &revinfo, sizeof(revinfo), AclRevisionInformation) &&
+		    GetAclInformation(pDacl, &sizeinfo, sizeof(sizeinfo), AclSizeInformation)) {
+			acl.hasdacl = true;
+			acl.revision = revinfo.AclRevision;
+			for (DWORD i = 0; i < sizeinfo.AceCount; i++) {
+				void *pAce;
+				PACE_HEADER hdr;
+				aceinfo ace;
+
+				if (!GetAce(pDacl, i, &pAce))
+					break;
+				hdr = (PACE_HEADER)pAce;
+				ace.type = hdr->AceType;
+				ace.flags = hdr->AceFlags;
+				ace.mask = 0;
+				// allowed and denied ACEs share a layout
+				if (hdr->AceType == ACCESS_ALLOWED_ACE_TYPE || hdr->AceType == ACCESS_DENIED_ACE_TYPE) {
+					PACCESS_ALLOWED_ACE a = (PACCESS_ALLOWED_ACE)pAce;
+
+					ace.mask = a->Mask;
+					ace.sid = sid_bytes((PSID)&a->SidStart);
+				}
+				acl.dacl.push_back(ace);
+			}
+		}
+	}
 
-	if (!LookupAccountSid(NULL, pSid, pstrAcctName, &dwAcctName, pstrDomainName, &dwDomainName, &eUse))
-		ErrorExit(L"LookupAccountSid");
+	if (pSD)
+		LocalFree(pSD);
+	return acl;
+}
 
-	_tprintf(TEXT("%s: %s\\%s\n"), name, pstrDomainName, pstrAcctName);
+void
+get_acctName(LPCTSTR name, PSID pSid) {
+	sidname sn = sidCache.lookup(sid_bytes(pSid));
 
-	if (pstrDomainName != NULL)
-		GlobalFree(pstrDomainName);
-	if (pstrAcctName != NULL)
-		GlobalFree(pstrAcctName);
+	if (!sn.ok) {
+		SetLastError(sn.error);
+		ErrorExit(L"LookupAccountSid");
+	}
+	_tprintf(TEXT("%s: %s\n"), name, sn.name.c_str());
 }
 
 void
@@ -681,25 +2422,6 @@ show_acl(LPCTSTR name, PACL acl) {
 
 void
 show_mask(DWORD mask) {
-	const struct mask_bits {
-		LPCTSTR name;
-		DWORD bit;
-	} maskbits[] = {
-		{ TEXT("read"), FILE_READ_DATA },
-		{ TEXT("write"), FILE_WRITE_DATA },
-		{ TEXT("createpipe"), FILE_CREATE_PIPE_INSTANCE },
-		{ TEXT("readea"), FILE_READ_EA },
-		{ TEXT("writeea"), FILE_WRITE_EA },
-		{ TEXT("execute"), FILE_EXECUTE },
-		{ TEXT("delete-child"), FILE_DELETE_CHILD },
-		{ TEXT("readattr"), FILE_READ_ATTRIBUTES },
-		{ TEXT("writeattr"), FILE_WRITE_ATTRIBUTES },
-		{ TEXT("delete"), DELETE },
-		{ TEXT("readcontrol"), READ_CONTROL },
-		{ TEXT("writedac"), WRITE_DAC },
-		{ TEXT("writeowner"), WRITE_OWNER },
-		{ TEXT("sync"), SYNCHRONIZE }
-	};
 	TCHAR c = '(';
 
 	for (auto i = 0; i < sizeof(maskbits) / sizeof(maskbits[0]); i++) {
@@ -715,3 +2437,221 @@ show_mask(DWORD mask) {
 		_tprintf(TEXT("%c"), c);
 	_tprintf(TEXT("%c"), ')');
 }
+
+// -y none, -y periodic[:ms] or -y group[:ms]
+bool
+parse_sync(const wchar_t *arg) {
+	const wchar_t *colon = wcschr(arg, L':');
+	size_t len = colon != NULL ? colon - arg : wcslen(arg);
+	wchar_t *end;
+
+	if (len == 4 && wcsncmp(arg, L"none", 4) == 0 && colon == NULL) {
+		syncMode = SYNC_NONE;
+		return true;
+	}
+	if (len == 8 && wcsncmp(arg, L"periodic", 8) == 0) {
+		syncMode = SYNC_PERIODIC;
+		syncMs = SYNC_PERIODIC_MS;
+	} else if (len == 5 && wcsncmp(arg, L"group", 5) == 0) {
+		syncMode = SYNC_GROUP;
+		syncMs = SYNC_GROUP_MS;
+	} else
+		return false;
+	if (colon != NULL) {
+		syncMs = wcstoul(colon + 1, &end, 10);
+		if (end == colon + 1 || *end != 0 || (syncMode == SYNC_PERIODIC && syncMs == 0))
+			return false;
+	}
+	return true;
+}
+
+// The log writer has finished done bytes. In group mode this wakes the
+// flusher, but only if it's waiting.
+void
+log_progress(unsigned long long done) {
+	if (logDone.load(std::memory_order_relaxed) == done)
+		return;
+	logDone.store(done);
+	if (flushIdle.exchange(false))
+		SetEvent(hFlushWake);
+}
+
+void
+start_flush_thread(void) {
+	hFlushWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (hFlushWake == NULL)
+		ErrorExit(TEXT("CreateEvent(flushwake)"));
+	hFlushThread = CreateThread(NULL, 0, flush_thread, NULL, 0, NULL);
+	if (hFlushThread == NULL)
+		ErrorExit(TEXT("CreateThread(flush)"));
+}
+
+DWORD WINAPI
+flush_thread(LPVOID arg) {
+	unsigned long long flushed = 0;
+	LARGE_INTEGER freq, t0, t1;
+
+	QueryPerformanceFrequency(&freq);
+	for (;;) {
+		bool stopping = flushStop.load();
+
+		if (logDone.load() != flushed) {
+			// let the rest of the group complete
+			if (syncMode == SYNC_GROUP && !stopping && syncMs != 0)
+				Sleep(syncMs);
+			flushed = logDone.load();
+			QueryPerformanceCounter(&t0);
+			if (!FlushFileBuffers(hLog)) {
+				flushError = GetLastError();
+				return 1;
+			}
+			QueryPerformanceCounter(&t1);
+			flushLatency.add((t1.QuadPart - t0.QuadPart) * 1000000 / freq.QuadPart);
+			if (syncMode == SYNC_GROUP)
+				continue;
+		}
+		if (stopping)
+			return 0;
+		if (syncMode == SYNC_GROUP) {
+			// recheck after going idle, or a wakeup could be missed
+			flushIdle.store(true);
+			if (logDone.load() != flushed) {
+				flushIdle.store(false);
+				continue;
+			}
+		}
+		WaitForSingleObject(hFlushWake, syncMode == SYNC_GROUP ? INFINITE : syncMs);
+	}
+}
+
+// One last flush, then report how long flushes took.
+void
+stop_flush_thread(void) {
+	DWORD status;
+
+	flushStop.store(true);
+	SetEvent(hFlushWake);
+	if (WaitForSingleObject(hFlushThread, LOGTHREAD_DRAIN_MS) != WAIT_OBJECT_0) {
+		fwprintf(stderr, L"log: gave up waiting for the final flush\n");
+		return;
+	}
+	if (GetExitCodeThread(hFlushThread, &status) && status != 0)
+		fwprintf(stderr, L"log: flush failed (error %u), later writes not flushed\n", flushError);
+	if (flushLatency.count() != 0)
+		fwprintf(stderr, L"log: %llu flushes, %hs\n", flushLatency.count(), flushLatency.summary().c_str());
+}
+
+// Bytes the (non -t) log writer has finished.
+unsigned long long
+log_written(OVERLAPPED *olap) {
+	if (dioLog != NULL)
+		return dioLog->written();
+	return ((unsigned long long)olap->OffsetHigh << 32) | olap->Offset;
+}
+
+DWORD
+dio_put(const __int8 *p, DWORD n) {
+	for (DWORD off = 0;;) {
+		off += dioLog->put(p + off, n - off);
+		dio_kick();
+		if (off == n)
+			break;
+		// Every staging buffer is being written. Memory stays bounded,
+		// so wait for one; local disks keep up with any pipe.
+		SleepEx(INFINITE, TRUE);
+		if (dioError != 0)
+			return WAITER_IO_ERROR;
+	}
+
+	// The timer is only set when idle; when it fires it checks how
+	// long it's really been quiet.
+	dioLastPut = GetTickCount64();
+	if (!dioTimerArmed && !dio_arm(DIO_TAIL_MS))
+		return WAITER_IO_ERROR;
+	return WAITER_SUCCESS;
+}
+
+BOOL
+dio_arm(DWORD ms) {
+	LARGE_INTEGER due;
+
+	due.QuadPart = -(LONGLONG)ms * 10000;
+	dioTimerArmed = SetWaitableTimer(hDioTimer, &due, 0, NULL, NULL, FALSE) != FALSE;
+	return dioTimerArmed;
+}
+
+void
+dio_kick(void) {
+	diobuf *b;
+
+	while ((b = dioLog->ready()) != NULL)
+		dio_write(b);
+}
+
+void
+dio_write(diobuf *b) {
+	diowrite *w = NULL;
+
+	for (auto &slot : dioWrites) {
+		if (slot.b == NULL) {
+			w = &slot;
+			break;
+		}
+	}
+	// there's a slot for every buffer plus the tail
+	ZeroMemory(&w->ov, sizeof(w->ov));
+	w->ov.Offset = (DWORD)b->off;
+	w->ov.OffsetHigh = (DWORD)(b->off >> 32);
+	w->b = b;
+	if (!WriteFileEx(hLog, b->p, b->len, &w->ov, dio_done)) {
+		dioError = GetLastError();
+		w->b = NULL;
+		dioLog->done(b);
+	}
+}
+
+VOID CALLBACK
+dio_done(DWORD error, DWORD n, LPOVERLAPPED ov) {
+	diowrite *w = (diowrite *)ov;
+	diobuf *b = w->b;
+
+	w->b = NULL;
+	if (error == 0 && n != b->len)
+		error = ERROR_WRITE_FAULT;
+	if (error != 0 && dioError == 0)
+		dioError = error;
+	// a tail is padded; cut the file back to what's really there
+	if (error == 0 && dioLog->istail(b))
+		dio_set_eof(b->end);
+	dioLog->done(b);
+	dio_kick();
+}
+
+void
+dio_set_eof(unsigned long long end) {
+	FILE_END_OF_FILE_INFO eof;
+
+	eof.EndOfFile.QuadPart = end;
+	if (!SetFileInformationByHandle(hLog, FileEndOfFileInfo, &eof, sizeof(eof)) && dioError == 0)
+		dioError = GetLastError();
+}
+
+// Write everything, the unaligned tail last, and trim the padding.
+void
+dio_drain(void) {
+	diobuf *b;
+
+	CancelWaitableTimer(hDioTimer);
+	while (!dioLog->idle() && dioError == 0)
+		SleepEx(INFINITE, TRUE);
+	if (dioError == 0 && (b = dioLog->tail()) != NULL) {
+		dio_write(b);
+		while (!dioLog->idle() && dioError == 0)
+			SleepEx(INFINITE, TRUE);
+	}
+	if (dioError == 0)
+		dio_set_eof(dioLog->size());
+	if (dioError != 0)
+		fwprintf(stderr, L"log: write failed (error %u), %llu bytes may be missing\n",
+			dioError, dioLog->size() - dioLog->written());
+}
@@ -0,0 +1,196 @@
+// directlog.h : staging buffers for unbuffered log writes (-u).
+//
+// With FILE_FLAG_NO_BUFFERING (O_DIRECT) a write must start at a
+// sector-aligned offset, from a sector-aligned address, and cover whole
+// sectors. directlog copies log bytes into a pool of aligned
+// DIO_BUFSIZE buffers and hands full ones out to be written, several
+// at a time, in file order. So that the log doesn't lag by up to a
+// buffer, the partly filled buffer can also be written as a padded tail
+// (tail()); the caller then sets the end of file to hide the padding,
+// and the same sectors are written again once the buffer fills.
+// DIO_ALIGN covers both 512-byte and 4K-sector disks.
+
+#pragma once
+
+#include "compat.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#define DIO_ALIGN	4096
+#define DIO_BUFSIZE	(64 * 1024)
+#define DIO_NBUFS	8
+
+struct diobuf {
+	__int8 *p;
+	DWORD len;		// bytes to write, a multiple of DIO_ALIGN
+	unsigned long long off;	// file offset
+	unsigned long long end;	// logical end of file once written
+};
+
+class directlog {
+private:
+	enum State { DIO_FREE, DIO_FILLING, DIO_FULL, DIO_BUSY };
+	__int8 *mem;
+	diobuf bufs[DIO_NBUFS];
+	State state[DIO_NBUFS];
+	diobuf tailbuf;
+	bool tailbusy;
+	unsigned fill;			// the buffer being filled
+	DWORD used;			// bytes in it
+	unsigned long long total;	// bytes put
+	unsigned long long tailed;	// logical end as of the last tail write
+
+	directlog(const directlog &);
+	directlog &operator=(const directlog &);
+public:
+	directlog();
+	~directlog();
+	DWORD put(const __int8 *p, DWORD n);
+	diobuf *ready();
+	diobuf *tail();
+	void done(diobuf *b);
+	bool istail(diobuf *b) { return b == &tailbuf; }
+	bool idle();
+	unsigned long long size() { return total; }
+	unsigned long long written();
+};
+
+inline
+directlog::directlog() : tailbusy(false), fill(0), used(0), total(0), tailed(0) {
+	size_t size = (size_t)(DIO_NBUFS + 1) * DIO_BUFSIZE;
+
+#ifdef _WIN32
+	mem = (__int8 *)_aligned_malloc(size, DIO_ALIGN);
+#else
+	void *p = NULL;
+
+	if (posix_memalign(&p, DIO_ALIGN, size) != 0)
+		p = NULL;
+	mem = (__int8 *)p;
+#endif
+	if (mem == NULL)
+		abort();
+	for (unsigned i = 0; i < DIO_NBUFS; i++) {
+		bufs[i].p = mem + (size_t)i * DIO_BUFSIZE;
+		state[i] = DIO_FREE;
+	}
+	tailbuf.p = mem + (size_t)DIO_NBUFS * DIO_BUFSIZE;
+	state[0] = DIO_FILLING;
+	bufs[0].off = 0;
+}
+
+inline
+directlog::~directlog() {
+#ifdef _WIN32
+	_aligned_free(mem);
+#else
+	free(mem);
+#endif
+}
+
+// Copy in as much as fits; less than n means every buffer is waiting
+// to be written.
+inline DWORD
+directlog::put(const __int8 *p, DWORD n) {
+	DWORD taken = 0;
+
+	while (taken < n) {
+		if (state[fill] == DIO_FREE) {
+			state[fill] = DIO_FILLING;
+			bufs[fill].off = total;
+		}
+		if (state[fill] != DIO_FILLING)
+			break;
+
+		DWORD k = n - taken < DIO_BUFSIZE - used ? n - taken : DIO_BUFSIZE - used;
+
+		memcpy(bufs[fill].p + used, p + taken, k);
+		used += k;
+		taken += k;
+		total += k;
+		if (used == DIO_BUFSIZE) {
+			bufs[fill].len = DIO_BUFSIZE;
+			bufs[fill].end = total;
+			state[fill] = DIO_FULL;
+			fill = (fill + 1) % DIO_NBUFS;
+			used = 0;
+		}
+	}
+	return taken;
+}
+
+// The oldest full buffer, now to be written; NULL if none. A buffer
+// whose sectors are being written as a tail waits for that to finish,
+// or the stale tail could land last.
+inline diobuf *
+directlog::ready() {
+	for (unsigned k = 1; k <= DIO_NBUFS; k++) {
+		unsigned i = (fill + k) % DIO_NBUFS;
+
+		if (state[i] != DIO_FULL)
+			continue;
+		if (tailbusy && tailbuf.off == bufs[i].off)
+			return NULL;
+		state[i] = DIO_BUSY;
+		return &bufs[i];
+	}
+	return NULL;
+}
+
+// A padded copy of the partly filled buffer to write, or NULL if there's
+// nothing new or a tail write is already in flight.
+inline diobuf *
+directlog::tail() {
+	DWORD len = (used + DIO_ALIGN - 1) & ~(DWORD)(DIO_ALIGN - 1);
+
+	if (tailbusy || state[fill] != DIO_FILLING || used == 0 || tailed == total)
+		return NULL;
+	memcpy(tailbuf.p, bufs[fill].p, used);
+	memset(tailbuf.p + used, 0, len - used);
+	tailbuf.off = bufs[fill].off;
+	tailbuf.len = len;
+	tailbuf.end = total;
+	tailbusy = true;
+	tailed = total;
+	return &tailbuf;
+}
+
+inline void
+directlog::done(diobuf *b) {
+	if (b == &tailbuf)
+		tailbusy = false;
+	else
+		state[b - bufs] = DIO_FREE;
+}
+
+// Nothing written or waiting to be, apart from the partial buffer.
+inline bool
+directlog::idle() {
+	if (tailbusy)
+		return false;
+	for (unsigned i = 0; i < DIO_NBUFS; i++)
+		if (state[i] == DIO_FULL || state[i] == DIO_BUSY)
+			return false;
+	return true;
+}
+
+// Bytes known to be in the file: everything before the oldest buffer
+// still to be written, or if there's none, up to the last tail.
+inline unsigned long long
+directlog::written() {
+	unsigned long long low = total;
+
+	for (unsigned i = 0; i < DIO_NBUFS; i++)
+		if ((state[i] == DIO_FULL || state[i] == DIO_BUSY) && bufs[i].off < low)
+			low = bufs[i].off;
+	if (low != total)
+		return low;
+	if (state[fill] != DIO_FILLING)
+		return total;
+	if (!tailbusy && tailbuf.off == bufs[fill].off && tailed > bufs[fill].off)
+		return tailed;
+	return bufs[fill].off;
+}
@@ -0,0 +1,59 @@
+// escape.h : the ~ escape state machine for keyboard input.
+//
+// As in cu, a ~ at the start of a line is held back until the next key
+// says whether it starts an escape: ~ followed by one of the front
+// end's command keys is the command, ~~ sends one ~, and ~ followed by
+// anything else sends both. Shared by the Windows and POSIX front ends.
+
+#pragma once
+
+#include <string.h>
+#include <string>
+
+enum TermState {
+	STATE_INIT,
+	STATE_NEWLINE,
+	STATE_TILDE,
+	STATE_DOT,
+	STATE_SEARCH,	// ~/ : reading the pattern
+	STATE_BROWSE	// ~/ : paging through matches
+};
+
+// Step over one key. Bytes for the pipe are appended to out. Returns
+// the command key when ~ and one of cmds have been typed (the state is
+// then STATE_NEWLINE), otherwise 0. Modal states (~/) are the caller's.
+static inline char
+esc_step(TermState *state, char k, const char *cmds, std::string &out) {
+	switch (*state) {
+	case STATE_INIT:
+		if (k == '\r')
+			*state = STATE_NEWLINE;
+		out.push_back(k);
+		break;
+	case STATE_NEWLINE:
+		if (k == '~') {
+			*state = STATE_TILDE;
+			break;
+		}
+		if (k != '\r')
+			*state = STATE_INIT;
+		out.push_back(k);
+		break;
+	case STATE_TILDE:
+		if (k != 0 && strchr(cmds, k) != NULL) {
+			*state = STATE_NEWLINE;
+			return k;
+		}
+		if (k != '~')
+			out.push_back('~');
+		out.push_back(k);
+		if (k == '\r')
+			*state = STATE_NEWLINE;
+		else
+			*state = STATE_INIT;
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
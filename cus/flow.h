@@ -0,0 +1,568 @@
+// flow.h : guest output through a graph of filters and sinks (-o).
+//
+// Output enters the graph once, copied into a slab: a refcounted block
+// that is only ever appended to, so the bytes a slice of it sees never
+// change. From there it travels as slices. A filter passes slices on,
+// trims them or lets them go; only a filter that rewrites bytes (strip,
+// dedup) makes new slabs. A sink queues the slices it is given and
+// writes them out at its own pace, keeping its own place in the front
+// one, so any number of sinks share the same bytes and a slow one holds
+// on to what it hasn't written without holding up the others.
+//
+// Each -o spec is a chain: filters, then a sink that takes the rest of
+// the spec as its argument.
+//
+//	strip,dedup,file:clean.log
+//	grep:panic,cmd:notify.exe
+//	tcp:loghost:5140
+//
+// The core uses only WriteFile, GetOverlappedResult, ResetEvent,
+// WaitForSingleObject and GetTickCount64, so bench/flowcheck.cpp runs it
+// against simio.h. Opening files, processes and sockets is left to the
+// sink maker (cus.cpp). The graph lives on one thread; the refcounts
+// aren't atomic.
+
+#pragma once
+
+#include "compat.h"
+#include "asyncout.h"
+#include "ansifilter.h"
+#include "linededup.h"
+#include "simd.h"
+#include <string.h>
+#include <deque>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define SLAB_SIZE (64 * 1024)
+#define FLOW_MAXSINKS 16
+#define FLOW_LINEMAX 65536	// grep decides a line this long without its end
+#define FLOW_DRAIN_MS 2000
+
+// Slabs alive and bytes copied into them, for ~q and flowcheck.
+struct slabstats {
+	long live;
+	unsigned long long copied;
+};
+
+inline slabstats &
+slab_stats(void) {
+	static slabstats s;
+
+	return s;
+}
+
+struct slab {
+	unsigned refs;
+	DWORD len, cap;
+
+	__int8 *data() { return (__int8 *)(this + 1); }
+	void hold() { refs++; }
+	void release();
+	static slab *make(DWORD cap);
+};
+
+inline slab *
+slab::make(DWORD cap) {
+	slab *s = (slab *)::operator new(sizeof(slab) + cap);
+
+	s->refs = 1;
+	s->len = 0;
+	s->cap = cap;
+	slab_stats().live++;
+	return s;
+}
+
+inline void
+slab::release() {
+	if (--refs != 0)
+		return;
+	slab_stats().live--;
+	::operator delete(this);
+}
+
+// Part of a slab, holding it while the slice (or a copy) is around.
+class slice {
+private:
+	slab *s;
+	DWORD off, len;
+public:
+	slice() : s(NULL), off(0), len(0) {}
+	slice(slab *b, DWORD o, DWORD n) : s(b), off(o), len(n) { s->hold(); }
+	slice(const slice &o) : s(o.s), off(o.off), len(o.len) { if (s != NULL) s->hold(); }
+	slice(slice &&o) : s(o.s), off(o.off), len(o.len) { o.s = NULL; o.len = 0; }
+	~slice() { if (s != NULL) s->release(); }
+	slice &operator=(slice o) {
+		std::swap(s, o.s);
+		std::swap(off, o.off);
+		std::swap(len, o.len);
+		return *this;
+	}
+
+	const __int8 *data() const { return s->data() + off; }
+	DWORD size() const { return len; }
+	bool empty() const { return len == 0; }
+	slice sub(DWORD o, DWORD n) const { return slice(s, off + o, n); }
+	void advance(DWORD n) { off += n; len -= n; }
+	// Take in next if it carries on where this ends.
+	bool join(const slice &next) {
+		if (s == NULL || next.s != s || off + len != next.off)
+			return false;
+		len += next.len;
+		return true;
+	}
+};
+
+// The one copy the graph makes. Runs put one after another share a slab
+// until it fills, so they come out as slices that join up.
+class slabwriter {
+private:
+	slab *cur;
+public:
+	slabwriter() : cur(NULL) {}
+	~slabwriter() { if (cur != NULL) cur->release(); }
+	slice put(const __int8 *p, DWORD n);
+};
+
+inline slice
+slabwriter::put(const __int8 *p, DWORD n) {
+	if (cur == NULL || cur->cap - cur->len < n) {
+		if (cur != NULL)
+			cur->release();
+		cur = slab::make(n > SLAB_SIZE ? n : SLAB_SIZE);
+	}
+	memcpy(cur->data() + cur->len, p, n);
+	slice s(cur, cur->len, n);
+	cur->len += n;
+	slab_stats().copied += n;
+	return s;
+}
+
+// The slices waiting for one sink, with bufferqueue's limit rules but
+// counted in bytes. A slice that joins the last one is merged into it,
+// so a run of small reads goes out as one write.
+class slicequeue {
+private:
+	std::deque<slice> q;
+	size_t nbytes, max, hiwater;
+	unsigned long long ndropped;
+public:
+	explicit slicequeue(size_t limit = 0) : nbytes(0), max(limit), hiwater(0), ndropped(0) {}
+	void push(const slice &s);
+	void advance(DWORD n);
+	void clear() { q.clear(); nbytes = 0; }
+	slice &front() { return q.front(); }
+	bool empty() { return q.empty(); }
+	size_t size() { return nbytes; }	// bytes
+	size_t limit() { return max; }
+	size_t peak() { return hiwater; }
+	bool full() { return max != 0 && nbytes >= max; }
+	bool blocked(bool stopped) { return max != 0 && (stopped ? nbytes > max / 2 : nbytes >= max); }
+	void dropped(size_t n) { ndropped += n; }
+	unsigned long long dropped() { return ndropped; }
+};
+
+inline void
+slicequeue::push(const slice &s) {
+	if (q.empty() || !q.back().join(s))
+		q.push_back(s);
+	nbytes += s.size();
+	if (nbytes > hiwater)
+		hiwater = nbytes;
+}
+
+// n bytes of the front slice have been written.
+inline void
+slicequeue::advance(DWORD n) {
+	q.front().advance(n);
+	nbytes -= n;
+	if (q.front().empty())
+		q.pop_front();
+}
+
+// A stage of the graph. put() takes a slice, copying the slice (not the
+// bytes) if it keeps it; finish() is the end of the output, for stages
+// that hold some back. Both return a WAITER_ code.
+class flownode {
+public:
+	virtual ~flownode() {}
+	virtual DWORD put(const slice &s) = 0;
+	virtual DWORD finish(void) { return WAITER_SUCCESS; }
+};
+
+class flowfilter : public flownode {
+public:
+	flownode *next;
+
+	flowfilter() : next(NULL) {}
+	DWORD finish(void) { return next->finish(); }
+};
+
+// strip and dedup: ansifilter.h and linededup.h, as -c and -d use them
+// for the log. Their output is new bytes, so it goes into new slabs.
+template <class F>
+class rewritefilter : public flowfilter {
+private:
+	F f;
+	slabwriter w;
+	std::string out;
+	DWORD emit(void);
+public:
+	DWORD put(const slice &s) { f.filter(s.data(), s.size(), out); return emit(); }
+	DWORD finish(void);
+};
+
+typedef rewritefilter<ansifilter> stripfilter;
+typedef rewritefilter<linededup> dedupfilter;
+
+template <class F>
+inline DWORD
+rewritefilter<F>::emit(void) {
+	DWORD ret = WAITER_SUCCESS;
+
+	if (!out.empty())
+		ret = next->put(w.put((const __int8 *)out.data(), (DWORD)out.size()));
+	out.clear();
+	return ret;
+}
+
+template <class F>
+inline DWORD
+rewritefilter<F>::finish(void) {
+	f.flush(out);
+	if (emit() != WAITER_SUCCESS)
+		return WAITER_IO_ERROR;
+	return next->finish();
+}
+
+// grep:PAT passes on the lines containing PAT, grep-v:PAT the others.
+// Lines aren't copied: the filter holds the slices of the line so far
+// and passes them on or lets them go when it ends. Only a line split
+// across slabs is copied, to scratch, to be searched. A line longer
+// than FLOW_LINEMAX is decided on its first FLOW_LINEMAX bytes.
+class grepfilter : public flowfilter {
+private:
+	std::string pat;
+	bool invert;
+	std::vector<slice> held;
+	DWORD nheld;
+	int rest;		// the rest of a long line: -1 undecided, 0 drop, 1 pass
+	std::string scratch;
+	DWORD decide(bool more);
+public:
+	grepfilter(const std::string &p, bool v) : pat(p), invert(v), nheld(0), rest(-1) {}
+	DWORD put(const slice &s);
+	DWORD finish(void);
+};
+
+inline DWORD
+grepfilter::decide(bool more) {
+	const char *p;
+	size_t n;
+	bool pass;
+
+	if (held.size() == 1) {
+		p = (const char *)held[0].data();
+		n = held[0].size();
+	} else {
+		scratch.clear();
+		for (const slice &s : held)
+			scratch.append((const char *)s.data(), s.size());
+		p = scratch.data();
+		n = scratch.size();
+	}
+	pass = (simd_memmem(p, n, pat.data(), pat.size()) != (size_t)-1) != invert;
+	for (const slice &s : held) {
+		if (pass && next->put(s) != WAITER_SUCCESS)
+			return WAITER_IO_ERROR;
+	}
+	held.clear();
+	nheld = 0;
+	if (more)
+		rest = pass;
+	return WAITER_SUCCESS;
+}
+
+inline DWORD
+grepfilter::put(const slice &s) {
+	DWORD off = 0;
+
+	while (off < s.size()) {
+		const __int8 *p = s.data() + off;
+		const void *nl = memchr(p, '\n', s.size() - off);
+		DWORD n = nl != NULL ? (DWORD)((const __int8 *)nl - p) + 1 : s.size() - off;
+		slice part = s.sub(off, n);
+
+		off += n;
+		if (rest >= 0) {
+			if (rest == 1 && next->put(part) != WAITER_SUCCESS)
+				return WAITER_IO_ERROR;
+			if (nl != NULL)
+				rest = -1;
+			continue;
+		}
+		if (held.empty() || !held.back().join(part))
+			held.push_back(part);
+		nheld += n;
+		if ((nl != NULL || nheld >= FLOW_LINEMAX) && decide(nl == NULL) != WAITER_SUCCESS)
+			return WAITER_IO_ERROR;
+	}
+	return WAITER_SUCCESS;
+}
+
+inline DWORD
+grepfilter::finish(void) {
+	if (!held.empty() && decide(false) != WAITER_SUCCESS)
+		return WAITER_IO_ERROR;
+	rest = -1;
+	return next->finish();
+}
+
+// The end of a chain. A full queue either drops what comes (drop) or
+// stops pipe reads until it is half empty, as -q says. A sink that
+// fails is closed and forgotten; it doesn't end the session.
+class flowsink : public flownode {
+protected:
+	slicequeue q;
+	bool drop;
+	bool broken;
+	DWORD err;
+	size_t unwritten;	// given up on at exit
+	void fail(DWORD error);
+	virtual void close(void) {}	// cancel what's in flight, let go of the handle
+public:
+	std::string name;
+
+	flowsink(const std::string &n, size_t limit, bool d) :
+	    q(limit), drop(d), broken(false), err(0), unwritten(0), name(n) {}
+	virtual HANDLE event(void) { return NULL; }	// to wait on, if it writes asynchronously
+	virtual DWORD complete(void) { return WAITER_SUCCESS; }
+	virtual void drain(void) { close(); }
+	bool blocked(bool stopped) { return !drop && !broken && q.blocked(stopped); }
+	bool failed(void) { return broken; }
+	DWORD error(void) { return err; }
+	size_t lost(void) { return unwritten; }
+	slicequeue &queue(void) { return q; }
+};
+
+inline void
+flowsink::fail(DWORD error) {
+	broken = true;
+	err = error;
+	close();
+	q.clear();
+}
+
+// A sink written through an OVERLAPPED: asyncout.h's writer, on slices.
+// The event is the caller's, made with CreateEvent(NULL, TRUE, ...).
+class ovsink : public flowsink {
+protected:
+	HANDLE h;
+	OVERLAPPED ov;
+	DWORD start(void);
+public:
+	ovsink(const std::string &n, HANDLE file, HANDLE ev, size_t limit, bool d) : flowsink(n, limit, d), h(file) {
+		memset(&ov, 0, sizeof(ov));
+		ov.hEvent = ev;
+	}
+	HANDLE event(void) { return ov.hEvent; }
+	DWORD put(const slice &s);
+	DWORD complete(void);
+	void drain(void);
+};
+
+// Write from the front until a write pends or the queue is empty.
+inline DWORD
+ovsink::start(void) {
+	DWORD n;
+
+	while (!q.empty()) {
+		if (!WriteFile(h, q.front().data(), q.front().size(), &n, &ov)) {
+			if (GetLastError() == ERROR_IO_PENDING)
+				return WAITER_SUCCESS;
+			fail(GetLastError());
+			break;
+		}
+		add_offset(n, &ov);
+		q.advance(n);
+	}
+	if (!ResetEvent(ov.hEvent))
+		return WAITER_IO_ERROR;
+	return WAITER_SUCCESS;
+}
+
+inline DWORD
+ovsink::put(const slice &s) {
+	bool idle = q.empty();
+
+	if (broken)
+		return WAITER_SUCCESS;
+	if (drop && q.full()) {
+		q.dropped(s.size());
+		return WAITER_SUCCESS;
+	}
+	q.push(s);
+	return idle ? start() : WAITER_SUCCESS;
+}
+
+// The event fired: finish the pending write and start the next.
+inline DWORD
+ovsink::complete(void) {
+	DWORD n;
+
+	if (broken || q.empty()) {
+		if (!ResetEvent(ov.hEvent))
+			return WAITER_IO_ERROR;
+		return WAITER_SUCCESS;
+	}
+	if (!GetOverlappedResult(h, &ov, &n, FALSE)) {
+		fail(GetLastError());
+		return ResetEvent(ov.hEvent) ? WAITER_SUCCESS : WAITER_IO_ERROR;
+	}
+	add_offset(n, &ov);
+	q.advance(n);
+	return start();
+}
+
+// At exit: give the sink FLOW_DRAIN_MS to take the rest.
+inline void
+ovsink::drain(void) {
+	ULONGLONG deadline = GetTickCount64() + FLOW_DRAIN_MS;
+
+	while (!broken && !q.empty()) {
+		ULONGLONG now = GetTickCount64();
+
+		if (now >= deadline || WaitForSingleObject(ov.hEvent, (DWORD)(deadline - now)) != WAIT_OBJECT_0 ||
+		    complete() != WAITER_SUCCESS)
+			break;
+	}
+	unwritten = q.size();
+	close();
+	q.clear();
+}
+
+// Makes the sink for kind:arg, or says why it can't in why.
+typedef flowsink *(*sinkmaker)(const std::string &kind, const std::string &arg, size_t limit, bool drop,
+    std::string &why);
+
+// The chains from the -o specs, all fed from put().
+class flowgraph {
+private:
+	sinkmaker maker;
+	size_t max;
+	bool drop;
+	slabwriter in;
+	std::vector<flownode *> heads, nodes;
+	std::vector<flowsink *> sinks, waiters;
+public:
+	flowgraph(sinkmaker m, size_t limit, bool d) : maker(m), max(limit), drop(d) {}
+	~flowgraph() { for (flownode *n : nodes) delete n; }
+	bool add(const std::string &spec, std::string &why);
+	DWORD put(const __int8 *p, DWORD n);
+	DWORD finish(void);
+	void drain(void) { for (flowsink *s : sinks) s->drain(); }
+	bool blocked(bool stopped);
+	size_t nsinks(void) { return sinks.size(); }
+	flowsink *sink(size_t i) { return sinks[i]; }
+	// The events to wait on; when events()[i] fires, call complete(i).
+	unsigned events(HANDLE *ev);
+	DWORD complete(unsigned i) { return waiters[i]->complete(); }
+};
+
+inline bool
+flowgraph::add(const std::string &spec, std::string &why) {
+	std::vector<flowfilter *> chain;
+	flowsink *s = NULL;
+	size_t at = 0;
+
+	while (s == NULL) {
+		size_t comma = spec.find(',', at);
+		std::string el = spec.substr(at, comma == std::string::npos ? std::string::npos : comma - at);
+		size_t colon = el.find(':');
+		std::string kind = el.substr(0, colon), arg = colon == std::string::npos ? "" : el.substr(colon + 1);
+		flowfilter *f = NULL;
+
+		if ((kind == "strip" || kind == "dedup") && colon != std::string::npos)
+			why = kind + " takes no argument";
+		else if (kind == "strip")
+			f = new stripfilter();
+		else if (kind == "dedup")
+			f = new dedupfilter();
+		else if ((kind == "grep" || kind == "grep-v") && arg.empty())
+			why = kind + " needs a pattern";
+		else if (kind == "grep" || kind == "grep-v")
+			f = new grepfilter(arg, kind == "grep-v");
+		else if (sinks.size() == FLOW_MAXSINKS)
+			why = "too many sinks";
+		else {
+			// a sink, which takes the rest of the spec
+			s = maker(kind, colon == std::string::npos ? "" : spec.substr(at + colon + 1), max, drop, why);
+			if (s == NULL)
+				break;
+			continue;
+		}
+		if (f == NULL)
+			break;
+		chain.push_back(f);
+		if (comma == std::string::npos) {
+			why = "no sink at the end";
+			break;
+		}
+		at = comma + 1;
+	}
+	if (s == NULL) {
+		for (flowfilter *f : chain)
+			delete f;
+		return false;
+	}
+
+	for (size_t i = 0; i < chain.size(); i++) {
+		chain[i]->next = i + 1 < chain.size() ? (flownode *)chain[i + 1] : s;
+		nodes.push_back(chain[i]);
+	}
+	heads.push_back(chain.empty() ? (flownode *)s : chain[0]);
+	nodes.push_back(s);
+	sinks.push_back(s);
+	if (s->event() != NULL)
+		waiters.push_back(s);
+	return true;
+}
+
+inline DWORD
+flowgraph::put(const __int8 *p, DWORD n) {
+	slice s = in.put(p, n);
+
+	for (flownode *h : heads) {
+		if (h->put(s) != WAITER_SUCCESS)
+			return WAITER_IO_ERROR;
+	}
+	return WAITER_SUCCESS;
+}
+
+// The output has ended: what the filters hold goes on to the sinks.
+inline DWORD
+flowgraph::finish(void) {
+	for (flownode *h : heads) {
+		if (h->finish() != WAITER_SUCCESS)
+			return WAITER_IO_ERROR;
+	}
+	return WAITER_SUCCESS;
+}
+
+inline bool
+flowgraph::blocked(bool stopped) {
+	for (flowsink *s : sinks) {
+		if (s->blocked(stopped))
+			return true;
+	}
+	return false;
+}
+
+inline unsigned
+flowgraph::events(HANDLE *ev) {
+	for (size_t i = 0; i < waiters.size(); i++)
+		ev[i] = waiters[i]->event();
+	return (unsigned)waiters.size();
+}
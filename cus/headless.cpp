@@ -0,0 +1,470 @@
+// headless.cpp : capture pipes to log files without a console (-H).
+//
+// Every session is a pipe and a log with one fixed ring between them;
+// nothing grows once a session is set up. When a log falls behind and
+// its ring fills, the pipe isn't read until there's room again. All
+// handles share one I/O completion port, so a single thread can run
+// hundreds of sessions (WaitForMultipleObjects stops at 64 handles).
+//
+// With -w, that many workers share the port, scheduled as hlsched.h
+// says: a session runs on one worker at a time, a completion per turn,
+// in the order its completions came off the port, so its bytes stay in
+// order, and an idle worker takes over sessions another has waiting.
+// The default is one worker, on the main thread.
+//
+// Sessions are given on the command line and added or removed at run
+// time through a local control pipe, one command per line:
+//
+//	add <pipe> <log>	start capturing pipe, appending to log
+//	remove <pipe>		stop, once what's been read is logged
+//	list			one line per session: pipe, log, bytes logged
+//	workers			one line per worker: turns run, sessions stolen
+//	quit			remove everything and exit
+//
+// Each command gets "ok", or "error ..." in reply; list's lines come
+// before its "ok".
+
+#include "stdafx.h"
+#include "hlsched.h"
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define HL_RINGSIZE (16 * 1024)
+#define HL_CTLMAX 1024		// longest control command
+
+// completion keys; anything else is a session
+#define HL_KEY_CTL 0
+#define HL_KEY_QUIT 1
+
+struct hlsession : hltask {
+	std::wstring pipe, log;
+	HANDLE hPipe, hLog;
+	OVERLAPPED rd, wr;
+	bool reading, writing;
+	std::atomic<bool> stopping;	// no more reads: removed, or the pipe closed
+	bool failed;		// the log can't be written
+	bool removed;		// by a command; under hlLock
+	std::atomic<unsigned long long> head;	// logged, as a byte count
+	unsigned long long tail;	// read
+	__int8 ring[HL_RINGSIZE];
+};
+
+static HANDLE hPort;
+static std::mutex hlLock;	// sessions, quitting and ctl
+static std::list<hlsession *> sessions;
+static bool quitting, exiting;
+static hlsched sched;
+static unsigned nextOwner;
+static unsigned ctlSelf;	// the worker running a control command
+static OVERLAPPED quitov;
+
+static struct {
+	HANDLE h;
+	OVERLAPPED ov;
+	enum { CTL_CONNECTING, CTL_READING, CTL_WRITING } state;
+	char in[HL_CTLMAX];
+	size_t inlen;
+	std::string out;
+} ctl;
+
+VOID ErrorExit(LPCWSTR msg);
+
+static void hl_worker(unsigned self);
+static bool hl_kick(hlsession *s);
+static bool hl_done(hlsession *s, const hldone &d);
+static void hl_exit_check(void);
+static void ctl_listen(void);
+static void ctl_read(void);
+static void ctl_write(void);
+static void ctl_done(BOOL ok, DWORD n);
+static void ctl_command(const std::string &line);
+static std::wstring widen(const std::string &s);
+static std::string narrow(const std::wstring &s);
+
+int
+headless(const wchar_t *ctlname, unsigned nw, int argc, wchar_t *argv[]) {
+	std::vector<std::thread> threads;
+
+	sched.nworkers = nw;
+	hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, nw);
+	if (hPort == NULL)
+		ErrorExit(TEXT("CreateIoCompletionPort"));
+
+	ctl.h = CreateNamedPipe(ctlname, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_REJECT_REMOTE_CLIENTS, 1, HL_CTLMAX, HL_CTLMAX, 0, NULL);
+	if (ctl.h == INVALID_HANDLE_VALUE)
+		ErrorExit(ctlname);
+	if (CreateIoCompletionPort(ctl.h, hPort, HL_KEY_CTL, 0) == NULL)
+		ErrorExit(TEXT("CreateIoCompletionPort(control)"));
+
+	{
+		std::lock_guard<std::mutex> g(hlLock);
+
+		for (int i = 0; i + 1 < argc; i += 2)
+			ctl_command("add " + narrow(argv[i]) + " " + narrow(argv[i + 1]));
+		ctl.out.clear();
+		ctl_listen();
+	}
+
+	for (unsigned i = 1; i < nw; i++)
+		threads.emplace_back(hl_worker, i);
+	hl_worker(0);
+	for (auto &t : threads)
+		t.join();
+	return (0);
+}
+
+// Run sessions until there are none ready anywhere, then wait for I/O.
+// Whoever queues a session is awake and looks at every queue before it
+// waits, so nothing is left queued with everyone waiting.
+static void
+hl_worker(unsigned self) {
+	for (;;) {
+		hltask *t;
+		hlsession *s;
+		DWORD n;
+		ULONG_PTR key;
+		OVERLAPPED *ov;
+		hldone d;
+
+		while ((t = sched.next(self)) != NULL)
+			sched.run(self, t, [](hltask *t, const hldone &d) { return hl_done((hlsession *)t, d); });
+
+		sched.workers[self].busy = false;
+		d.ok = GetQueuedCompletionStatus(hPort, &n, &key, &ov, INFINITE);
+		d.error = d.ok ? ERROR_SUCCESS : GetLastError();
+		sched.workers[self].busy = true;
+		if (ov == NULL)
+			ErrorExit(TEXT("GetQueuedCompletionStatus"));
+		if (key == HL_KEY_QUIT)
+			return;
+		if (key == HL_KEY_CTL) {
+			std::lock_guard<std::mutex> g(hlLock);
+
+			ctlSelf = self;
+			ctl_done(d.ok, n);
+			hl_exit_check();
+			continue;
+		}
+		s = (hlsession *)key;
+		d.kind = ov == &s->rd ? d.HL_READ : d.HL_WRITE;
+		d.n = n;
+		sched.post(self, s, d);
+	}
+}
+
+// Once quitting, the last session gone and the reply written, stop
+// every worker. Under hlLock.
+static void
+hl_exit_check(void) {
+	if (!quitting || !sessions.empty() || ctl.state == ctl.CTL_WRITING || exiting)
+		return;
+	exiting = true;
+	for (unsigned i = 0; i < sched.nworkers; i++) {
+		if (!PostQueuedCompletionStatus(hPort, 0, HL_KEY_QUIT, &quitov))
+			ErrorExit(TEXT("PostQueuedCompletionStatus"));
+	}
+}
+
+static hlsession *
+hl_open(const std::wstring &pipe, const std::wstring &log, DWORD *error) {
+	LARGE_INTEGER size;
+	auto s = new hlsession();
+
+	s->pipe = pipe;
+	s->log = log;
+	s->hPipe = CreateFile(pipe.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (s->hPipe == INVALID_HANDLE_VALUE) {
+		*error = GetLastError();
+		delete s;
+		return NULL;
+	}
+	s->hLog = CreateFile(log.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE, NULL,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (s->hLog == INVALID_HANDLE_VALUE || !GetFileSizeEx(s->hLog, &size) ||
+	    CreateIoCompletionPort(s->hPipe, hPort, (ULONG_PTR)s, 0) == NULL ||
+	    CreateIoCompletionPort(s->hLog, hPort, (ULONG_PTR)s, 0) == NULL) {
+		*error = GetLastError();
+		CloseHandle(s->hPipe);
+		if (s->hLog != INVALID_HANDLE_VALUE)
+			CloseHandle(s->hLog);
+		delete s;
+		return NULL;
+	}
+
+	// append
+	s->wr.Offset = size.LowPart;
+	s->wr.OffsetHigh = size.HighPart;
+	return s;
+}
+
+// Start whatever I/O the session can do: a read into the free part of
+// the ring, a write of the filled part. Each stops at the wrap point.
+// Returns true if the session is finished, and freed.
+static bool
+hl_kick(hlsession *s) {
+	if (!s->stopping && !s->reading && s->tail - s->head < HL_RINGSIZE) {
+		DWORD off = (DWORD)(s->tail % HL_RINGSIZE);
+		DWORD len = (DWORD)(HL_RINGSIZE - (s->tail - s->head));
+
+		if (len > HL_RINGSIZE - off)
+			len = HL_RINGSIZE - off;
+		if (ReadFile(s->hPipe, s->ring + off, len, NULL, &s->rd) ||
+		    GetLastError() == ERROR_IO_PENDING || GetLastError() == ERROR_MORE_DATA)
+			s->reading = true;
+		else {
+			fwprintf(stderr, L"%s: read failed (error %u)\n", s->pipe.c_str(), GetLastError());
+			s->stopping = true;
+		}
+	}
+
+	if (!s->failed && !s->writing && s->tail != s->head) {
+		DWORD off = (DWORD)(s->head % HL_RINGSIZE);
+		DWORD len = (DWORD)(s->tail - s->head);
+
+		if (len > HL_RINGSIZE - off)
+			len = HL_RINGSIZE - off;
+		if (WriteFile(s->hLog, s->ring + off, len, NULL, &s->wr) || GetLastError() == ERROR_IO_PENDING)
+			s->writing = true;
+		else {
+			fwprintf(stderr, L"%s: log write failed (error %u)\n", s->log.c_str(), GetLastError());
+			s->failed = true;
+			s->stopping = true;
+			CancelIoEx(s->hPipe, NULL);
+		}
+	}
+
+	if (s->stopping && !s->reading && !s->writing && (s->failed || s->head == s->tail)) {
+		CloseHandle(s->hPipe);
+		CloseHandle(s->hLog);
+		{
+			std::lock_guard<std::mutex> g(hlLock);
+
+			sessions.remove(s);
+			hl_exit_check();
+		}
+		delete s;
+		return true;
+	}
+	return false;
+}
+
+// Returns true if the session is finished, and freed.
+static bool
+hl_done(hlsession *s, const hldone &d) {
+	BOOL ok = d.ok || d.error == ERROR_MORE_DATA;
+	DWORD n = d.n;
+
+	switch (d.kind) {
+	case d.HL_START:
+		break;
+	case d.HL_STOP:
+		if (!s->stopping) {
+			s->stopping = true;
+			CancelIoEx(s->hPipe, &s->rd);
+		}
+		break;
+	case d.HL_READ:
+		s->reading = false;
+		if (ok)
+			s->tail += n;
+		else if (!s->stopping) {
+			fwprintf(stderr, L"%s: closed (error %u)\n", s->pipe.c_str(), d.error);
+			s->stopping = true;
+		}
+		break;
+	case d.HL_WRITE:
+		s->writing = false;
+		if (ok) {
+			ULARGE_INTEGER pos;
+
+			s->head += n;
+			pos.LowPart = s->wr.Offset;
+			pos.HighPart = s->wr.OffsetHigh;
+			pos.QuadPart += n;
+			s->wr.Offset = pos.LowPart;
+			s->wr.OffsetHigh = pos.HighPart;
+		} else {
+			fwprintf(stderr, L"%s: log write failed (error %u)\n", s->log.c_str(), d.error);
+			s->failed = true;
+			s->stopping = true;
+			CancelIoEx(s->hPipe, NULL);
+		}
+		break;
+	}
+	return hl_kick(s);
+}
+
+static void
+ctl_listen(void) {
+	ctl.state = ctl.CTL_CONNECTING;
+	ctl.inlen = 0;
+	ZeroMemory(&ctl.ov, sizeof(ctl.ov));
+	if (ConnectNamedPipe(ctl.h, &ctl.ov) || GetLastError() == ERROR_IO_PENDING)
+		return;
+	if (GetLastError() == ERROR_PIPE_CONNECTED) {
+		// connected before we asked; no completion is coming
+		ctl_read();
+		return;
+	}
+	ErrorExit(TEXT("ConnectNamedPipe"));
+}
+
+static void
+ctl_read(void) {
+	ctl.state = ctl.CTL_READING;
+	if (!ReadFile(ctl.h, ctl.in + ctl.inlen, (DWORD)(sizeof(ctl.in) - ctl.inlen), NULL, &ctl.ov) &&
+	    GetLastError() != ERROR_IO_PENDING) {
+		DisconnectNamedPipe(ctl.h);
+		ctl_listen();
+	}
+}
+
+static void
+ctl_write(void) {
+	ctl.state = ctl.CTL_WRITING;
+	if (!WriteFile(ctl.h, ctl.out.data(), (DWORD)ctl.out.size(), NULL, &ctl.ov) &&
+	    GetLastError() != ERROR_IO_PENDING) {
+		DisconnectNamedPipe(ctl.h);
+		ctl_listen();
+	}
+}
+
+static void
+ctl_done(BOOL ok, DWORD n) {
+	if (!ok && ctl.state != ctl.CTL_CONNECTING) {
+		// the client went away
+		ctl.out.clear();
+		DisconnectNamedPipe(ctl.h);
+		ctl_listen();
+		return;
+	}
+
+	switch (ctl.state) {
+	case ctl.CTL_CONNECTING:
+		ctl_read();
+		return;
+	case ctl.CTL_WRITING:
+		ctl.out.erase(0, n);
+		if (!ctl.out.empty()) {
+			ctl_write();
+			return;
+		}
+		break;
+	case ctl.CTL_READING: {
+		size_t start = 0;
+
+		ctl.inlen += n;
+		for (size_t i = 0; i < ctl.inlen; i++) {
+			if (ctl.in[i] != '\n')
+				continue;
+			std::string line(ctl.in + start, i - start);
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			ctl_command(line);
+			start = i + 1;
+		}
+		memmove(ctl.in, ctl.in + start, ctl.inlen - start);
+		ctl.inlen -= start;
+		if (ctl.inlen == sizeof(ctl.in)) {
+			ctl.out.append("error command too long\n");
+			ctl.inlen = 0;
+		}
+		if (!ctl.out.empty()) {
+			ctl_write();
+			return;
+		}
+		break;
+	}
+	}
+	ctl_read();
+}
+
+static void
+ctl_command(const std::string &line) {
+	size_t sp = line.find(' ');
+	std::string cmd = line.substr(0, sp);
+	std::string arg = sp == std::string::npos ? "" : line.substr(sp + 1);
+
+	if (cmd == "add") {
+		size_t sp2 = arg.find(' ');
+		hlsession *s;
+		DWORD error;
+
+		if (quitting) {
+			ctl.out.append("error quitting\n");
+			return;
+		}
+		if (sp2 == std::string::npos || sp2 == 0 || sp2 + 1 == arg.size()) {
+			ctl.out.append("error usage: add pipe log\n");
+			return;
+		}
+		s = hl_open(widen(arg.substr(0, sp2)), widen(arg.substr(sp2 + 1)), &error);
+		if (s == NULL) {
+			ctl.out.append("error " + std::to_string(error) + "\n");
+			fwprintf(stderr, L"%s: %s: error %u\n", widen(arg.substr(0, sp2)).c_str(),
+				widen(arg.substr(sp2 + 1)).c_str(), error);
+			return;
+		}
+		sessions.push_back(s);
+		s->owner = nextOwner++ % sched.nworkers;
+		sched.post(ctlSelf, s, hldone{ hldone::HL_START, TRUE, 0, ERROR_SUCCESS });
+		ctl.out.append("ok\n");
+	} else if (cmd == "remove") {
+		std::wstring pipe = widen(arg);
+
+		for (auto s : sessions) {
+			if (s->pipe == pipe && !s->stopping && !s->removed) {
+				s->removed = true;
+				sched.post(ctlSelf, s, hldone{ hldone::HL_STOP, TRUE, 0, ERROR_SUCCESS });
+				ctl.out.append("ok\n");
+				return;
+			}
+		}
+		ctl.out.append("error no such session\n");
+	} else if (cmd == "list") {
+		for (auto s : sessions)
+			ctl.out.append(narrow(s->pipe) + " " + narrow(s->log) + " " + std::to_string(s->head) +
+				(s->stopping || s->removed ? " stopping\n" : "\n"));
+		ctl.out.append("ok\n");
+	} else if (cmd == "workers") {
+		for (unsigned i = 0; i < sched.nworkers; i++)
+			ctl.out.append(std::to_string(i) + " " + std::to_string(sched.workers[i].runs) + " " +
+				std::to_string(sched.workers[i].steals) + "\n");
+		ctl.out.append("ok\n");
+	} else if (cmd == "quit") {
+		quitting = true;
+		// sessions are only freed under hlLock, which we hold
+		for (auto s : sessions) {
+			if (!s->removed) {
+				s->removed = true;
+				sched.post(ctlSelf, s, hldone{ hldone::HL_STOP, TRUE, 0, ERROR_SUCCESS });
+			}
+		}
+		ctl.out.append("ok\n");
+	} else if (!cmd.empty())
+		ctl.out.append("error unknown command\n");
+}
+
+static std::wstring
+widen(const std::string &s) {
+	std::wstring w(s.size(), 0);
+	int n = MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), &w[0], (int)w.size());
+
+	w.resize(n > 0 ? n : 0);
+	return w;
+}
+
+static std::string
+narrow(const std::wstring &w) {
+	std::string s(w.size() * 3, 0);
+	int n = WideCharToMultiByte(CP_UTF8, 0, w.data(), (int)w.size(), &s[0], (int)s.size(), NULL, NULL);
+
+	s.resize(n > 0 ? n : 0);
+	return s;
+}
@@ -0,0 +1,167 @@
+// hexdump.h : guest output as offset/hex/ASCII lines, for ~x.
+//
+// Lines look like hexdump -C:
+//
+//	0001f3a0  7f 45 4c 46 02 01 01 00  00 00 00 00 00 00 00 00  |.ELF............|
+//
+// The offset counts guest output from the start of the session. Bytes
+// that don't fill a line are held until they do; partial() shows them
+// meanwhile. With SSE2 a whole line's hex digits and printable column
+// are made 16 bytes at a time; otherwise a digit table is used.
+
+#pragma once
+
+#include "compat.h"
+#include "simd.h"
+#include <string.h>
+#include <string>
+
+#define HEXDUMP_WIDTH 16
+#define HEXDUMP_LINEMAX 96	// with a 16-digit offset and CR LF
+
+class hexdump {
+private:
+	unsigned long long off;		// of held[0]
+	unsigned char held[HEXDUMP_WIDTH];
+	unsigned nheld;
+	char *line(const unsigned char *p, unsigned n, char *q);
+	void append(const unsigned char *p, unsigned n, const char *end, std::string &out);
+public:
+	explicit hexdump(unsigned long long start) : off(start), nheld(0) {}
+	void format(const __int8 *p, size_t n, std::string &out);
+	void partial(std::string &out);
+	void flush(std::string &out);
+};
+
+// Write the line for n (at most HEXDUMP_WIDTH) bytes at off to q,
+// without the line end, and return where it ends. Short lines are
+// padded so the ASCII column stays in place. q needs HEXDUMP_LINEMAX
+// bytes (the SSE2 store may write past the line's end).
+inline char *
+hexdump::line(const unsigned char *p, unsigned n, char *q) {
+	static const char digits[] = "0123456789abcdef";
+	char hex[2 * HEXDUMP_WIDTH];
+	int shift = off >> 32 != 0 ? 60 : 28;
+
+	for (; shift >= 0; shift -= 4)
+		*q++ = digits[(off >> shift) & 0xf];
+	*q++ = ' ';
+
+#ifdef CUS_SSE2
+	if (n == HEXDUMP_WIDTH) {
+		const __m128i mask = _mm_set1_epi8(0x0f);
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		__m128i lo = _mm_and_si128(v, mask);
+		__m128i ascii;
+
+		// nibble + '0', and 'a' - '0' - 10 more where it's over 9
+		hi = _mm_add_epi8(_mm_add_epi8(hi, _mm_set1_epi8('0')),
+		    _mm_and_si128(_mm_cmpgt_epi8(hi, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10)));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, _mm_set1_epi8('0')),
+		    _mm_and_si128(_mm_cmpgt_epi8(lo, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10)));
+		_mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+
+		// printable is 0x20..0x7e; bytes from 0x80 are negative here
+		__m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)),
+		    _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+		ascii = _mm_or_si128(_mm_and_si128(printable, v), _mm_andnot_si128(printable, _mm_set1_epi8('.')));
+
+		for (unsigned i = 0; i < HEXDUMP_WIDTH; i++, q += 3) {
+			if (i == HEXDUMP_WIDTH / 2)
+				*q++ = ' ';
+			q[0] = ' ';
+			memcpy(q + 1, hex + 2 * i, 2);
+		}
+		*q++ = ' ';
+		*q++ = ' ';
+		*q++ = '|';
+		_mm_storeu_si128((__m128i *)q, ascii);
+		q += HEXDUMP_WIDTH;
+		*q++ = '|';
+		return q;
+	}
+#endif
+	(void)hex;
+	for (unsigned i = 0; i < HEXDUMP_WIDTH; i++) {
+		*q++ = ' ';
+		if (i == HEXDUMP_WIDTH / 2)
+			*q++ = ' ';
+		*q++ = i < n ? digits[p[i] >> 4] : ' ';
+		*q++ = i < n ? digits[p[i] & 0xf] : ' ';
+	}
+	*q++ = ' ';
+	*q++ = ' ';
+	*q++ = '|';
+	for (unsigned i = 0; i < n; i++)
+		*q++ = p[i] >= 0x20 && p[i] < 0x7f ? (char)p[i] : '.';
+	*q++ = '|';
+	return q;
+}
+
+inline void
+hexdump::append(const unsigned char *p, unsigned n, const char *end, std::string &out) {
+	char buf[HEXDUMP_LINEMAX + 16], *q = line(p, n, buf);
+
+	while (*end != 0)
+		*q++ = *end++;
+	out.append(buf, q - buf);
+}
+
+// Append the lines n more bytes complete.
+inline void
+hexdump::format(const __int8 *p, size_t n, std::string &out) {
+	const unsigned char *s = (const unsigned char *)p;
+
+	if (nheld != 0) {
+		unsigned k = n < HEXDUMP_WIDTH - nheld ? (unsigned)n : HEXDUMP_WIDTH - nheld;
+
+		memcpy(held + nheld, s, k);
+		nheld += k;
+		s += k;
+		n -= k;
+		if (nheld < HEXDUMP_WIDTH)
+			return;
+		append(held, HEXDUMP_WIDTH, "\r\n", out);
+		off += HEXDUMP_WIDTH;
+		nheld = 0;
+	}
+
+	// Whole lines go straight into out, sized for the longest.
+	if (n >= HEXDUMP_WIDTH) {
+		size_t at = out.size();
+		char *q;
+
+		out.resize(at + (n / HEXDUMP_WIDTH) * HEXDUMP_LINEMAX + 16);
+		q = &out[at];
+		for (; n >= HEXDUMP_WIDTH; s += HEXDUMP_WIDTH, n -= HEXDUMP_WIDTH) {
+			q = line(s, HEXDUMP_WIDTH, q);
+			*q++ = '\r';
+			*q++ = '\n';
+			off += HEXDUMP_WIDTH;
+		}
+		out.resize(q - out.data());
+	}
+	memcpy(held, s, n);
+	nheld = (unsigned)n;
+}
+
+// The held bytes as a line ending in CR, for the next full line to
+// overwrite.
+inline void
+hexdump::partial(std::string &out) {
+	if (nheld == 0)
+		return;
+	append(held, nheld, "\r", out);
+}
+
+// The held bytes as a finished line.
+inline void
+hexdump::flush(std::string &out) {
+	if (nheld == 0)
+		return;
+	append(held, nheld, "\r\n", out);
+	off += nheld;
+	nheld = 0;
+}
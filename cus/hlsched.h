@@ -0,0 +1,137 @@
+// hlsched.h : which -H worker runs which session, and when (-w).
+//
+// Each worker has a queue of sessions with completions waiting; whichever
+// worker takes a completion off the port posts it to the session and,
+// if the session isn't already queued, queues it for the worker that
+// owns it, or takes it over if that worker is waiting on the port.
+// Workers run their own queue first and, when it's empty, steal from the
+// back of another's, taking the session over. A session runs on one
+// worker at a time, a completion per turn, in the order they were
+// posted. One that has more waiting goes to the back of the queue, so a
+// busy session doesn't hold up the others on its worker.
+//
+// Nothing here touches the port, so the bench can run it against a fake
+// one on Linux.
+
+#pragma once
+
+#include "compat.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+#define HL_MAXWORKERS 64
+
+// What a session has to handle: its I/O completing, or a control command.
+struct hldone {
+	enum { HL_READ, HL_WRITE, HL_START, HL_STOP } kind;
+	BOOL ok;
+	DWORD n, error;
+};
+
+// The scheduler's part of a session.
+struct hltask {
+	std::mutex lock;	// done, queued, owner
+	std::deque<hldone> done;
+	bool queued;		// on a ready queue, or running
+	unsigned owner;
+
+	hltask() : queued(false), owner(0) {}
+};
+
+struct hlworker {
+	std::mutex lock;
+	std::deque<hltask *> ready;
+	std::atomic<bool> busy;		// not waiting on the port
+	std::atomic<unsigned long long> runs, steals;
+
+	hlworker() : busy(false), runs(0), steals(0) {}
+};
+
+class hlsched {
+public:
+	hlworker workers[HL_MAXWORKERS];
+	unsigned nworkers;
+
+	hlsched() : nworkers(1) {}
+	hltask *next(unsigned self);
+	void post(unsigned self, hltask *t, const hldone &d);
+	// handle(t, d) returns true once t is finished, and freed.
+	template <class F> void run(unsigned self, hltask *t, F handle);
+};
+
+// The next task for self to run: its own oldest, or another's newest.
+// Whatever is left on an idle worker's queue is taken too, or it would
+// wait for that worker's next completion.
+inline hltask *
+hlsched::next(unsigned self) {
+	for (unsigned i = 0; i < nworkers; i++) {
+		hlworker *w = &workers[(self + i) % nworkers];
+		std::lock_guard<std::mutex> g(w->lock);
+		hltask *t;
+
+		if (w->ready.empty())
+			continue;
+		if (i == 0) {
+			t = w->ready.front();
+			w->ready.pop_front();
+			return t;
+		}
+		t = w->ready.back();
+		w->ready.pop_back();
+		t->owner = self;
+		workers[self].steals++;
+		return t;
+	}
+	return NULL;
+}
+
+// Give t something to handle, and queue it unless it's queued already:
+// for its owner, or for self if the owner is waiting on the port.
+inline void
+hlsched::post(unsigned self, hltask *t, const hldone &d) {
+	unsigned owner;
+
+	{
+		std::lock_guard<std::mutex> g(t->lock);
+
+		t->done.push_back(d);
+		if (t->queued)
+			return;
+		t->queued = true;
+		if (!workers[t->owner].busy)
+			t->owner = self;
+		owner = t->owner;
+	}
+	std::lock_guard<std::mutex> g(workers[owner].lock);
+	workers[owner].ready.push_back(t);
+}
+
+// One turn: the oldest thing t has to handle. If there's more, t goes to
+// the back of the queue.
+template <class F>
+inline void
+hlsched::run(unsigned self, hltask *t, F handle) {
+	hldone d;
+	bool more;
+
+	{
+		std::lock_guard<std::mutex> g(t->lock);
+
+		d = t->done.front();
+		t->done.pop_front();
+	}
+	workers[self].runs++;
+	if (handle(t, d))
+		return;
+	{
+		std::lock_guard<std::mutex> g(t->lock);
+
+		more = !t->done.empty();
+		t->queued = more;
+	}
+	if (more) {
+		std::lock_guard<std::mutex> g(workers[self].lock);
+		workers[self].ready.push_back(t);
+	}
+}
@@ -0,0 +1,64 @@
+// latency.h : a small fixed-size latency histogram.
+//
+// Samples (in microseconds) go into power-of-two buckets, so adding one
+// is a couple of instructions and the whole thing is a few hundred
+// bytes. Percentiles are reported as the upper bound of their bucket,
+// i.e. to within a factor of two, but never above the max; the mean and
+// max are exact.
+
+#pragma once
+
+#include <string>
+#include <stdio.h>
+
+#define LAT_BUCKETS 40
+
+class lathist {
+private:
+	unsigned long long buckets[LAT_BUCKETS];	// [i] holds samples < 2^i us
+	unsigned long long n, total, worst;
+public:
+	lathist() : buckets(), n(0), total(0), worst(0) {}
+	void add(unsigned long long us);
+	unsigned long long count() { return n; }
+	unsigned long long max() { return worst; }
+	double mean() { return n == 0 ? 0.0 : (double)total / n; }
+	unsigned long long percentile(double p);
+	std::string summary();
+};
+
+inline void
+lathist::add(unsigned long long us) {
+	int b = 0;
+
+	while (b < LAT_BUCKETS - 1 && (us >> b) != 0)
+		b++;
+	buckets[b]++;
+	n++;
+	total += us;
+	if (us > worst)
+		worst = us;
+}
+
+inline unsigned long long
+lathist::percentile(double p) {
+	unsigned long long want = (unsigned long long)(p / 100.0 * n + 0.5), seen = 0;
+
+	for (int b = 0; b < LAT_BUCKETS; b++) {
+		seen += buckets[b];
+		if (seen >= want && seen != 0)
+			return b == 0 ? 0 : (1ULL << b) < worst ? (1ULL << b) : worst;
+	}
+	return worst;
+}
+
+// e.g. "mean 1.73 ms, p50 <= 2.05 ms, p99 <= 4.10 ms, max 7.10 ms": p50
+// in [1024, 2048) us, p99 in [2048, 4096) us
+inline std::string
+lathist::summary() {
+	char buf[160];
+
+	snprintf(buf, sizeof(buf), "mean %.2f ms, p50 <= %.2f ms, p99 <= %.2f ms, max %.2f ms",
+	    mean() / 1000.0, percentile(50) / 1000.0, percentile(99) / 1000.0, worst / 1000.0);
+	return buf;
+}
@@ -0,0 +1,178 @@
+// linededup.h : collapse repeated lines in the log (-d).
+//
+// Each completed line is hashed and checked against the last
+// DEDUP_WINDOW lines written. A run of identical lines, or of an
+// identical block of up to DEDUP_WINDOW lines, is written once and
+// followed by a "last message repeated N times" line when it ends.
+// Partial lines are carried across calls, so a line split between
+// abuffers is still seen whole. On output that doesn't repeat this
+// costs one hash and a few compares per line.
+
+#pragma once
+
+#include "compat.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#define DEDUP_WINDOW	8
+#define DEDUP_LINEMAX	65536
+#define DEDUP_MARKEVERY	65536	// cycles; a run that never ends still shows up
+
+// Word-at-a-time multiply/rotate hash.
+static inline unsigned long long
+dedup_hash(const char *p, size_t n) {
+	const unsigned long long k = 0x9e3779b97f4a7c15ULL;
+	unsigned long long h = n * k, w;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&w, p + i, 8);
+		h = (((h << 5) | (h >> 59)) ^ w) * k;
+	}
+	if (i < n) {
+		w = 0;
+		memcpy(&w, p + i, n - i);
+		h = (((h << 5) | (h >> 59)) ^ w) * k;
+	}
+	return h ^ (h >> 32);
+}
+
+class linededup {
+private:
+	struct entry {
+		unsigned long long hash;
+		std::string text;	// including its line ending
+	} hist[DEDUP_WINDOW];	// lines written, a ring
+	unsigned nhist, histpos;
+	std::string cur;	// the line being collected
+	bool longline;		// cur hit DEDUP_LINEMAX; pass the rest through
+	unsigned period;	// nonzero while a run of this many lines repeats
+	unsigned long long nrep;	// lines held back in the run
+	unsigned long long nsuppressed;
+
+	entry &back(unsigned k) { return hist[(histpos + DEDUP_WINDOW - k) % DEDUP_WINDOW]; }
+	void remember(unsigned long long h, std::string &text);
+	void mark(std::string &out, unsigned long long cycles);
+	void endrun(std::string &out);
+	void line(std::string &out);
+public:
+	linededup() : nhist(0), histpos(0), longline(false), period(0), nrep(0), nsuppressed(0) {}
+	void filter(const __int8 *p, DWORD n, std::string &out);
+	void flush(std::string &out);
+	unsigned long long suppressed() { return nsuppressed; }
+};
+
+// Takes text's contents; it's left empty.
+inline void
+linededup::remember(unsigned long long h, std::string &text) {
+	entry &e = hist[histpos];
+
+	e.hash = h;
+	e.text.swap(text);
+	text.clear();
+	histpos = (histpos + 1) % DEDUP_WINDOW;
+	if (nhist < DEDUP_WINDOW)
+		nhist++;
+}
+
+inline void
+linededup::mark(std::string &out, unsigned long long cycles) {
+	const std::string &last = back(1).text;
+	char buf[80];
+
+	if (period == 1)
+		snprintf(buf, sizeof(buf), "last message repeated %llu times", cycles);
+	else
+		snprintf(buf, sizeof(buf), "last %u lines repeated %llu times", period, cycles);
+	out.append(buf);
+	out.append(last.size() > 1 && last[last.size() - 2] == '\r' ? "\r\n" : "\n");
+	nsuppressed += cycles * period;
+}
+
+// The run is over: report the whole cycles, then write out any part of
+// a cycle that was held back, since it never completed.
+inline void
+linededup::endrun(std::string &out) {
+	unsigned left = (unsigned)(nrep % period);
+	std::string partial[DEDUP_WINDOW];
+
+	if (nrep >= period)
+		mark(out, nrep / period);
+	for (unsigned i = 0; i < left; i++)
+		partial[i] = back(period - i).text;
+	for (unsigned i = 0; i < left; i++) {
+		out.append(partial[i]);
+		remember(dedup_hash(partial[i].data(), partial[i].size()), partial[i]);
+	}
+	period = 0;
+	nrep = 0;
+}
+
+inline void
+linededup::line(std::string &out) {
+	unsigned long long h = dedup_hash(cur.data(), cur.size());
+
+	if (period != 0) {
+		entry &e = back(period - (unsigned)(nrep % period));
+
+		if (e.hash == h && e.text == cur) {
+			cur.clear();
+			if (++nrep == (unsigned long long)DEDUP_MARKEVERY * period) {
+				mark(out, DEDUP_MARKEVERY);
+				nrep = 0;
+			}
+			return;
+		}
+		endrun(out);
+	}
+	for (unsigned k = 1; k <= nhist; k++) {
+		entry &e = back(k);
+
+		if (e.hash == h && e.text == cur) {
+			period = k;
+			nrep = 1;
+			cur.clear();
+			return;
+		}
+	}
+	out.append(cur);
+	remember(h, cur);
+}
+
+inline void
+linededup::filter(const __int8 *p, DWORD n, std::string &out) {
+	const char *cp = (const char *)p;
+
+	while (n > 0) {
+		const char *nl = (const char *)memchr(cp, '\n', n);
+		DWORD len = nl != NULL ? (DWORD)(nl - cp + 1) : n;
+
+		if (longline) {
+			out.append(cp, len);
+			if (nl != NULL)
+				longline = false;
+		} else {
+			cur.append(cp, len);
+			if (nl != NULL)
+				line(out);
+			else if (cur.size() > DEDUP_LINEMAX) {
+				if (period != 0)
+					endrun(out);
+				out.append(cur);
+				cur.clear();
+				longline = true;
+			}
+		}
+		cp += len;
+		n -= len;
+	}
+}
+
+inline void
+linededup::flush(std::string &out) {
+	if (period != 0)
+		endrun(out);
+	out.append(cur);
+	cur.clear();
+}
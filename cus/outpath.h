@@ -0,0 +1,92 @@
+// outpath.h : the pipe output path, put together for the session.
+//
+// Every buffer read from the pipe goes through the same stages: the
+// outputs that see the raw bytes (the console, and the scrollback,
+// recording, -f and -o), then the log's filters (-c, -d), then the log
+// writer (the queue, -t's ring, -u's buffers, or none), which hands
+// what it took to the -k index, or not. Asking at each
+// stage which way to go costs a few loads and branches per buffer,
+// mostly for features the session doesn't use. So each stage is a
+// policy class, outpath() is written once over them, and
+// outpaths<P>::pick() looks at the options once, at startup, and
+// returns the instantiation for them, in which the unused stages aren't
+// there at all.
+//
+// P supplies the policies: cus.cpp has the real ones and
+// bench/pathbench.cpp has stand-ins.
+//
+//	P::ctx					what the stages are passed
+//	P::raw_console, P::raw_all		static DWORD put(ctx &, const __int8 *, DWORD)
+//	P::clean_off, P::clean_on		template <class L, class I> static DWORD put(ctx &, abuffer *)
+//	P::log_none, P::log_queue, P::log_drop,	template <class I> static DWORD put(ctx &, abuffer *)
+//	    P::log_ring, P::log_direct
+//	P::index_off, P::index_on		static DWORD put(ctx &, const __int8 *, DWORD)
+//
+// raw_console is for a session with nothing but the console. The clean
+// and log policies own the buffer they are given; a clean policy passes
+// its output on to the log policy L, and that the bytes its writer took
+// to the index policy I.
+
+#pragma once
+
+#include "abuffer.h"
+#include "asyncout.h"
+
+enum outlog { OUTLOG_NONE, OUTLOG_QUEUE, OUTLOG_DROP, OUTLOG_RING, OUTLOG_DIRECT };
+
+template <class P, class R, class C, class L, class I>
+DWORD
+outpath(typename P::ctx &x, abuffer *abuf) {
+	DWORD ret;
+
+	if (abuf->empty()) {
+		delete abuf;
+		return WAITER_SUCCESS;
+	}
+	if ((ret = R::put(x, abuf->getptr(), abuf->size())) != WAITER_SUCCESS)
+		return ret;
+	return C::template put<L, I>(x, abuf);
+}
+
+template <class P>
+struct outpaths {
+	typedef DWORD (*fn)(typename P::ctx &x, abuffer *abuf);
+
+	template <class R, class C, class I>
+	static fn pick_log(outlog log) {
+		switch (log) {
+		case OUTLOG_QUEUE:
+			return outpath<P, R, C, typename P::log_queue, I>;
+		case OUTLOG_DROP:
+			return outpath<P, R, C, typename P::log_drop, I>;
+		case OUTLOG_RING:
+			return outpath<P, R, C, typename P::log_ring, I>;
+		case OUTLOG_DIRECT:
+			return outpath<P, R, C, typename P::log_direct, I>;
+		default:
+			return outpath<P, R, C, typename P::log_none, I>;
+		}
+	}
+
+	template <class R, class C>
+	static fn pick_index(outlog log, bool index) {
+		if (index && log != OUTLOG_NONE)
+			return pick_log<R, C, typename P::index_on>(log);
+		return pick_log<R, C, typename P::index_off>(log);
+	}
+
+	template <class R>
+	static fn pick_clean(bool clean, outlog log, bool index) {
+		if (clean)
+			return pick_index<R, typename P::clean_on>(log, index);
+		return pick_index<R, typename P::clean_off>(log, index);
+	}
+
+	// raw: anything besides the console sees the raw bytes; clean: the
+	// log is filtered; index: what's logged is indexed.
+	static fn pick(bool raw, bool clean, outlog log, bool index) {
+		if (raw)
+			return pick_clean<typename P::raw_all>(clean, log, index);
+		return pick_clean<typename P::raw_console>(clean, log, index);
+	}
+};
@@ -0,0 +1,278 @@
+// printkidx.h : the printk lines of a log, in columns (-k, tools/logidx -q).
+//
+// As bytes go to the log, pkindex splits them into lines, across
+// buffer boundaries, and keeps a record of each line that starts with
+// a printk level ("<6>") or timestamp ("[   12.345678]"), or both: the
+// guest time, the host time its first byte arrived, the level, and
+// where the line is in the log. PK_BLOCKRECS records make a block, and
+// each block is appended to the side file (log.pk) a column at a time:
+//
+//	pkblock		magic, count, what the block covers, column widths
+//	gts[count]	guest time in us, less gtsmin, plus 1; 0 for none
+//	hts[count]	host time in us since 1970, less htsmin
+//	level[count]	0-7, or PK_NOLEVEL
+//	off[count]	in the log, less offbase
+//	len[count]	with the newline
+//
+// Each column is stored in the fewest bytes (1, 2, 4 or 8, little
+// endian) that hold its largest value in the block, which is typically
+// 4, 4, 1, 4 and 1: 14 bytes a line. A query reads the block headers,
+// skips the blocks that can't match, and reads only the time and level
+// columns of the rest; offsets, lengths and the lines themselves only
+// for the records that match. Blocks are whole or missing, so the file
+// can be read as it grows.
+
+#pragma once
+
+#include "compat.h"
+#include "bootindex.h"	// printk_ts
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define PK_MAGIC "cuspk2\n"
+#define PK_BLOCKRECS 1024
+#define PK_HEADMAX 32		// enough of a line for "<NNN>[ssssss.uuuuuu]"
+#define PK_NOLEVEL 8
+
+enum { PK_GTS, PK_HTS, PK_LEVEL, PK_OFF, PK_LEN, PK_NCOLS };
+
+struct pkblock {
+	char magic[8];
+	unsigned count;
+	unsigned levels;		// bit L: a line at level L; bit PK_NOLEVEL
+	long long gtsmin, gtsmax;	// -1 if no line has a timestamp
+	unsigned long long htsmin, htsmax;
+	unsigned long long offbase;
+	unsigned char width[PK_NCOLS];
+	unsigned char pad[3];
+};
+
+// Where column col of block b starts, from the start of the block;
+// column PK_NCOLS is the end of the block.
+inline size_t
+pk_column(const pkblock &b, int col) {
+	size_t at = sizeof(pkblock);
+
+	for (int i = 0; i < col; i++)
+		at += (size_t)b.width[i] * b.count;
+	return at;
+}
+
+// n values of width w from p.
+inline void
+pk_decode(const unsigned char *p, unsigned w, unsigned n, unsigned long long *out) {
+	for (unsigned i = 0; i < n; i++, p += w) {
+		unsigned long long v = 0;
+
+		for (unsigned j = 0; j < w; j++)
+			v |= (unsigned long long)p[j] << (8 * j);
+		out[i] = v;
+	}
+}
+
+// What logidx -q looks for: times in us, each range inclusive.
+struct pkquery {
+	int maxlevel;		// -1 for any
+	bool gts, hts;
+	long long gfrom, gto, hfrom, hto;
+};
+
+// Whether any line in block b can match q, from the header alone.
+inline bool
+pk_maybe(const pkblock &b, const pkquery &q) {
+	if (q.maxlevel >= 0 && (b.levels & ((2u << q.maxlevel) - 1)) == 0)
+		return false;
+	if (q.gts && (b.gtsmin < 0 || b.gtsmax < q.gfrom || b.gtsmin > q.gto))
+		return false;
+	if (q.hts && ((long long)b.htsmax < q.hfrom || (long long)b.htsmin > q.hto))
+		return false;
+	return true;
+}
+
+// Whether a line of block b matches q, given its gts, hts and level
+// columns as stored; only those q looks at need to have been read.
+inline bool
+pk_match(const pkblock &b, const pkquery &q, unsigned long long gts, unsigned long long hts, unsigned long long level) {
+	long long g = (long long)gts + b.gtsmin - 1;
+	long long h = (long long)(hts + b.htsmin);
+
+	if (q.maxlevel >= 0 && level > (unsigned)q.maxlevel)
+		return false;
+	if (q.gts && (gts == 0 || g < q.gfrom || g > q.gto))
+		return false;
+	if (q.hts && (h < q.hfrom || h > q.hto))
+		return false;
+	return true;
+}
+
+// A level ("<6>", or a syslog priority like "<30>") at p.
+inline bool
+printk_level(const char *p, const char *end, unsigned *level, const char **after) {
+	const char *q = p + 1;
+	unsigned v = 0;
+
+	if (p >= end || *p != '<')
+		return false;
+	for (; q < end && *q >= '0' && *q <= '9' && q - p <= 3; q++)
+		v = v * 10 + (*q - '0');
+	if (q == p + 1 || q == end || *q != '>')
+		return false;
+	*level = v & 7;
+	*after = q + 1;
+	return true;
+}
+
+class pkindex {
+	unsigned long long off;		// in the log, of the next byte
+	unsigned long long lstart, lhost;
+	bool inline_;			// part way through a line
+	char head[PK_HEADMAX];
+	unsigned headlen;
+	unsigned long long nlines;
+
+	std::vector<long long> gts;
+	std::vector<unsigned long long> hts, offs, lens;
+	std::vector<unsigned char> levels;
+
+	void line(unsigned long long end, std::string &out);
+	void block(std::string &out);
+
+public:
+	pkindex() : off(0), lstart(0), lhost(0), inline_(false), headlen(0), nlines(0) {}
+	// n more bytes of the log, which arrived at now (us since 1970).
+	// A full block is appended to out.
+	void feed(const __int8 *p, DWORD n, unsigned long long now, std::string &out);
+	// At the end: the last line, unterminated, and the block so far.
+	void flush(std::string &out);
+	unsigned long long lines() { return nlines; }
+};
+
+inline void
+pkindex::feed(const __int8 *p, DWORD n, unsigned long long now, std::string &out) {
+	const __int8 *end = p + n;
+
+	while (p < end) {
+		const __int8 *nl = (const __int8 *)memchr(p, '\n', end - p);
+		const __int8 *stop = nl != NULL ? nl + 1 : end;
+
+		if (!inline_) {
+			inline_ = true;
+			lstart = off;
+			lhost = now;
+		}
+		if (headlen < PK_HEADMAX) {
+			size_t take = (size_t)(stop - p) < PK_HEADMAX - headlen ? (size_t)(stop - p) : PK_HEADMAX - headlen;
+
+			memcpy(head + headlen, p, take);
+			headlen += (unsigned)take;
+		}
+		off += stop - p;
+		p = stop;
+		if (nl != NULL)
+			line(off, out);
+	}
+}
+
+inline void
+pkindex::flush(std::string &out) {
+	if (inline_)
+		line(off, out);
+	if (!gts.empty())
+		block(out);
+}
+
+// The line from lstart to end is done; keep it if it's printk's.
+inline void
+pkindex::line(unsigned long long end, std::string &out) {
+	const char *p = head, *hend = head + headlen;
+	unsigned level = PK_NOLEVEL;
+	double ts;
+	bool hasts;
+
+	inline_ = false;
+	headlen = 0;
+	if (printk_level(p, hend, &level, &p))
+		hasts = printk_ts(p, hend, &ts);
+	else if ((hasts = printk_ts(p, hend, &ts))) {
+		// "[ts] <6>", as some consoles put it
+		const char *q = (const char *)memchr(p, ']', hend - p) + 1;
+
+		while (q < hend && *q == ' ')
+			q++;
+		printk_level(q, hend, &level, &q);
+	}
+	if (!hasts && level == PK_NOLEVEL)
+		return;
+
+	gts.push_back(hasts ? (long long)(ts * 1e6 + 0.5) : -1);
+	hts.push_back(lhost);
+	levels.push_back((unsigned char)level);
+	offs.push_back(lstart);
+	lens.push_back(end - lstart);
+	nlines++;
+	if (gts.size() == PK_BLOCKRECS)
+		block(out);
+}
+
+// Append n values less base, each in the fewest bytes that hold the
+// largest; returns that width.
+inline unsigned char
+pk_encode(std::string &out, const unsigned long long *v, unsigned n, unsigned long long base) {
+	unsigned long long bits = 0;
+	unsigned char w;
+
+	for (unsigned i = 0; i < n; i++)
+		bits |= v[i] - base;
+	w = bits <= 0xff ? 1 : bits <= 0xffff ? 2 : bits <= 0xffffffff ? 4 : 8;
+	for (unsigned i = 0; i < n; i++) {
+		unsigned long long d = v[i] - base;
+
+		for (unsigned j = 0; j < w; j++)
+			out += (char)(d >> (8 * j));
+	}
+	return w;
+}
+
+inline void
+pkindex::block(std::string &out) {
+	pkblock b;
+	unsigned count = (unsigned)gts.size();
+	std::vector<unsigned long long> g(count), lv(levels.begin(), levels.end());
+	size_t at = out.size();
+
+	memset(&b, 0, sizeof(b));
+	memcpy(b.magic, PK_MAGIC, sizeof(b.magic));
+	b.count = count;
+	b.gtsmin = b.gtsmax = -1;
+	b.htsmin = b.htsmax = hts[0];
+	b.offbase = offs[0];
+	for (unsigned i = 0; i < count; i++) {
+		b.levels |= 1u << levels[i];
+		if (gts[i] >= 0) {
+			if (b.gtsmin < 0 || gts[i] < b.gtsmin)
+				b.gtsmin = gts[i];
+			if (gts[i] > b.gtsmax)
+				b.gtsmax = gts[i];
+		}
+		if (hts[i] < b.htsmin)
+			b.htsmin = hts[i];
+		if (hts[i] > b.htsmax)
+			b.htsmax = hts[i];
+	}
+	for (unsigned i = 0; i < count; i++)
+		g[i] = gts[i] < 0 ? 0 : gts[i] - b.gtsmin + 1;
+
+	out.append(sizeof(b), 0);
+	b.width[PK_GTS] = pk_encode(out, g.data(), count, 0);
+	b.width[PK_HTS] = pk_encode(out, hts.data(), count, b.htsmin);
+	b.width[PK_LEVEL] = pk_encode(out, lv.data(), count, 0);
+	b.width[PK_OFF] = pk_encode(out, offs.data(), count, b.offbase);
+	b.width[PK_LEN] = pk_encode(out, lens.data(), count, 0);
+	memcpy(&out[at], &b, sizeof(b));
+	gts.clear();
+	hts.clear();
+	levels.clear();
+	offs.clear();
+	lens.clear();
+}
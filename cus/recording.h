@@ -0,0 +1,191 @@
+// recording.h : the session recording format (-r) and its decoder (-p).
+//
+// A recording is a header, a stream of records and, if the session
+// ended cleanly, an index for seeking:
+//
+//	header	"CUSREC01", u64 start time (us since the Unix epoch)
+//	record	varint delta (us since the previous record),
+//		varint (length << 1 | direction), data
+//	index	{ u64 clock (us), u64 offset } ...
+//	trailer	u64 index offset, u64 index entries, "CUSIDX01"
+//
+// Each index entry gives the clock *before* the record at its offset,
+// so a reader can start decoding there. An entry is written at most
+// every REC_INDEX_US. All integers are little-endian. A recording
+// without a trailer (cus was killed) still plays; it just can't seek
+// without reading from the start.
+
+#pragma once
+
+#include "compat.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define REC_MAGIC	"CUSREC01"
+#define REC_IDXMAGIC	"CUSIDX01"
+#define REC_HDRLEN	16
+#define REC_TRAILERLEN	24
+#define REC_INDEX_US	1000000ULL
+#define REC_MAXRECORD	(1024 * 1024)
+
+#define REC_DIR_OUT	0	// guest to console (pipe_input_helper)
+#define REC_DIR_IN	1	// keyboard to guest (handle_stdin)
+
+struct recindex {
+	unsigned long long clock;
+	unsigned long long offset;
+};
+
+static inline void
+rec_put64(std::string &out, unsigned long long v) {
+	for (int i = 0; i < 8; i++)
+		out.push_back((char)(v >> (8 * i)));
+}
+
+static inline unsigned long long
+rec_get64(const unsigned char *p) {
+	unsigned long long v = 0;
+
+	for (int i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static inline void
+rec_putvarint(std::string &out, unsigned long long v) {
+	while (v >= 0x80) {
+		out.push_back((char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((char)v);
+}
+
+// Returns bytes used, 0 if p runs out first, -1 if malformed.
+static inline int
+rec_getvarint(const unsigned char *p, size_t n, unsigned long long *v) {
+	unsigned long long r = 0;
+
+	for (int i = 0; i < 10; i++) {
+		if ((size_t)i >= n)
+			return 0;
+		r |= (unsigned long long)(p[i] & 0x7f) << (7 * i);
+		if ((p[i] & 0x80) == 0) {
+			*v = r;
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+class recwriter {
+private:
+	unsigned long long clock;	// us since start, as of the last record
+	unsigned long long offset;	// bytes written so far
+	unsigned long long lastindex;
+	std::vector<recindex> index;
+public:
+	recwriter() : clock(0), offset(0), lastindex(0) {}
+	void start(unsigned long long wallclock, std::string &out);
+	void record(unsigned long long now, int dir, const __int8 *p, DWORD n, std::string &out);
+	void finish(std::string &out);
+};
+
+inline void
+recwriter::start(unsigned long long wallclock, std::string &out) {
+	size_t before = out.size();
+
+	out.append(REC_MAGIC, 8);
+	rec_put64(out, wallclock);
+	offset += out.size() - before;
+}
+
+// now is us since start; it must not go backwards.
+inline void
+recwriter::record(unsigned long long now, int dir, const __int8 *p, DWORD n, std::string &out) {
+	size_t before = out.size();
+
+	if (now < clock)
+		now = clock;
+	if (index.empty() || now - lastindex >= REC_INDEX_US) {
+		recindex e = { clock, offset };
+
+		index.push_back(e);
+		lastindex = now;
+	}
+	rec_putvarint(out, now - clock);
+	rec_putvarint(out, ((unsigned long long)n << 1) | (dir & 1));
+	out.append((const char *)p, n);
+	clock = now;
+	offset += out.size() - before;
+}
+
+inline void
+recwriter::finish(std::string &out) {
+	unsigned long long idxoff = offset;
+
+	for (auto &e : index) {
+		rec_put64(out, e.clock);
+		rec_put64(out, e.offset);
+	}
+	rec_put64(out, idxoff);
+	rec_put64(out, index.size());
+	out.append(REC_IDXMAGIC, 8);
+}
+
+struct recrecord {
+	unsigned long long delta;
+	int dir;
+	DWORD len;
+	const __int8 *data;
+};
+
+// Decode the record at p. Returns its length, 0 if more than n bytes
+// are needed, -1 if it's corrupt.
+static inline int
+rec_decode(const unsigned char *p, size_t n, recrecord *r) {
+	unsigned long long lendir;
+	int a, b;
+
+	if ((a = rec_getvarint(p, n, &r->delta)) <= 0)
+		return a;
+	if ((b = rec_getvarint(p + a, n - a, &lendir)) <= 0)
+		return b;
+	if ((lendir >> 1) > REC_MAXRECORD)
+		return -1;
+	r->dir = (int)(lendir & 1);
+	r->len = (DWORD)(lendir >> 1);
+	if (n - a - b < r->len)
+		return 0;
+	r->data = (const __int8 *)(p + a + b);
+	return a + b + (int)r->len;
+}
+
+// Check the trailer (the last REC_TRAILERLEN bytes of a file of the
+// given size); on success returns the index offset and entry count.
+static inline bool
+rec_trailer(const unsigned char *p, unsigned long long size,
+    unsigned long long *idxoff, unsigned long long *count) {
+	if (memcmp(p + 16, REC_IDXMAGIC, 8) != 0)
+		return false;
+	*idxoff = rec_get64(p);
+	*count = rec_get64(p + 8);
+	return *idxoff >= REC_HDRLEN && *idxoff <= size && *count <= (size - *idxoff) / 16 &&
+	    *idxoff + *count * 16 + REC_TRAILERLEN == size;
+}
+
+// Binary search: the last entry whose clock is at or before t.
+static inline unsigned long long
+rec_seek(const unsigned char *index, unsigned long long count, unsigned long long t) {
+	unsigned long long lo = 0, hi = count;
+
+	while (hi - lo > 1) {
+		unsigned long long mid = lo + (hi - lo) / 2;
+
+		if (rec_get64(index + mid * 16) <= t)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
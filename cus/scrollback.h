@@ -0,0 +1,245 @@
+// scrollback.h : in-memory scrollback of guest output (-b) for ~/.
+//
+// Output is kept in SB_CHUNK-sized chunks, allocated as they are first
+// needed, so -b 256 costs nothing until 256 MB has actually scrolled by.
+// Offsets are absolute byte counts since the session started;
+// everything from begin() to end() is retained. Each chunk has an
+// index of the lines that start in it, as 16-bit offsets, kept up to
+// date as data arrives, so searches go line by line, newest first,
+// without rescanning for newlines. The index counts against the cap
+// along with the chunks, so a flood of empty lines keeps less output
+// rather than more memory; the oldest chunk goes, with its index, and
+// its buffer is used for the next.
+
+#pragma once
+
+#include "compat.h"
+#include "simd.h"
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define SB_CHUNK (64 * 1024)
+
+struct sbchunk {
+	std::unique_ptr<char[]> data;
+	std::vector<unsigned short> lines;	// line starts in it, ascending
+};
+
+class scrollback {
+private:
+	std::deque<sbchunk> chunks;	// from begin() to the one end() is in
+	unsigned long long first;	// number of chunks[0]
+	unsigned long long cap;
+	unsigned long long used;	// by the chunks and their indexes
+	unsigned long long tail;	// total bytes appended
+	std::string scratch;
+
+	sbchunk &at(unsigned long long off) { return chunks[(size_t)(off / SB_CHUNK - first)]; }
+	char *chunk(unsigned long long off) { return at(off).data.get(); }
+	std::unique_ptr<char[]> drop(void);
+	const char *span(unsigned long long off, size_t n);
+	unsigned long long lineat(unsigned long long off);
+	unsigned long long nextline(unsigned long long start);
+	bool match(unsigned long long s, const std::string &pat);
+public:
+	scrollback(size_t mbytes);
+	void append(const __int8 *p, size_t n);
+	unsigned long long begin() { return first * SB_CHUNK; }
+	unsigned long long end() { return tail; }
+	unsigned long long memory() { return used; }
+	void copy(unsigned long long off, size_t n, std::string &out);
+	void line(unsigned long long start, std::string &out);
+	size_t linesafter(unsigned long long start);
+	bool findprev(const std::string &pat, unsigned long long before, unsigned long long *start);
+	bool findnext(const std::string &pat, unsigned long long after, unsigned long long *start);
+};
+
+inline
+scrollback::scrollback(size_t mbytes) : first(0), tail(0) {
+	size_t n = (mbytes * 1024 * 1024 + SB_CHUNK - 1) / SB_CHUNK;
+
+	cap = (unsigned long long)(n < 2 ? 2 : n) * SB_CHUNK;
+	chunks.emplace_back();
+	chunks.back().lines.push_back(0);
+	used = chunks.back().lines.capacity() * sizeof(unsigned short);
+}
+
+// Forget the oldest chunk; its buffer is returned for reuse.
+inline std::unique_ptr<char[]>
+scrollback::drop(void) {
+	sbchunk &c = chunks.front();
+	std::unique_ptr<char[]> data(std::move(c.data));
+
+	used -= c.lines.capacity() * sizeof(unsigned short) + (data ? SB_CHUNK : 0);
+	chunks.pop_front();
+	first++;
+	return data;
+}
+
+inline void
+scrollback::append(const __int8 *p, size_t n) {
+	const char *cp = (const char *)p;
+
+	for (size_t done = 0; done < n;) {
+		sbchunk &c = chunks.back();
+		size_t pos = (size_t)(tail % SB_CHUNK);
+		size_t len = std::min(n - done, (size_t)SB_CHUNK - pos);
+		size_t had = c.lines.capacity();
+		const char *nl;
+		char *dst;
+
+		if (!c.data) {
+			std::unique_ptr<char[]> spare;
+
+			while (used + SB_CHUNK > cap && chunks.size() > 1)
+				spare = drop();
+			c.data = spare ? std::move(spare) : std::unique_ptr<char[]>(new char[SB_CHUNK]);
+			used += SB_CHUNK;
+		}
+		dst = c.data.get() + pos;
+		memcpy(dst, cp + done, len);
+		for (const char *q = dst; (nl = (const char *)memchr(q, '\n', dst + len - q)) != NULL; q = nl + 1) {
+			if (nl + 1 - c.data.get() < SB_CHUNK)
+				c.lines.push_back((unsigned short)(nl + 1 - c.data.get()));
+		}
+		used += (c.lines.capacity() - had) * sizeof(unsigned short);
+		tail += len;
+		done += len;
+		if (tail % SB_CHUNK == 0) {
+			chunks.emplace_back();
+			if (dst[len - 1] == '\n') {
+				chunks.back().lines.push_back(0);
+				used += chunks.back().lines.capacity() * sizeof(unsigned short);
+			}
+		}
+	}
+
+	while (used > cap && chunks.size() > 1)
+		drop();
+}
+
+// n bytes at off, contiguous; copied only if they cross a chunk.
+inline const char *
+scrollback::span(unsigned long long off, size_t n) {
+	size_t pos = (size_t)(off % SB_CHUNK);
+
+	if (pos + n <= SB_CHUNK)
+		return chunk(off) + pos;
+	scratch.clear();
+	copy(off, n, scratch);
+	return scratch.data();
+}
+
+inline void
+scrollback::copy(unsigned long long off, size_t n, std::string &out) {
+	if (off < begin())
+		off = begin();
+	if (off + n > tail)
+		n = (size_t)(tail - off);
+	while (n > 0) {
+		size_t pos = (size_t)(off % SB_CHUNK);
+		size_t len = std::min(n, (size_t)SB_CHUNK - pos);
+
+		out.append(chunk(off) + pos, len);
+		off += len;
+		n -= len;
+	}
+}
+
+// Start of the line containing off, or begin() if that's gone.
+inline unsigned long long
+scrollback::lineat(unsigned long long off) {
+	if (off < begin())
+		return begin();
+	for (size_t ci = (size_t)(off / SB_CHUNK - first) + 1; ci-- > 0;) {
+		const std::vector<unsigned short> &l = chunks[ci].lines;
+		unsigned long long base = (first + ci) * SB_CHUNK;
+		auto it = l.end();
+
+		if (off < base + SB_CHUNK)
+			it = std::upper_bound(l.begin(), l.end(), (unsigned short)(off - base));
+		if (it != l.begin())
+			return base + it[-1];
+	}
+	return begin();
+}
+
+// Start of the first line after start, or end() if there isn't one.
+inline unsigned long long
+scrollback::nextline(unsigned long long start) {
+	for (size_t ci = start < begin() ? 0 : (size_t)(start / SB_CHUNK - first); ci < chunks.size(); ci++) {
+		const std::vector<unsigned short> &l = chunks[ci].lines;
+		unsigned long long base = (first + ci) * SB_CHUNK;
+		auto it = l.begin();
+
+		if (start >= base)
+			it = std::upper_bound(l.begin(), l.end(), (unsigned short)(start - base));
+		if (it != l.end())
+			return base + *it;
+	}
+	return tail;
+}
+
+inline bool
+scrollback::match(unsigned long long s, const std::string &pat) {
+	unsigned long long e = nextline(s);
+
+	if (e - s < pat.size())
+		return false;
+	return simd_memmem(span(s, (size_t)(e - s)), (size_t)(e - s), pat.data(), pat.size()) != (size_t)-1;
+}
+
+// The bytes of the line starting at start, without its line ending.
+inline void
+scrollback::line(unsigned long long start, std::string &out) {
+	unsigned long long s = lineat(start);
+	unsigned long long e = nextline(s);
+
+	out.clear();
+	copy(s, (size_t)(e - s), out);
+	while (!out.empty() && (out.back() == '\n' || out.back() == '\r'))
+		out.pop_back();
+}
+
+// How many lines follow the one starting at start.
+inline size_t
+scrollback::linesafter(unsigned long long start) {
+	unsigned long long s = lineat(start);
+	size_t ci = (size_t)(s / SB_CHUNK - first);
+	const std::vector<unsigned short> &l = chunks[ci].lines;
+	size_t n = l.end() - std::upper_bound(l.begin(), l.end(), (unsigned short)(s % SB_CHUNK));
+
+	while (++ci < chunks.size())
+		n += chunks[ci].lines.size();
+	return n;
+}
+
+// Newest line starting before before that contains pat.
+inline bool
+scrollback::findprev(const std::string &pat, unsigned long long before, unsigned long long *start) {
+	if (before <= begin())
+		return false;
+	for (unsigned long long s = lineat(before - 1);; s = lineat(s - 1)) {
+		if (match(s, pat)) {
+			*start = s;
+			return true;
+		}
+		if (s == begin())
+			return false;
+	}
+}
+
+// Oldest line starting after after that contains pat.
+inline bool
+scrollback::findnext(const std::string &pat, unsigned long long after, unsigned long long *start) {
+	for (unsigned long long s = nextline(after); s < tail; s = nextline(s)) {
+		if (match(s, pat)) {
+			*start = s;
+			return true;
+		}
+	}
+	return false;
+}
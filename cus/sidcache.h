@@ -0,0 +1,206 @@
+// sidcache.h : SID->name caching and pipe ACL reporting for -i.
+//
+// Looking up an account is slow (a domain SID can take hundreds of ms)
+// and a pipe scan sees the same handful of SIDs over and over, so names
+// are resolved once and cached. The actual lookup sits behind
+// sidresolver; on Windows that's LookupAccountSid, elsewhere it can be
+// anything that maps SID bytes to names. The cache is safe to share
+// between threads: concurrent lookups of one SID resolve it once.
+
+#pragma once
+
+#include "compat.h"
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <wchar.h>
+#include <wctype.h>
+
+struct sidname {
+	bool ok;
+	DWORD error;		// why the lookup failed
+	std::wstring name;	// domain\account, or the SID string on failure
+};
+
+class sidresolver {
+public:
+	virtual ~sidresolver() {}
+	// sid is the binary SID.
+	virtual sidname resolve(const std::string &sid) = 0;
+};
+
+class sidcache {
+private:
+	sidresolver *resolver;
+	std::mutex lock;
+	std::map<std::string, std::shared_future<sidname> > names;
+	unsigned long nhits, nmisses;
+public:
+	sidcache(sidresolver *r) : resolver(r), nhits(0), nmisses(0) {}
+	sidname lookup(const std::string &sid);
+	unsigned long hits() { return nhits; }
+	unsigned long misses() { return nmisses; }
+};
+
+inline sidname
+sidcache::lookup(const std::string &sid) {
+	std::promise<sidname> mine;
+	std::shared_future<sidname> f;
+	bool resolve = false;
+
+	{
+		std::lock_guard<std::mutex> g(lock);
+		auto it = names.find(sid);
+
+		if (it != names.end()) {
+			nhits++;
+			f = it->second;
+		} else {
+			nmisses++;
+			f = mine.get_future().share();
+			names[sid] = f;
+			resolve = true;
+		}
+	}
+	if (resolve)
+		mine.set_value(resolver->resolve(sid));
+	return f.get();
+}
+
+// Access mask bits as shown by -i, in display order.
+static const struct maskbit {
+	const wchar_t *name;
+	DWORD bit;
+} maskbits[] = {
+	{ L"read", 0x00000001 },		// FILE_READ_DATA
+	{ L"write", 0x00000002 },		// FILE_WRITE_DATA
+	{ L"createpipe", 0x00000004 },		// FILE_CREATE_PIPE_INSTANCE
+	{ L"readea", 0x00000008 },		// FILE_READ_EA
+	{ L"writeea", 0x00000010 },		// FILE_WRITE_EA
+	{ L"execute", 0x00000020 },		// FILE_EXECUTE
+	{ L"delete-child", 0x00000040 },	// FILE_DELETE_CHILD
+	{ L"readattr", 0x00000080 },		// FILE_READ_ATTRIBUTES
+	{ L"writeattr", 0x00000100 },		// FILE_WRITE_ATTRIBUTES
+	{ L"delete", 0x00010000 },		// DELETE
+	{ L"readcontrol", 0x00020000 },		// READ_CONTROL
+	{ L"writedac", 0x00040000 },		// WRITE_DAC
+	{ L"writeowner", 0x00080000 },		// WRITE_OWNER
+	{ L"sync", 0x00100000 }			// SYNCHRONIZE
+};
+
+#define ACE_TYPE_ALLOWED 0	// ACCESS_ALLOWED_ACE_TYPE
+#define ACE_TYPE_DENIED 1	// ACCESS_DENIED_ACE_TYPE
+
+struct aceinfo {
+	unsigned type;
+	unsigned flags;
+	DWORD mask;
+	std::string sid;	// empty for types we don't decode
+};
+
+// What -i knows about one pipe, before any names are resolved.
+struct pipeacl {
+	std::wstring pipe;
+	DWORD error;		// nonzero if the pipe couldn't be examined
+	std::string owner;
+	std::string group;
+	bool hasdacl;
+	unsigned revision;
+	std::vector<aceinfo> dacl;
+};
+
+// Case-insensitive match with * and ?, as for pipe names.
+static inline bool
+globmatch(const wchar_t *pat, const wchar_t *s) {
+	const wchar_t *star = NULL, *resume = NULL;
+
+	while (*s != 0) {
+		if (*pat == L'*') {
+			star = pat++;
+			resume = s;
+		} else if (*pat == L'?' || (*pat != 0 && towlower(*pat) == towlower(*s))) {
+			pat++;
+			s++;
+		} else if (star != NULL) {
+			pat = star + 1;
+			s = ++resume;
+		} else
+			return false;
+	}
+	while (*pat == L'*')
+		pat++;
+	return *pat == 0;
+}
+
+static inline void
+json_string(std::wstring &out, const std::wstring &s) {
+	wchar_t hex[8];
+
+	out.push_back(L'"');
+	for (wchar_t c : s) {
+		if (c == L'"' || c == L'\\') {
+			out.push_back(L'\\');
+			out.push_back(c);
+		} else if (c < 0x20) {
+			swprintf(hex, sizeof(hex) / sizeof(hex[0]), L"\\u%04x", (unsigned)c);
+			out.append(hex);
+		} else
+			out.push_back(c);
+	}
+	out.push_back(L'"');
+}
+
+// One JSON object (one line) describing a pipe.
+static inline std::wstring
+pipeacl_json(const pipeacl &acl, sidcache &cache) {
+	std::wstring out;
+	wchar_t num[32];
+
+	out.append(L"{\"pipe\":");
+	json_string(out, acl.pipe);
+	if (acl.error != 0) {
+		swprintf(num, sizeof(num) / sizeof(num[0]), L",\"error\":%u}", acl.error);
+		out.append(num);
+		return out;
+	}
+	out.append(L",\"owner\":");
+	json_string(out, cache.lookup(acl.owner).name);
+	out.append(L",\"group\":");
+	json_string(out, cache.lookup(acl.group).name);
+	if (!acl.hasdacl) {
+		out.append(L",\"dacl\":null}");
+		return out;
+	}
+	swprintf(num, sizeof(num) / sizeof(num[0]), L",\"revision\":%u,\"dacl\":[", acl.revision);
+	out.append(num);
+	for (size_t i = 0; i < acl.dacl.size(); i++) {
+		const aceinfo &ace = acl.dacl[i];
+		const wchar_t *sep = L"";
+
+		if (i != 0)
+			out.push_back(L',');
+		swprintf(num, sizeof(num) / sizeof(num[0]), L"{\"type\":%u,\"flags\":%u", ace.type, ace.flags);
+		out.append(num);
+		if (ace.type != ACE_TYPE_ALLOWED && ace.type != ACE_TYPE_DENIED) {
+			out.push_back(L'}');
+			continue;
+		}
+		out.append(ace.type == ACE_TYPE_ALLOWED ? L",\"access\":\"allowed\"" : L",\"access\":\"denied\"");
+		swprintf(num, sizeof(num) / sizeof(num[0]), L",\"mask\":%u,\"rights\":[", ace.mask);
+		out.append(num);
+		for (auto &mb : maskbits) {
+			if (ace.mask & mb.bit) {
+				out.append(sep);
+				json_string(out, mb.name);
+				sep = L",";
+			}
+		}
+		out.append(L"],\"sid\":");
+		json_string(out, cache.lookup(ace.sid).name);
+		out.push_back(L'}');
+	}
+	out.append(L"]}");
+	return out;
+}
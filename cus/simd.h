@@ -0,0 +1,71 @@
+// simd.h : the little bit of SIMD plumbing the byte scanners share.
+//
+// CUS_SSE2 is defined when SSE2 intrinsics can be used (every x64
+// build, and x86 builds with /arch:SSE2 or better). Everything that
+// uses it has a scalar fallback.
+
+#pragma once
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CUS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Index of the lowest set bit; x must not be zero.
+static inline unsigned
+ctz32(unsigned x) {
+#ifdef _MSC_VER
+	unsigned long i;
+
+	_BitScanForward(&i, x);
+	return (unsigned)i;
+#else
+	return (unsigned)__builtin_ctz(x);
+#endif
+}
+
+#include <string.h>
+
+// Find needle in hay; returns its offset or (size_t)-1. With SSE2, the
+// first and last needle bytes are matched 16 positions at a time and
+// only those candidates are compared in full.
+static inline size_t
+simd_memmem(const char *hay, size_t n, const char *needle, size_t m) {
+	size_t i = 0;
+
+	if (m == 0)
+		return 0;
+	if (m > n)
+		return (size_t)-1;
+	if (m == 1) {
+		const char *p = (const char *)memchr(hay, needle[0], n);
+		return p == NULL ? (size_t)-1 : (size_t)(p - hay);
+	}
+#ifdef CUS_SSE2
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[m - 1]);
+
+	for (; i + m - 1 + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+		unsigned bits = (unsigned)_mm_movemask_epi8(
+		    _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+		while (bits != 0) {
+			unsigned j = ctz32(bits);
+
+			if (memcmp(hay + i + j + 1, needle + 1, m - 2) == 0)
+				return i + j;
+			bits &= bits - 1;
+		}
+	}
+#endif
+	for (; i + m <= n; i++)
+		if (hay[i] == needle[0] && memcmp(hay + i + 1, needle + 1, m - 1) == 0)
+			return i;
+	return (size_t)-1;
+}
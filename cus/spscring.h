@@ -0,0 +1,93 @@
+// spscring.h : single-producer/single-consumer lock-free byte ring.
+//
+// The producer (the event loop) copies bytes in with put(), the
+// consumer (the log writer thread) drains them with peek()/consume().
+// Neither side ever blocks; when the ring is full put() keeps what
+// fits and counts the rest as lost.
+
+#pragma once
+
+#include "compat.h"
+#include <atomic>
+#include <string.h>
+
+class spscring {
+private:
+	__int8 *buf;
+	DWORD mask;
+	// head and tail on their own cache lines so the two threads don't
+	// bounce a shared line on every chunk.
+	char pad0[64];
+	std::atomic<unsigned long long> head;	// consumer
+	char pad1[64];
+	std::atomic<unsigned long long> tail;	// producer
+	char pad2[64];
+	std::atomic<unsigned long long> nlost;
+	std::atomic<unsigned long long> noverflow;
+public:
+	spscring(DWORD size);
+	~spscring();
+	DWORD put(const __int8 *p, DWORD n, bool *wasempty);
+	DWORD peek(const __int8 **p);
+	void consume(DWORD n);
+	DWORD capacity() { return mask + 1; }
+	unsigned long long pending() { return tail.load() - head.load(); }
+	unsigned long long lost() { return nlost.load(); }
+	unsigned long long overflows() { return noverflow.load(); }
+};
+
+// size is rounded up to a power of two.
+inline
+spscring::spscring(DWORD size) : head(0), tail(0), nlost(0), noverflow(0) {
+	DWORD n = 1;
+
+	while (n < size)
+		n <<= 1;
+	buf = new __int8[n];
+	mask = n - 1;
+}
+
+inline
+spscring::~spscring() {
+	delete[] buf;
+}
+
+// Producer side. Returns the number of bytes stored; *wasempty is set if
+// the consumer had caught up, i.e. it may be asleep and needs a wakeup.
+inline DWORD
+spscring::put(const __int8 *p, DWORD n, bool *wasempty) {
+	unsigned long long t = tail.load(std::memory_order_relaxed);
+	unsigned long long h = head.load(std::memory_order_acquire);
+	DWORD room = (DWORD)(mask + 1 - (t - h));
+
+	*wasempty = (t == h);
+	if (n > room) {
+		nlost.fetch_add(n - room, std::memory_order_relaxed);
+		noverflow.fetch_add(1, std::memory_order_relaxed);
+		n = room;
+	}
+
+	DWORD off = (DWORD)(t & mask);
+	DWORD first = n < mask + 1 - off ? n : mask + 1 - off;
+	memcpy(buf + off, p, first);
+	memcpy(buf, p + first, n - first);
+	tail.store(t + n, std::memory_order_release);
+	return n;
+}
+
+// Consumer side: the contiguous readable bytes up to the wrap point.
+inline DWORD
+spscring::peek(const __int8 **p) {
+	unsigned long long h = head.load(std::memory_order_relaxed);
+	unsigned long long t = tail.load(std::memory_order_acquire);
+	DWORD off = (DWORD)(h & mask);
+	unsigned long long avail = t - h;
+
+	*p = buf + off;
+	return (DWORD)(avail < mask + 1 - off ? avail : mask + 1 - off);
+}
+
+inline void
+spscring::consume(DWORD n) {
+	head.store(head.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
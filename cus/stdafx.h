@@ -7,8 +7,11 @@
 
 #include "targetver.h"
 
+#include <WinSock2.h>	// before Windows.h, which brings in winsock.h
+#include <WS2tcpip.h>
 #include <Windows.h>
 #include <stdio.h>
 #include <tchar.h>
 #include <AclAPI.h>
+#include <sddl.h>
 #include "getopt.h"
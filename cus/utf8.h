@@ -0,0 +1,194 @@
+// utf8.h : UTF-8 validation and UTF-8 <-> UTF-16 conversion for the
+// console paths.
+//
+// The guest talks UTF-8 over the pipe, the Windows console wants
+// UTF-16. utf8decoder validates and transcodes pipe output; sequences
+// split between reads are carried over to the next call, and invalid
+// input becomes U+FFFD (one per maximal invalid subpart). ASCII is
+// checked and widened 16 bytes at a time.
+
+#pragma once
+
+#include "compat.h"
+#include "simd.h"
+#include <string>
+
+#define UTF8_REPLACEMENT 0xfffd
+
+// Encode a code point; returns the number of bytes written (1-4).
+static inline int
+utf8_encode(unsigned cp, char *out) {
+	if (cp < 0x80) {
+		out[0] = (char)cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = (char)(0xc0 | (cp >> 6));
+		out[1] = (char)(0x80 | (cp & 0x3f));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = (char)(0xe0 | (cp >> 12));
+		out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		out[2] = (char)(0x80 | (cp & 0x3f));
+		return 3;
+	}
+	out[0] = (char)(0xf0 | (cp >> 18));
+	out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+	out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+	out[3] = (char)(0x80 | (cp & 0x3f));
+	return 4;
+}
+
+// Decode one sequence at p. Returns its length, 0 if p holds a valid
+// but incomplete prefix, or -k if the first k bytes are invalid.
+static inline int
+utf8_decode_one(const unsigned char *p, size_t n, unsigned *cp) {
+	unsigned c = p[0], v;
+	int len;
+
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	}
+	if (c < 0xc2)
+		return -1;
+	if (c < 0xe0) {
+		len = 2;
+		v = c & 0x1f;
+	} else if (c < 0xf0) {
+		len = 3;
+		v = c & 0x0f;
+	} else if (c < 0xf5) {
+		len = 4;
+		v = c & 0x07;
+	} else
+		return -1;
+
+	for (int i = 1; i < len; i++) {
+		unsigned lo = 0x80, hi = 0xbf, b;
+
+		if ((size_t)i >= n)
+			return 0;
+		// no overlongs, surrogates or code points past U+10FFFF
+		if (i == 1) {
+			if (c == 0xe0)
+				lo = 0xa0;
+			else if (c == 0xed)
+				hi = 0x9f;
+			else if (c == 0xf0)
+				lo = 0x90;
+			else if (c == 0xf4)
+				hi = 0x8f;
+		}
+		b = p[i];
+		if (b < lo || b > hi)
+			return -i;
+		v = (v << 6) | (b & 0x3f);
+	}
+	*cp = v;
+	return len;
+}
+
+// True if p[0..n) is all ASCII.
+static inline bool
+utf8_ascii(const __int8 *p, size_t n) {
+	size_t i = 0;
+
+#ifdef CUS_SSE2
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 16 <= n; i += 16)
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+	if (_mm_movemask_epi8(acc) != 0)
+		return false;
+#endif
+	for (; i < n; i++)
+		if (p[i] < 0)
+			return false;
+	return true;
+}
+
+static inline void
+utf16_put(unsigned cp, std::u16string &out) {
+	if (cp < 0x10000)
+		out.push_back((char16_t)cp);
+	else {
+		cp -= 0x10000;
+		out.push_back((char16_t)(0xd800 | (cp >> 10)));
+		out.push_back((char16_t)(0xdc00 | (cp & 0x3ff)));
+	}
+}
+
+class utf8decoder {
+private:
+	unsigned char pend[4];	// incomplete sequence from the last call
+	DWORD npend;
+public:
+	utf8decoder() : npend(0) {}
+	// Nothing carried over and p is ASCII: the bytes can go out as is.
+	bool passthrough(const __int8 *p, DWORD n) { return npend == 0 && utf8_ascii(p, n); }
+	void decode(const __int8 *p, DWORD n, std::u16string &out);
+};
+
+inline void
+utf8decoder::decode(const __int8 *p, DWORD n, std::u16string &out) {
+	const unsigned char *up = (const unsigned char *)p;
+	DWORD i = 0;
+	unsigned cp;
+
+	// Finish the sequence the last read split. pend is always a valid
+	// prefix, so if the next byte doesn't fit, pend is one invalid
+	// subpart and that byte starts over.
+	while (npend != 0 && i < n) {
+		int r;
+
+		pend[npend++] = up[i++];
+		r = utf8_decode_one(pend, npend, &cp);
+		if (r > 0) {
+			utf16_put(cp, out);
+			npend = 0;
+		} else if (r < 0) {
+			out.push_back(UTF8_REPLACEMENT);
+			npend = 0;
+			i--;
+		}
+	}
+
+	while (i < n) {
+		int r;
+
+#ifdef CUS_SSE2
+		if (i + 16 <= n) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(up + i));
+
+			if (_mm_movemask_epi8(v) == 0) {
+				char16_t wide[16];
+				__m128i z = _mm_setzero_si128();
+
+				_mm_storeu_si128((__m128i *)wide, _mm_unpacklo_epi8(v, z));
+				_mm_storeu_si128((__m128i *)(wide + 8), _mm_unpackhi_epi8(v, z));
+				out.append(wide, 16);
+				i += 16;
+				continue;
+			}
+		}
+#endif
+		if (up[i] < 0x80) {
+			out.push_back(up[i++]);
+			continue;
+		}
+		r = utf8_decode_one(up + i, n - i, &cp);
+		if (r > 0) {
+			utf16_put(cp, out);
+			i += r;
+		} else if (r == 0) {
+			// split sequence; keep it for the next read
+			while (i < n)
+				pend[npend++] = up[i++];
+		} else {
+			out.push_back(UTF8_REPLACEMENT);
+			i += -r;
+		}
+	}
+}
@@ -0,0 +1,286 @@
+// coro.cpp : the coroutine engine for the Linux front end.
+//
+// The session is four straight-line tasks (coro.h): guest output to the
+// terminal queue and the log, keys to the port queue, and one drain per
+// queue writing it out. A full queue makes its producer wait on the
+// queue's room event, or with :drop lose the excess. Everything a task
+// keeps across a wait lives in its frame, and the queues' bytes in
+// rings, all in the session's arena, so the data path doesn't allocate.
+
+#include "cus.h"
+#include "coro.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+
+#define SESSION_ARENA (64 * 1024)	// for the frames
+#define QUEUE_SLACK (2 * READ_BUFSIZE)	// ring room past the -q limit
+
+// A queue's bytes, in a ring. A producer stops at the -q limit, with
+// the read or keys in hand still to put, so the ring has QUEUE_SLACK
+// more room than that.
+struct byteq {
+	char *buf;
+	size_t cap, max, head, len, hiwater;
+	unsigned long long ndropped;
+
+	void init(arena &a, size_t limit) {
+		max = limit;
+		cap = limit + QUEUE_SLACK;
+		buf = (char *)a.alloc(cap);
+		head = len = hiwater = 0;
+		ndropped = 0;
+	}
+	size_t size() { return len; }
+	size_t limit() { return max; }
+	size_t peak() { return hiwater; }
+	bool empty() { return len == 0; }
+	bool full() { return len >= max; }
+	bool blocked(bool stopped) { return stopped ? len > max / 2 : len >= max; }
+	void dropped(size_t n) { ndropped += n; }
+	unsigned long long dropped() { return ndropped; }
+
+	// Whatever doesn't fit is dropped.
+	void push(const char *p, size_t n) {
+		if (n > cap - len) {
+			dropped(n - (cap - len));
+			n = cap - len;
+		}
+		size_t at = (head + len) % cap, k = n < cap - at ? n : cap - at;
+
+		memcpy(buf + at, p, k);
+		memcpy(buf, p + k, n - k);
+		len += n;
+		if (len > hiwater)
+			hiwater = len;
+	}
+	// The bytes at the front, in one or two pieces.
+	int front(struct iovec *iov) {
+		size_t k = len < cap - head ? len : cap - head;
+
+		iov[0].iov_base = buf + head;
+		iov[0].iov_len = k;
+		iov[1].iov_base = buf;
+		iov[1].iov_len = len - k;
+		return len > k ? 2 : 1;
+	}
+	void pop(size_t n) {
+		head = (head + n) % cap;
+		len -= n;
+	}
+};
+
+// Bytes for one output, and the events between its producer and drain.
+struct outq {
+	const char *name;
+	ioslot *slot;
+	byteq q;
+	event data, room;
+};
+
+struct session {
+	arena mem;
+	reactor &io;
+	ioslot port, in, out;
+	outq term, guest;		// to stdout, to the port
+	bool inputDone, over;
+	task tasks[4];
+
+	session(reactor &r) : mem(SESSION_ARENA + 2 * (queueLimit * ABUFFER_SIZE + QUEUE_SLACK)), io(r),
+		inputDone(false), over(false) {}
+};
+
+static session *current;		// for ~q, whose callback takes no argument
+
+static void
+fail(int error, const char *what) {
+	errno = error;
+	err(1, "%s", what);
+}
+
+static void
+outq_init(session &s, outq &w, const char *name, ioslot *slot) {
+	w.name = name;
+	w.slot = slot;
+	w.q.init(s.mem, queueLimit * ABUFFER_SIZE);
+	w.data = { &s.io, nullptr, false };
+	w.room = { &s.io, nullptr, false };
+}
+
+static void
+put(outq &w, const char *p, size_t n) {
+	if (queuePolicy == QUEUE_DROP && w.q.full()) {
+		w.q.dropped(n);
+		return;
+	}
+	w.q.push(p, n);
+	w.data.notify();
+}
+
+static void
+term_put(const char *p, size_t n) {
+	put(current->term, p, n);
+}
+
+static void
+queue_line(std::string &s, const char *name, byteq &q) {
+	char buf[128];
+
+	snprintf(buf, sizeof(buf), "\r\n  %-9s %7zu KB of %zu KB, peak %zu KB", name,
+		q.size() / 1024, q.limit() / 1024, q.peak() / 1024);
+	s += buf;
+	if (q.dropped() != 0) {
+		snprintf(buf, sizeof(buf), ", %llu bytes dropped", q.dropped());
+		s += buf;
+	}
+}
+
+// ~q
+static void
+coro_status(void) {
+	char buf[64];
+	std::string s = "\r\n[coroutines, ";
+
+	s += queuePolicy == QUEUE_DROP ? "drop when full]" : "block when full]";
+	queue_line(s, "terminal", current->term.q);
+	queue_line(s, "port", current->guest.q);
+	snprintf(buf, sizeof(buf), "\r\n  arena     %zu of %zu bytes\r\n", current->mem.used, current->mem.size);
+	s += buf;
+	ui_puts(s.c_str(), term_put);
+}
+
+static void
+log_write(const char *p, size_t n, bool last) {
+	if (logFd < 0)
+		return;
+	log_prepare(&p, &n, last);
+	if (n != 0)
+		write_all(logFd, p, n, "log");
+}
+
+// With :block, wait while w is full, until it is half empty.
+static bool
+full(outq &w, bool stopped) {
+	return queuePolicy == QUEUE_BLOCK && w.q.blocked(stopped);
+}
+
+static task
+guest_output(session &s) {
+	char buf[READ_BUFSIZE];
+	bool stopped = false;
+
+	for (;;) {
+		while ((stopped = full(s.term, stopped)))
+			co_await s.term.room;
+		ssize_t n = co_await read_some(s.port, buf, sizeof(buf));
+
+		if (n == 0 || n == -EIO)	// EIO: a pty with nothing on the other side
+			break;
+		if (n < 0)
+			fail((int)-n, portName);
+		ioPortBytes += n;
+		put(s.term, buf, n);
+		log_write(buf, n, false);
+	}
+	portClosed = true;
+	s.over = true;
+}
+
+static task
+keyboard(session &s) {
+	char buf[READ_BUFSIZE];
+	bool stopped = false;
+	std::string out;		// keeps its capacity from one read to the next
+
+	for (;;) {
+		out.clear();
+		while ((stopped = full(s.guest, stopped)))
+			co_await s.guest.room;
+		ssize_t n = co_await read_some(s.in, buf, sizeof(buf));
+
+		if (n == 0)
+			break;
+		if (n < 0)
+			fail((int)-n, "stdin");
+		if (!keys_in(buf, n, out, coro_status)) {
+			s.over = true;
+			co_return;
+		}
+		if (!out.empty())
+			put(s.guest, out.data(), out.size());
+		if (!s.in.pollable)
+			co_await s.io.yield();	// a file is always ready
+	}
+	s.inputDone = true;
+	s.guest.data.notify();
+}
+
+// Write out the front of w, a writev at a time.
+static task
+drain(session &s, outq &w) {
+	struct iovec iov[2];
+
+	for (;;) {
+		while (w.q.empty()) {
+			if (&w == &s.guest && s.inputDone) {
+				s.over = true;		// all the input has gone
+				co_return;
+			}
+			co_await w.data;
+		}
+		int n = w.q.front(iov);
+		ssize_t r = co_await write_some(*w.slot, iov, n);
+
+		if (r < 0)
+			fail((int)-r, w.name);
+		w.q.pop(r);
+		w.room.notify();
+	}
+}
+
+int
+run_coro(void) {
+	reactor io;
+	session s(io);
+
+	current = &s;
+	fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
+	fcntl(1, F_SETFL, fcntl(1, F_GETFL) | O_NONBLOCK);
+	fcntl(portFd, F_SETFL, fcntl(portFd, F_GETFL) | O_NONBLOCK);
+	io.add(s.port, portFd);
+	if (!s.port.pollable)
+		errx(1, "%s: not a socket or terminal", portName);
+	io.add(s.in, 0);
+	io.add(s.out, 1);
+	outq_init(s, s.term, "stdout", &s.out);
+	outq_init(s, s.guest, portName, &s.port);	// guest_output reads the same slot
+
+	s.tasks[0] = guest_output(s);
+	s.tasks[1] = keyboard(s);
+	s.tasks[2] = drain(s, s.term);
+	s.tasks[3] = drain(s, s.guest);
+	for (task &t : s.tasks)
+		io.post(t.h);
+	while (!s.over && stopSig == 0)
+		io.turn();
+	log_write(NULL, 0, true);
+
+	// What's still queued for the terminal goes out before we leave.
+	fcntl(1, F_SETFL, fcntl(1, F_GETFL) & ~O_NONBLOCK);
+	while (!s.term.q.empty()) {
+		struct iovec iov[2];
+		int n = s.term.q.front(iov);
+
+		for (int i = 0; i < n; i++)
+			write_all(1, (const char *)iov[i].iov_base, iov[i].iov_len, "stdout");
+		s.term.q.pop(s.term.q.size());
+	}
+	for (task &t : s.tasks)
+		t.h.destroy();
+	ioCalls += io.calls;
+	if (s.guest.q.dropped() != 0)
+		fprintf(stderr, "port: queue full, %llu bytes of input dropped\n", s.guest.q.dropped());
+	if (s.term.q.dropped() != 0)
+		fprintf(stderr, "terminal: queue full, %llu bytes dropped\n", s.term.q.dropped());
+	return portClosed ? 1 : 0;
+}
@@ -0,0 +1,216 @@
+// coro.h : a small C++20 coroutine runtime over epoll.
+//
+// A task is a coroutine that runs to its end; nothing waits for its
+// result. Its frame comes from the arena of its first parameter (a
+// session, or anything with an arena called mem), so starting a task
+// never touches the heap, and the frames go when the arena does. A task
+// suspends on a read or write (co_await read_some(...)) or on an event
+// another task notifies, and the reactor resumes it.
+//
+// The reads and writes work like overlapped I/O. The operation is tried
+// at once. If the descriptor isn't ready, the awaiter waits on its
+// ioslot, and the reactor finishes the operation when epoll says it can
+// go, then resumes the task with the result. Descriptors are registered
+// once, edge-triggered, so waiting costs no epoll_ctl. Any number of
+// sessions can share one reactor, and so one thread.
+
+#pragma once
+
+#include <coroutine>
+#include <deque>
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Bump allocation from one block. Nothing is freed on its own; a
+// session's tasks live as long as the session, and go with its arena.
+struct arena {
+	char *base;
+	size_t size, used;
+
+	explicit arena(size_t n) : base((char *)malloc(n)), size(n), used(0) {
+		if (base == NULL)
+			err(1, "arena");
+	}
+	~arena() { free(base); }
+	void *alloc(size_t n) {
+		n = (n + 15) & ~(size_t)15;
+		if (used + n > size)
+			errx(1, "coroutine arena full (%zu of %zu bytes)", used + n, size);
+		void *p = base + used;
+		used += n;
+		return p;
+	}
+};
+
+struct task {
+	struct promise_type {
+		template <class S, class... A>
+		static void *operator new(size_t n, S &owner, A &...) { return owner.mem.alloc(n); }
+		static void operator delete(void *, size_t) {}
+
+		task get_return_object() { return task{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+		std::suspend_always initial_suspend() noexcept { return {}; }	// the owner posts it
+		std::suspend_always final_suspend() noexcept { return {}; }	// the owner destroys it
+		void return_void() {}
+		void unhandled_exception() { abort(); }
+	};
+
+	std::coroutine_handle<promise_type> h;
+};
+
+struct reactor;
+struct io_op;
+
+// A descriptor and the operation (if any) waiting in each direction.
+// Regular files can't be watched; operations on them always complete
+// at once.
+struct ioslot {
+	reactor *r;
+	int fd;
+	bool pollable;
+	io_op *rd, *wr;
+};
+
+struct reactor {
+	int epfd;
+	std::deque<std::coroutine_handle<>> ready;
+	unsigned long long calls;	// system calls, for -v
+
+	reactor() : calls(0) {
+		if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			err(1, "epoll_create1");
+	}
+	~reactor() { close(epfd); }
+
+	void add(ioslot &s, int fd);
+	void post(std::coroutine_handle<> h) { ready.push_back(h); }
+	void turn(void);
+
+	// co_await io.yield(): let the other ready tasks run first.
+	struct yielder {
+		reactor *r;
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h) { r->post(h); }
+		void await_resume() {}
+	};
+	yielder yield(void) { return yielder{ this }; }
+};
+
+// One readv or writev. co_await gives its result: a byte count, or
+// -errno (never -EAGAIN).
+struct io_op {
+	ioslot *s;
+	const struct iovec *iov;
+	int iovcnt;
+	bool out;
+	struct iovec one;
+	ssize_t res;
+	std::coroutine_handle<> h;
+
+	bool attempt(void) {
+		const struct iovec *v = iov != NULL ? iov : &one;
+		ssize_t r = out ? writev(s->fd, v, iovcnt) : readv(s->fd, v, iovcnt);
+
+		s->r->calls++;
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			return false;
+		res = r < 0 ? -errno : r;
+		return true;
+	}
+	bool await_ready() { return attempt(); }
+	void await_suspend(std::coroutine_handle<> task) {
+		h = task;
+		if (out)
+			s->wr = this;
+		else
+			s->rd = this;
+	}
+	ssize_t await_resume() { return res; }
+};
+
+static inline io_op
+read_some(ioslot &s, void *p, size_t n) {
+	return io_op{ &s, NULL, 1, false, { p, n }, 0, {} };
+}
+
+static inline io_op
+write_some(ioslot &s, const struct iovec *iov, int iovcnt) {
+	return io_op{ &s, iov, iovcnt, true, {}, 0, {} };
+}
+
+// Wakes one waiting task. A notify with nobody waiting is remembered,
+// so the next co_await goes straight through.
+struct event {
+	reactor *r;
+	std::coroutine_handle<> h;
+	bool set;
+
+	void notify(void) {
+		set = true;
+		if (h) {
+			r->post(h);
+			h = nullptr;
+		}
+	}
+	bool await_ready() { return set; }
+	void await_suspend(std::coroutine_handle<> task) { h = task; }
+	void await_resume() { set = false; }
+};
+
+inline void
+reactor::add(ioslot &s, int fd) {
+	struct epoll_event ev;
+
+	s.r = this;
+	s.fd = fd;
+	s.rd = s.wr = NULL;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = &s;
+	calls++;
+	s.pollable = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+	if (!s.pollable && errno != EPERM)
+		err(1, "epoll_ctl");
+}
+
+// Resume every ready task; if there are none, wait for I/O and finish
+// the operations it allows. Returns early on a signal.
+inline void
+reactor::turn(void) {
+	struct epoll_event evs[16];
+	int n;
+
+	if (ready.empty()) {
+		calls++;
+		if ((n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), -1)) < 0) {
+			if (errno == EINTR)
+				return;
+			err(1, "epoll_wait");
+		}
+		for (int i = 0; i < n; i++) {
+			ioslot *s = (ioslot *)evs[i].data.ptr;
+			uint32_t e = evs[i].events;
+
+			// HUP and ERR let both directions see the end or the error.
+			if ((e & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0 && s->rd != NULL && s->rd->attempt()) {
+				post(s->rd->h);
+				s->rd = NULL;
+			}
+			if ((e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0 && s->wr != NULL && s->wr->attempt()) {
+				post(s->wr->h);
+				s->wr = NULL;
+			}
+		}
+	}
+	while (!ready.empty()) {
+		std::coroutine_handle<> h = ready.front();
+
+		ready.pop_front();
+		h.resume();
+	}
+}
@@ -0,0 +1,601 @@
+// cus.cpp : cus for Linux, where QEMU and VirtualBox give guest serial
+// ports as Unix domain sockets or ptys.
+//
+//	cus [-v] [-e epoll|uring|coro] [-l log [-cd]] [-q KB[:drop]] socket|pty
+//
+// The session is the Windows one: a raw terminal, ~. to exit and ~q for
+// the queues (escape.h), and the same log (-l, cleaned with -c, repeats
+// collapsed with -d). Redirected stdin and stdout work as on Windows.
+//
+// The I/O is done by one of three engines. The io_uring one (uring.cpp)
+// is used where the kernel has it. The coroutine one (coro.cpp) runs
+// the session as a few straight-line tasks on an epoll reactor. The
+// epoll one here runs one loop over non-blocking descriptors: output
+// for the terminal and input for the guest wait in bounded
+// bufferqueues, so a flood of output never holds up the keyboard, and
+// a full queue stops whatever feeds it, or with :drop loses the
+// excess. -v reports system calls per MB at exit.
+
+#include "cus.h"
+#include "ansifilter.h"
+#include "escape.h"
+#include "linededup.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define WRITEV_MAX 64
+
+// A non-blocking output and what's waiting for it. An fd epoll can't
+// watch (a regular file) is left blocking and never queues.
+struct writer {
+	const char *name;
+	int fd;
+	bool pollable;
+	bufferqueue *q;
+};
+
+QueuePolicy queuePolicy;
+size_t queueLimit = QUEUE_LIMIT_KB * 1024 / ABUFFER_SIZE;
+const char *portName;
+int portFd;
+bool portSocket, stdinTty, portClosed;
+volatile sig_atomic_t stopSig;
+unsigned long long ioCalls, ioPortBytes;
+
+writer term, port;
+int epfd;
+bool stdinPollable, stdinEof;
+bool termPaused, stdinPaused;	// reads stopped for a full queue
+struct termios termSaved, portSaved;
+bool termSet, portSet;
+int stdinFlags, stdoutFlags;
+
+int logFd = -1;
+ansifilter *logFilter;
+linededup *logDedup;
+std::string logClean, logUniq;
+
+static void
+usage(const char *name) {
+	fprintf(stderr, "usage: %s [-v] [-e epoll|uring|coro] [-l log [-cd]] [-q KB[:drop]] socket|pty\n", name);
+	exit(1);
+}
+
+static void
+restore_terminal(void) {
+	if (termSet)
+		tcsetattr(0, TCSAFLUSH, &termSaved);
+	if (portSet)
+		tcsetattr(portFd, TCSANOW, &portSaved);
+	fcntl(0, F_SETFL, stdinFlags);
+	fcntl(1, F_SETFL, stdoutFlags);
+	termSet = portSet = false;
+}
+
+static void
+on_signal(int sig) {
+	stopSig = sig;
+}
+
+// -q KB[:block|:drop]
+static bool
+parse_queue(const char *arg) {
+	unsigned long kb;
+	char *end;
+
+	kb = strtoul(arg, &end, 10);
+	if (end == arg || kb == 0 || kb > 4 * 1024 * 1024)
+		return false;
+	if (strcmp(end, ":drop") == 0)
+		queuePolicy = QUEUE_DROP;
+	else if (*end == 0 || strcmp(end, ":block") == 0)
+		queuePolicy = QUEUE_BLOCK;
+	else
+		return false;
+	queueLimit = ((size_t)kb * 1024 + ABUFFER_SIZE - 1) / ABUFFER_SIZE;
+	return true;
+}
+
+void
+write_all(int fd, const char *p, size_t n, const char *name) {
+	while (n > 0) {
+		ssize_t r = write(fd, p, n);
+
+		ioCalls++;
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "%s", name);
+		}
+		p += r;
+		n -= r;
+	}
+}
+
+// Write what can go now and queue the rest.
+static void
+out_write(writer &w, const char *p, size_t n) {
+	if (!w.pollable) {
+		write_all(w.fd, p, n, w.name);
+		return;
+	}
+	if (w.q->empty()) {
+		ssize_t r = write(w.fd, p, n);
+
+		ioCalls++;
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				err(1, "%s", w.name);
+			r = 0;
+		}
+		p += r;
+		n -= r;
+	}
+	if (n == 0)
+		return;
+	if (queuePolicy == QUEUE_DROP && w.q->full()) {
+		w.q->dropped((DWORD)n);
+		return;
+	}
+	while (n > 0) {
+		auto abuf = new abuffer();
+		size_t k = n < ABUFFER_SIZE ? n : ABUFFER_SIZE;
+
+		memcpy(abuf->getptr(), p, k);
+		abuf->size((DWORD)k);
+		w.q->push(abuf);
+		p += k;
+		n -= k;
+	}
+}
+
+// The fd is writable: gather the front of the queue into one writev.
+static void
+out_flush(writer &w) {
+	while (!w.q->empty()) {
+		struct iovec iov[WRITEV_MAX];
+		size_t n = w.q->size() < WRITEV_MAX ? w.q->size() : WRITEV_MAX;
+
+		for (size_t i = 0; i < n; i++) {
+			iov[i].iov_base = w.q->at(i)->getptr();
+			iov[i].iov_len = w.q->at(i)->size();
+		}
+		ssize_t r = writev(w.fd, iov, (int)n);
+
+		ioCalls++;
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			err(1, "%s", w.name);
+		}
+		while (r > 0) {
+			auto abuf = w.q->front();
+			DWORD k = (DWORD)r < abuf->size() ? (DWORD)r : abuf->size();
+
+			abuf->advance(k);
+			r -= k;
+			if (abuf->empty()) {
+				w.q->pop();
+				delete abuf;
+			}
+		}
+	}
+}
+
+bool
+log_filtering(void) {
+	return logFilter != NULL || logDedup != NULL;
+}
+
+// What the log gets for output p/n: the same bytes, or what -c and/or
+// -d make of them (good until the next call). last flushes what they
+// hold.
+void
+log_prepare(const char **p, size_t *n, bool last) {
+	if (logFilter != NULL) {
+		logClean.clear();
+		logFilter->filter((const __int8 *)*p, (DWORD)*n, logClean);
+		if (last)
+			logFilter->flush(logClean);
+		*p = logClean.data();
+		*n = logClean.size();
+	}
+	if (logDedup != NULL) {
+		logUniq.clear();
+		logDedup->filter((const __int8 *)*p, (DWORD)*n, logUniq);
+		if (last)
+			logDedup->flush(logUniq);
+		*p = logUniq.data();
+		*n = logUniq.size();
+	}
+}
+
+static void
+log_out(const char *p, size_t n, bool last) {
+	if (logFd < 0)
+		return;
+	log_prepare(&p, &n, last);
+	if (n != 0)
+		write_all(logFd, p, n, "log");
+}
+
+// Messages for the user go to the terminal, or stderr if stdout isn't one.
+void
+ui_puts(const char *s, void (*out)(const char *, size_t)) {
+	if (isatty(1))
+		out(s, strlen(s));
+	else
+		write_all(2, s, strlen(s), "stderr");
+}
+
+static void
+term_out(const char *p, size_t n) {
+	out_write(term, p, n);
+}
+
+static void
+queue_line(std::string &s, const char *name, bufferqueue *q) {
+	char buf[128];
+
+	snprintf(buf, sizeof(buf), "\r\n  %-9s %7zu KB of %zu KB, peak %zu KB", name,
+		q->size() * ABUFFER_SIZE / 1024, q->limit() * ABUFFER_SIZE / 1024, q->peak() * ABUFFER_SIZE / 1024);
+	s += buf;
+	if (q->dropped() != 0) {
+		snprintf(buf, sizeof(buf), ", %llu bytes dropped", q->dropped());
+		s += buf;
+	}
+}
+
+// ~q
+static void
+queue_status(void) {
+	std::string s = "\r\n[queues, ";
+
+	s += queuePolicy == QUEUE_DROP ? "drop when full" : "block when full";
+	if (termPaused)
+		s += ", port reads stopped";
+	s += "]";
+	queue_line(s, "terminal", term.q);
+	queue_line(s, "port", port.q);
+	s += "\r\n";
+	ui_puts(s.c_str(), term_out);
+}
+
+// Keyboard input through the escapes (~. and ~q, which calls status);
+// redirected input as is. Returns false for ~.
+bool
+keys_in(const char *p, size_t n, std::string &out, void (*status)(void)) {
+	static TermState state = STATE_NEWLINE;
+
+	if (!stdinTty) {
+		out.append(p, n);
+		return true;
+	}
+	for (size_t i = 0; i < n; i++) {
+		switch (esc_step(&state, p[i], ".q", out)) {
+		case '.':
+			return false;
+		case 'q':
+			status();
+			break;
+		}
+	}
+	return true;
+}
+
+static void
+port_open(const char *name) {
+	struct stat st;
+
+	if (stat(name, &st) < 0)
+		err(1, "%s", name);
+	if (S_ISSOCK(st.st_mode)) {
+		struct sockaddr_un sun;
+
+		if (strlen(name) >= sizeof(sun.sun_path))
+			errx(1, "%s: socket path too long", name);
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, name);
+		if ((portFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+			err(1, "socket");
+		if (connect(portFd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			err(1, "%s", name);
+		portSocket = true;
+	} else {
+		if ((portFd = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0)
+			err(1, "%s", name);
+		if (isatty(portFd)) {
+			struct termios t;
+
+			if (tcgetattr(portFd, &portSaved) < 0)
+				err(1, "%s", name);
+			t = portSaved;
+			cfmakeraw(&t);
+			if (tcsetattr(portFd, TCSANOW, &t) < 0)
+				err(1, "%s", name);
+			portSet = true;
+		}
+	}
+}
+
+static void
+term_setup(void) {
+	struct termios t;
+
+	stdinFlags = fcntl(0, F_GETFL);
+	stdoutFlags = fcntl(1, F_GETFL);
+	stdinTty = isatty(0);
+	if (stdinTty) {
+		if (tcgetattr(0, &termSaved) < 0)
+			err(1, "tcgetattr");
+		t = termSaved;
+		cfmakeraw(&t);
+		if (tcsetattr(0, TCSAFLUSH, &t) < 0)
+			err(1, "tcsetattr");
+		termSet = true;
+	}
+	atexit(restore_terminal);
+}
+
+static bool
+watch(int fd, bool nonblock) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	ioCalls++;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (errno == EPERM)
+			return false;	// a regular file; always ready
+		err(1, "epoll_ctl");
+	}
+	if (nonblock && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		err(1, "fcntl");
+	return true;
+}
+
+// Ask epoll for just what the loop can act on now.
+static void
+interest(int fd, uint32_t events) {
+	static uint32_t last[3] = { ~0U, ~0U, ~0U };
+	int slot = fd == portFd ? 2 : fd;
+	struct epoll_event ev;
+
+	if (last[slot] == events)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	ioCalls++;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		err(1, "epoll_ctl");
+	last[slot] = events;
+}
+
+static bool
+blocked(bufferqueue *q, bool stopped) {
+	return queuePolicy == QUEUE_BLOCK && q->blocked(stopped);
+}
+
+// Guest output: to the terminal and the log.
+static bool
+port_read(void) {
+	char buf[READ_BUFSIZE];
+	ssize_t n;
+
+	while (!(termPaused = blocked(term.q, termPaused))) {
+		ioCalls++;
+		if ((n = read(portFd, buf, sizeof(buf))) < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return true;
+			if (errno == EIO)	// pty with nothing on the other side
+				return false;
+			err(1, "%s", portName);
+		}
+		if (n == 0)
+			return false;
+		ioPortBytes += n;
+		out_write(term, buf, n);
+		log_out(buf, n, false);
+	}
+	return true;
+}
+
+// Returns false for ~.
+static bool
+stdin_read(void) {
+	char buf[READ_BUFSIZE];
+	ssize_t n;
+
+	while (!(stdinPaused = blocked(port.q, stdinPaused))) {
+		std::string out;
+
+		ioCalls++;
+		if ((n = read(0, buf, sizeof(buf))) < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return true;
+			err(1, "stdin");
+		}
+		if (n == 0) {
+			stdinEof = true;
+			return true;
+		}
+		if (!keys_in(buf, n, out, queue_status))
+			return false;
+		if (!out.empty())
+			out_write(port, out.data(), out.size());
+	}
+	return true;
+}
+
+// The epoll engine; returns the exit status.
+static int
+run_epoll(void) {
+	struct epoll_event evs[4];
+	bool quit = false;
+
+	if (fcntl(portFd, F_SETFL, fcntl(portFd, F_GETFL) | O_NONBLOCK) < 0)
+		err(1, "%s", portName);
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		err(1, "epoll_create1");
+	term.name = "stdout";
+	term.fd = 1;
+	term.q = new bufferqueue(queueLimit);
+	term.pollable = watch(1, true);
+	port.name = portName;
+	port.fd = portFd;
+	port.q = new bufferqueue(queueLimit);
+	port.pollable = true;
+	if (!watch(portFd, false))
+		errx(1, "%s: not a socket or terminal", portName);
+	stdinPollable = watch(0, true);
+
+	while (!quit && !portClosed && stopSig == 0) {
+		bool busy = false;	// an fd epoll can't watch is ready
+		int n;
+
+		interest(portFd, (termPaused ? 0 : EPOLLIN) | (port.q->empty() ? 0 : EPOLLOUT));
+		if (term.pollable)
+			interest(1, term.q->empty() ? 0 : EPOLLOUT);
+		if (stdinPollable)
+			interest(0, stdinPaused || stdinEof ? 0 : EPOLLIN);
+		else
+			busy = !stdinPaused && !stdinEof;
+
+		ioCalls++;
+		if ((n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), busy ? 0 : -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "epoll_wait");
+		}
+		for (int i = 0; i < n; i++) {
+			int fd = evs[i].data.fd;
+
+			if (fd == portFd) {
+				if ((evs[i].events & EPOLLOUT) != 0)
+					out_flush(port);
+				if ((evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0 && !port_read())
+					portClosed = true;
+			} else if (fd == 1)
+				out_flush(term);
+			else if (fd == 0 && !stdin_read())
+				quit = true;
+		}
+		if (busy && !stdin_read())
+			quit = true;
+
+		// the queues drained: pick up where the loop stopped
+		if (termPaused && !port_read())
+			portClosed = true;
+		if (stdinPaused && !stdin_read())
+			quit = true;
+		if (stdinEof && port.q->empty())
+			quit = true;
+	}
+	log_out(NULL, 0, true);
+
+	// What's still queued for the terminal goes out before we leave.
+	fcntl(1, F_SETFL, stdoutFlags & ~O_NONBLOCK);
+	term.pollable = true;
+	while (!term.q->empty())
+		out_flush(term);
+	restore_terminal();
+	if (port.q->dropped() != 0)
+		fprintf(stderr, "port: queue full, %llu bytes of input dropped\n", port.q->dropped());
+	if (term.q->dropped() != 0)
+		fprintf(stderr, "terminal: queue full, %llu bytes dropped\n", term.q->dropped());
+	return portClosed ? 1 : 0;
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *logName = NULL, *progname = argv[0], *engine = "uring";
+	bool cFlag = false, dFlag = false, vFlag = false;
+	struct sigaction sa;
+	int c, status;
+
+	while ((c = getopt(argc, argv, "cde:l:q:v")) != -1) {
+		switch (c) {
+		case 'c':
+			cFlag = true;
+			break;
+		case 'd':
+			dFlag = true;
+			break;
+		case 'e':
+			engine = optarg;
+			if (strcmp(engine, "epoll") != 0 && strcmp(engine, "uring") != 0 && strcmp(engine, "coro") != 0)
+				usage(progname);
+			break;
+		case 'l':
+			logName = optarg;
+			break;
+		case 'q':
+			if (!parse_queue(optarg))
+				usage(progname);
+			break;
+		case 'v':
+			vFlag = true;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || ((cFlag || dFlag) && logName == NULL))
+		usage(progname);
+	portName = argv[0];
+
+	if (logName != NULL) {
+		if ((logFd = open(logName, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0)
+			err(1, "%s", logName);
+		if (cFlag)
+			logFilter = new ansifilter();
+		if (dFlag)
+			logDedup = new linededup();
+	}
+	port_open(portName);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	sa.sa_handler = on_signal;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	term_setup();
+
+	status = -ENOSYS;
+	if (strcmp(engine, "coro") == 0)
+		status = run_coro();
+	else if (strcmp(engine, "uring") == 0 && (status = run_uring()) < 0 && vFlag)
+		fprintf(stderr, "io_uring: %s, using epoll\r\n", strerror(-status));
+	if (status < 0) {
+		engine = "epoll";
+		status = run_epoll();
+	}
+
+	restore_terminal();
+	if (portClosed)
+		warnx("%s: connection closed", portName);
+	if (vFlag)
+		fprintf(stderr, "%s: %llu system calls for %.1f MB from the port, %.0f per MB\n", engine,
+			ioCalls, ioPortBytes / 1e6, ioPortBytes != 0 ? ioCalls / (ioPortBytes / 1e6) : 0.0);
+	return status;
+}
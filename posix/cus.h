@@ -0,0 +1,40 @@
+// cus.h : what the Linux front end's I/O engines share. cus.cpp has the
+// session setup and the epoll engine, uring.cpp the io_uring one and
+// coro.cpp the coroutine one.
+
+#pragma once
+
+#include "abuffer.h"
+#include <signal.h>
+#include <stddef.h>
+#include <string>
+
+#define READ_BUFSIZE (16 * 1024)
+#define QUEUE_LIMIT_KB 4096
+
+enum QueuePolicy { QUEUE_BLOCK, QUEUE_DROP };
+
+extern QueuePolicy queuePolicy;
+extern size_t queueLimit;		// in abuffers' worth of bytes
+extern const char *portName;
+extern int portFd;
+extern bool portSocket, stdinTty;
+extern bool portClosed;			// the guest end went away
+extern volatile sig_atomic_t stopSig;
+extern int logFd;
+
+// For -v: system calls made on the data path, and bytes from the port.
+extern unsigned long long ioCalls, ioPortBytes;
+
+void write_all(int fd, const char *p, size_t n, const char *name);
+bool keys_in(const char *p, size_t n, std::string &out, void (*status)(void));
+bool log_filtering(void);
+void log_prepare(const char **p, size_t *n, bool last);
+void ui_puts(const char *s, void (*out)(const char *, size_t));
+
+// Returns the exit status, or -errno if io_uring can't be used here;
+// then nothing has been touched and the epoll engine takes over.
+int run_uring(void);
+
+// The coroutine engine (coro.cpp); returns the exit status.
+int run_coro(void);
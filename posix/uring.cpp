@@ -0,0 +1,399 @@
+// uring.cpp : the io_uring engine for the Linux front end.
+//
+// Guest output is received into a fixed pool of buffers registered with
+// the kernel (a provided-buffer ring): on a socket by one multishot
+// receive, which keeps completing for as long as there are free
+// buffers, on a pty by a read re-armed per chunk. Each chunk is written
+// to the terminal and the log straight from its pool buffer, which goes
+// back to the kernel once both writes are done. So nothing is allocated
+// per chunk, and when the terminal or log can't keep up the pool runs
+// dry and receiving stops: backpressure with bounded memory. (With -q
+// :drop, output the terminal hasn't taken is dropped instead once the
+// pool is three-quarters used.)
+//
+// One terminal write (a writev over waiting chunks) and one port write
+// are in flight at a time, which keeps them in order. Log writes carry
+// their file offsets, so any number can be in flight; the ones queued
+// together are linked so they run in order. With -c or -d the log gets
+// filtered copies instead of the pool buffers. All submissions for a
+// loop turn go in with the wait for the next completions: one system
+// call per turn.
+
+#include "cus.h"
+#include "uring.h"
+
+#include <deque>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 256
+#define URING_NBUFS 64			// a power of two
+#define URING_BUFSIZE (16 * 1024)
+#define URING_BGID 1
+#define URING_IOV 64
+
+enum { OP_RECV, OP_STDIN, OP_TERM, OP_LOG, OP_PORT };
+
+// Bytes waiting to be written, in pool buffer bid or (bid -1) a copy.
+struct chunk {
+	const char *p;
+	size_t len;
+	int bid;
+	std::string *own;
+};
+
+struct logop {
+	chunk c;
+	unsigned long long off;
+	bool busy;
+};
+
+static uring ring;
+static bufring pool;
+static unsigned short refs[URING_NBUFS];
+static bool recvArmed, recvStarved, closing;
+
+static std::deque<chunk> termq;		// the first termIovs are being written
+static unsigned termIovs;
+static struct iovec termIov[URING_IOV];
+static size_t termQueued;
+static unsigned long long termDropped;
+
+static std::deque<chunk> logq;		// not yet submitted
+static logop logops[URING_ENTRIES];
+static unsigned logBusy;
+static unsigned long long logOff;
+
+static std::string portPending, portBusy;
+static size_t portDone;
+static unsigned long long portDropped;
+
+static char keybuf[READ_BUFSIZE];
+static bool stdinArmed, stdinEof, stdinPaused, quit;
+
+static void
+fail(int error, const char *what) {
+	errno = error;
+	err(1, "%s", what);
+}
+
+static io_uring_sqe *
+sqe_get(void) {
+	io_uring_sqe *sqe;
+
+	while ((sqe = uring_sqe(&ring)) == NULL) {
+		int r = uring_enter(&ring, 0);
+
+		if (r < 0 && r != -EINTR && r != -EAGAIN && r != -EBUSY)
+			fail(-r, "io_uring_enter");
+	}
+	return sqe;
+}
+
+static void
+prep_rw(io_uring_sqe *sqe, int op, int fd, const void *p, unsigned len, unsigned long long off, unsigned long long data) {
+	sqe->opcode = (unsigned char)op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)p;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = data;
+}
+
+static void
+chunk_done(const chunk &c) {
+	if (c.bid < 0)
+		delete c.own;
+	else if (--refs[c.bid] == 0)
+		bufring_put(&pool, c.bid);
+}
+
+static chunk
+chunk_copy(const char *p, size_t n) {
+	chunk c;
+
+	c.own = new std::string(p, n);
+	c.p = c.own->data();
+	c.len = n;
+	c.bid = -1;
+	return c;
+}
+
+static void
+term_own(const char *p, size_t n) {
+	termq.push_back(chunk_copy(p, n));
+	termQueued += n;
+}
+
+// ~q
+static void
+pool_status(void) {
+	char buf[256];
+
+	snprintf(buf, sizeof(buf), "\r\n[io_uring, %s when full]\r\n  pool      %u of %u buffers in use"
+		"\r\n  terminal  %zu KB waiting, %llu bytes dropped\r\n  port      %zu KB waiting, %llu bytes dropped\r\n",
+		queuePolicy == QUEUE_DROP ? "drop" : "block", URING_NBUFS - pool.navail, URING_NBUFS,
+		termQueued / 1024, termDropped, (portPending.size() + portBusy.size()) / 1024, portDropped);
+	ui_puts(buf, term_own);
+}
+
+// A chunk of guest output has landed in pool buffer bid.
+static void
+deliver(unsigned bid, size_t len) {
+	const char *p = bufring_at(&pool, bid);
+	chunk c = { p, len, (int)bid, NULL };
+
+	pool.navail--;
+	refs[bid] = 1;
+	if (closing) {
+		chunk_done(c);
+		return;
+	}
+	ioPortBytes += len;
+	if (queuePolicy == QUEUE_DROP && termIovs != 0 && pool.navail < URING_NBUFS / 4)
+		termDropped += len;
+	else {
+		refs[bid]++;
+		termq.push_back(c);
+		termQueued += len;
+	}
+	if (logFd >= 0) {
+		if (!log_filtering()) {
+			refs[bid]++;
+			logq.push_back(c);
+		} else {
+			const char *q = p;
+			size_t n = len;
+
+			log_prepare(&q, &n, false);
+			if (n != 0)
+				logq.push_back(chunk_copy(q, n));
+		}
+	}
+	chunk_done(c);
+}
+
+static void
+recv_arm(void) {
+	io_uring_sqe *sqe = sqe_get();
+
+	if (portSocket) {
+		prep_rw(sqe, IORING_OP_RECV, portFd, NULL, 0, 0, OP_RECV);
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	} else
+		prep_rw(sqe, IORING_OP_READ, portFd, NULL, URING_BUFSIZE, (unsigned long long)-1, OP_RECV);
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	recvArmed = true;
+}
+
+static void
+stdin_arm(void) {
+	prep_rw(sqe_get(), IORING_OP_READ, 0, keybuf, sizeof(keybuf), (unsigned long long)-1, OP_STDIN);
+	stdinArmed = true;
+}
+
+// Start whatever writes can start.
+static void
+kick(void) {
+	if (termIovs == 0 && !termq.empty()) {
+		while (termIovs < URING_IOV && termIovs < termq.size()) {
+			termIov[termIovs].iov_base = (void *)termq[termIovs].p;
+			termIov[termIovs].iov_len = termq[termIovs].len;
+			termIovs++;
+		}
+		prep_rw(sqe_get(), IORING_OP_WRITEV, 1, termIov, termIovs, (unsigned long long)-1, OP_TERM);
+	}
+
+	io_uring_sqe *last = NULL;
+	for (unsigned i = 0; i < URING_ENTRIES && !logq.empty(); i++) {
+		if (logops[i].busy)
+			continue;
+		logops[i].c = logq.front();
+		logops[i].off = logOff;
+		logops[i].busy = true;
+		logq.pop_front();
+		logOff += logops[i].c.len;
+		logBusy++;
+		if (last != NULL)
+			last->flags |= IOSQE_IO_LINK;
+		last = sqe_get();
+		prep_rw(last, IORING_OP_WRITE, logFd, logops[i].c.p, (unsigned)logops[i].c.len, logops[i].off,
+			OP_LOG | (unsigned long long)i << 8);
+	}
+
+	if (portBusy.empty() && !portPending.empty()) {
+		portBusy.swap(portPending);
+		portDone = 0;
+		prep_rw(sqe_get(), IORING_OP_WRITE, portFd, portBusy.data(), (unsigned)portBusy.size(),
+			(unsigned long long)-1, OP_PORT);
+	}
+}
+
+// Resubmit the rest of log write i (short, or cancelled with its link).
+static void
+log_again(unsigned i) {
+	prep_rw(sqe_get(), IORING_OP_WRITE, logFd, logops[i].c.p, (unsigned)logops[i].c.len, logops[i].off,
+		OP_LOG | (unsigned long long)i << 8);
+}
+
+static void
+complete(io_uring_cqe *cqe) {
+	unsigned op = cqe->user_data & 0xff, i = (unsigned)(cqe->user_data >> 8);
+	int res = cqe->res;
+
+	switch (op) {
+	case OP_RECV:
+		if ((cqe->flags & IORING_CQE_F_BUFFER) != 0 && res > 0)
+			deliver(cqe->flags >> IORING_CQE_BUFFER_SHIFT, res);
+		if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+			recvArmed = false;
+		if (res == 0 || res == -EIO)		// EIO: a pty with nothing on the other side
+			portClosed = true;
+		else if (res == -ENOBUFS)
+			recvStarved = true;
+		else if (res < 0 && res != -EINTR && res != -EAGAIN)
+			fail(-res, portName);
+		break;
+	case OP_STDIN: {
+		std::string out;
+
+		stdinArmed = false;
+		if (res == 0)
+			stdinEof = true;
+		else if (res < 0 && res != -EINTR && res != -EAGAIN)
+			fail(-res, "stdin");
+		else if (res > 0 && !keys_in(keybuf, res, out, pool_status))
+			quit = true;
+		if (queuePolicy == QUEUE_DROP && portPending.size() >= queueLimit * ABUFFER_SIZE)
+			portDropped += out.size();
+		else
+			portPending += out;
+		break;
+	}
+	case OP_TERM:
+		if (res < 0 && res != -EINTR && res != -EAGAIN)
+			fail(-res, "stdout");
+		for (size_t n = res > 0 ? res : 0; n != 0;) {
+			chunk &c = termq.front();
+			size_t k = n < c.len ? n : c.len;
+
+			c.p += k;
+			c.len -= k;
+			n -= k;
+			termQueued -= k;
+			if (c.len == 0) {
+				chunk_done(c);
+				termq.pop_front();
+			}
+		}
+		termIovs = 0;
+		break;
+	case OP_LOG:
+		if (res == -ECANCELED || res == -EINTR || res == -EAGAIN) {
+			log_again(i);
+			break;
+		}
+		if (res < 0)
+			fail(-res, "log");
+		if ((size_t)res < logops[i].c.len) {
+			logops[i].c.p += res;
+			logops[i].c.len -= res;
+			logops[i].off += res;
+			log_again(i);
+			break;
+		}
+		chunk_done(logops[i].c);
+		logops[i].busy = false;
+		logBusy--;
+		break;
+	case OP_PORT:
+		if (res < 0 && res != -EINTR && res != -EAGAIN)
+			fail(-res, portName);
+		portDone += res > 0 ? res : 0;
+		if (portDone < portBusy.size())
+			prep_rw(sqe_get(), IORING_OP_WRITE, portFd, portBusy.data() + portDone,
+				(unsigned)(portBusy.size() - portDone), (unsigned long long)-1, OP_PORT);
+		else
+			portBusy.clear();
+		break;
+	}
+}
+
+static void
+turn(void) {
+	io_uring_cqe *cqe;
+	int r;
+
+	kick();
+	if ((r = uring_enter(&ring, 1)) < 0 && r != -EINTR)
+		fail(-r, "io_uring_enter");
+	while ((cqe = uring_peek(&ring)) != NULL) {
+		complete(cqe);
+		uring_seen(&ring);
+	}
+}
+
+int
+run_uring(void) {
+	io_uring_cqe *cqe;
+	int r;
+
+	if ((r = uring_init(&ring, URING_ENTRIES)) < 0)
+		return r;
+	if ((r = bufring_init(&ring, &pool, URING_BGID, URING_NBUFS, URING_BUFSIZE)) < 0) {
+		uring_close(&ring);
+		return r;
+	}
+
+	// Requests on O_NONBLOCK files fail with EAGAIN instead of waiting.
+	fcntl(0, F_SETFL, fcntl(0, F_GETFL) & ~O_NONBLOCK);
+	fcntl(1, F_SETFL, fcntl(1, F_GETFL) & ~O_NONBLOCK);
+	fcntl(portFd, F_SETFL, fcntl(portFd, F_GETFL) & ~O_NONBLOCK);
+
+	// A kernel without multishot receive rejects it at once; nothing
+	// has been read yet, so epoll can still take over.
+	recv_arm();
+	if ((r = uring_enter(&ring, 0)) < 0 || ((cqe = uring_peek(&ring)) != NULL && cqe->res == -EINVAL)) {
+		uring_close(&ring);
+		bufring_free(&pool);
+		return r < 0 ? r : -EINVAL;
+	}
+	stdin_arm();
+
+	while (!quit && !portClosed && stopSig == 0) {
+		if (!recvArmed && pool.navail >= (recvStarved ? URING_NBUFS / 2 : 1)) {
+			recvStarved = false;
+			recv_arm();
+		}
+		stdinPaused = queuePolicy == QUEUE_BLOCK &&
+			portPending.size() >= (stdinPaused ? queueLimit / 2 : queueLimit) * ABUFFER_SIZE;
+		if (!stdinArmed && !stdinEof && !stdinPaused)
+			stdin_arm();
+		if (stdinEof && portPending.empty() && portBusy.empty())
+			break;
+		turn();
+	}
+
+	// Finish the terminal and log writes; whatever else arrives is let go.
+	closing = true;
+	if (logFd >= 0 && log_filtering()) {
+		const char *p = NULL;
+		size_t n = 0;
+
+		log_prepare(&p, &n, true);
+		if (n != 0)
+			logq.push_back(chunk_copy(p, n));
+	}
+	while (!termq.empty() || !logq.empty() || logBusy != 0)
+		turn();
+
+	ioCalls += ring.enters;
+	uring_close(&ring);
+	bufring_free(&pool);
+	if (termDropped != 0 || portDropped != 0)
+		fprintf(stderr, "\r\nio_uring: %llu bytes of output and %llu of input dropped\r\n", termDropped, portDropped);
+	return portClosed ? 1 : 0;
+}
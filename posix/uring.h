@@ -0,0 +1,209 @@
+// uring.h : just enough io_uring for cus, on the raw system calls (no
+// liburing), plus a provided-buffer ring.
+//
+// A uring is the usual pair of mapped queues. uring_sqe() hands out
+// submission entries, which are all passed to the kernel by the next
+// uring_enter() along with the wait for completions, so a loop turn is
+// one system call however much it does. A bufring is a fixed pool of
+// equal buffers registered with the kernel (IORING_REGISTER_PBUF_RING);
+// reads that ask for IOSQE_BUFFER_SELECT take one from it and return
+// its id in the completion, and the owner gives it back with
+// bufring_put() once the data has been used.
+
+#pragma once
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct uring {
+	int fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	io_uring_sqe *sqes;
+	io_uring_cqe *cqes;
+	unsigned sqtodo;		// entries handed out, not yet submitted
+	void *sqmap, *cqmap;
+	size_t sqlen, cqlen, sqeslen;
+	unsigned long long enters;	// io_uring_enter calls
+};
+
+struct bufring {
+	io_uring_buf_ring *br;
+	size_t brlen;
+	char *base;
+	unsigned nbufs, bufsize;
+	unsigned short bgid, tail;
+	unsigned navail;		// buffers the kernel can use
+};
+
+// Returns 0 or -errno; on failure nothing is left open.
+static inline int
+uring_init(uring *u, unsigned entries) {
+	io_uring_params p;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -errno;
+
+	u->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0 && u->cqlen > u->sqlen)
+		u->sqlen = u->cqlen;
+	u->sqmap = mmap(NULL, u->sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sqmap == MAP_FAILED)
+		goto fail;
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		u->cqmap = u->sqmap;
+	else {
+		u->cqmap = mmap(NULL, u->cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cqmap == MAP_FAILED)
+			goto fail;
+	}
+	u->sqeslen = p.sq_entries * sizeof(io_uring_sqe);
+	u->sqes = (io_uring_sqe *)mmap(NULL, u->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	u->sqhead = (unsigned *)((char *)u->sqmap + p.sq_off.head);
+	u->sqtail = (unsigned *)((char *)u->sqmap + p.sq_off.tail);
+	u->sqmask = (unsigned *)((char *)u->sqmap + p.sq_off.ring_mask);
+	u->sqarray = (unsigned *)((char *)u->sqmap + p.sq_off.array);
+	u->cqhead = (unsigned *)((char *)u->cqmap + p.cq_off.head);
+	u->cqtail = (unsigned *)((char *)u->cqmap + p.cq_off.tail);
+	u->cqmask = (unsigned *)((char *)u->cqmap + p.cq_off.ring_mask);
+	u->cqes = (io_uring_cqe *)((char *)u->cqmap + p.cq_off.cqes);
+	return 0;
+fail:
+	int e = errno;
+
+	if (u->sqmap != NULL && u->sqmap != MAP_FAILED)
+		munmap(u->sqmap, u->sqlen);
+	if (u->cqmap != NULL && u->cqmap != MAP_FAILED && u->cqmap != u->sqmap)
+		munmap(u->cqmap, u->cqlen);
+	close(u->fd);
+	return -e;
+}
+
+static inline int
+uring_enter(uring *u, unsigned wait) {
+	int r;
+
+	u->enters++;
+	r = (int)syscall(__NR_io_uring_enter, u->fd, u->sqtodo, wait, wait != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (r < 0)
+		return -errno;
+	u->sqtodo -= (unsigned)r;
+	return r;
+}
+
+// A cleared submission entry, or NULL if the queue is full (submit).
+static inline io_uring_sqe *
+uring_sqe(uring *u) {
+	unsigned head = __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE);
+	unsigned tail = *u->sqtail;
+	io_uring_sqe *sqe;
+
+	if (tail - head > *u->sqmask)
+		return NULL;
+	sqe = &u->sqes[tail & *u->sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sqarray[tail & *u->sqmask] = tail & *u->sqmask;
+	__atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+	u->sqtodo++;
+	return sqe;
+}
+
+// The next completion, or NULL; uring_seen() when done with it.
+static inline io_uring_cqe *
+uring_peek(uring *u) {
+	unsigned head = *u->cqhead;
+
+	if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &u->cqes[head & *u->cqmask];
+}
+
+static inline void
+uring_seen(uring *u) {
+	__atomic_store_n(u->cqhead, *u->cqhead + 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+uring_close(uring *u) {
+	munmap(u->sqes, u->sqeslen);
+	if (u->cqmap != u->sqmap)
+		munmap(u->cqmap, u->cqlen);
+	munmap(u->sqmap, u->sqlen);
+	close(u->fd);
+}
+
+// Give buffer bid (back) to the kernel.
+static inline void
+bufring_put(bufring *b, unsigned bid) {
+	// Not br->bufs: in C++ the header's flex array member lands at the
+	// wrong offset (its empty placeholder struct takes a byte).
+	io_uring_buf *e = (io_uring_buf *)b->br + (b->tail & (b->nbufs - 1));
+
+	e->addr = (unsigned long long)(b->base + (size_t)bid * b->bufsize);
+	e->len = b->bufsize;
+	e->bid = (unsigned short)bid;
+	b->tail++;
+	__atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+	b->navail++;
+}
+
+static inline char *
+bufring_at(bufring *b, unsigned bid) {
+	return b->base + (size_t)bid * b->bufsize;
+}
+
+// nbufs must be a power of two. Returns 0 or -errno (EINVAL on kernels
+// before 5.19, which have no buffer rings).
+static inline int
+bufring_init(uring *u, bufring *b, unsigned short bgid, unsigned nbufs, unsigned bufsize) {
+	io_uring_buf_reg reg;
+
+	memset(b, 0, sizeof(*b));
+	b->nbufs = nbufs;
+	b->bufsize = bufsize;
+	b->bgid = bgid;
+	b->brlen = nbufs * sizeof(io_uring_buf);
+	b->br = (io_uring_buf_ring *)mmap(NULL, b->brlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->br == MAP_FAILED)
+		return -errno;
+	b->base = (char *)mmap(NULL, (size_t)nbufs * bufsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->base == MAP_FAILED) {
+		munmap(b->br, b->brlen);
+		return -errno;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long long)b->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		int e = errno;
+
+		munmap(b->base, (size_t)nbufs * bufsize);
+		munmap(b->br, b->brlen);
+		return -e;
+	}
+	for (unsigned i = 0; i < nbufs; i++)
+		bufring_put(b, i);
+	return 0;
+}
+
+// After uring_close(), which unregisters the ring.
+static inline void
+bufring_free(bufring *b) {
+	munmap(b->base, (size_t)b->nbufs * b->bufsize);
+	munmap(b->br, b->brlen);
+}
@@ -0,0 +1,437 @@
+// logidx.cpp : index a cus log by boot, and pull single boots out of it.
+//
+//	logidx [-j threads] [-b banner]... [-i index] log
+//	logidx -x boot [-i index] log
+//	logidx -q [-l level] [-t from,to] [-T from,to] [-k pkindex] log
+//
+// The first form maps the log, scans it for boot banners in parallel
+// LOGIDX_CHUNK pieces, writes the index (log.idx unless -i) and prints
+// it as a table. -b replaces the default banners (see bootindex.h). The
+// second form copies one boot to stdout using the index alone. The
+// third copies the printk lines at level or below, with guest times
+// (-t, seconds) or host times (-T, seconds since 1970) in range, using
+// the columns cus -k wrote (log.pk unless -k, see printkidx.h).
+
+#include "bootindex.h"
+#include "printkidx.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define LOGIDX_CHUNK (64ULL * 1024 * 1024)
+#define LOGIDX_COPYBUF (1024 * 1024)
+
+static void
+usage(const char *name) {
+	fprintf(stderr, "usage: %s [-j threads] [-b banner]... [-i index] log\n"
+	    "       %s -x boot [-i index] log\n"
+	    "       %s -q [-l level] [-t from,to] [-T from,to] [-k pkindex] log\n", name, name, name);
+	exit(1);
+}
+
+static int
+build(const char *log, const std::string &idxname, unsigned nthreads, const std::vector<std::string> &banners) {
+	struct stat st;
+	const char *base = NULL;
+	std::vector<unsigned long long> starts;
+	std::vector<bootrec> boots;
+	int fd;
+
+	if ((fd = open(log, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(log);
+		return 1;
+	}
+	unsigned long long size = (unsigned long long)st.st_size;
+	if (size != 0) {
+		base = (const char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+	}
+
+	auto t0 = std::chrono::steady_clock::now();
+
+	// Pass 1: banners, one chunk at a time per thread.
+	{
+		unsigned long long nchunks = (size + LOGIDX_CHUNK - 1) / LOGIDX_CHUNK;
+		std::vector<std::vector<unsigned long long> > found(nthreads);
+		std::vector<std::thread> workers;
+		std::atomic<unsigned long long> next(0);
+
+		for (unsigned t = 0; t < nthreads; t++) {
+			workers.emplace_back([&, t]() {
+				unsigned long long c;
+
+				while ((c = next.fetch_add(1)) < nchunks) {
+					unsigned long long s = c * LOGIDX_CHUNK;
+					unsigned long long e = std::min(size, s + LOGIDX_CHUNK);
+
+					madvise((void *)(base + s), e - s, MADV_WILLNEED);
+					bootidx_scan(base, size, s, e, banners, found[t]);
+				}
+			});
+		}
+		for (auto &w : workers)
+			w.join();
+		for (auto &f : found)
+			starts.insert(starts.end(), f.begin(), f.end());
+		std::sort(starts.begin(), starts.end());
+		starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+	}
+
+	if (size != 0 && (starts.empty() || starts[0] != 0))
+		starts.insert(starts.begin(), 0);
+	for (size_t i = 0; i < starts.size(); i++) {
+		bootrec b;
+
+		b.start = starts[i];
+		b.end = i + 1 < starts.size() ? starts[i + 1] : size;
+		b.hasts = false;
+		b.firstts = b.lastts = 0;
+		boots.push_back(b);
+	}
+
+	// Pass 2: timestamps at each end of each boot.
+	{
+		std::vector<std::thread> workers;
+		std::atomic<size_t> next(0);
+
+		for (unsigned t = 0; t < nthreads; t++) {
+			workers.emplace_back([&]() {
+				size_t i;
+
+				while ((i = next.fetch_add(1)) < boots.size()) {
+					bootrec &b = boots[i];
+
+					b.hasts = bootidx_firstts(base, b.start, b.end, &b.firstts) &&
+					    bootidx_lastts(base, b.start, b.end, &b.lastts);
+				}
+			});
+		}
+		for (auto &w : workers)
+			w.join();
+	}
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+	std::string tmp = idxname + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (f == NULL) {
+		perror(tmp.c_str());
+		return 1;
+	}
+	bootidx_write(f, size, boots);
+	if (fclose(f) != 0 || rename(tmp.c_str(), idxname.c_str()) != 0) {
+		perror(idxname.c_str());
+		return 1;
+	}
+
+	printf("%5s %15s %15s %12s %14s %14s\n", "boot", "start", "end", "bytes", "first", "last");
+	for (size_t i = 0; i < boots.size(); i++) {
+		const bootrec &b = boots[i];
+
+		printf("%5zu %15llu %15llu %12llu ", i, b.start, b.end, b.end - b.start);
+		if (b.hasts)
+			printf("%14.6f %14.6f\n", b.firstts, b.lastts);
+		else
+			printf("%14s %14s\n", "-", "-");
+	}
+	fprintf(stderr, "%s: %.2f GB in %.2f s (%.2f GB/s, %u threads), %zu boots\n", log,
+	    size / 1e9, secs, secs > 0 ? size / 1e9 / secs : 0.0, nthreads, boots.size());
+	if (base != NULL)
+		munmap((void *)base, size);
+	close(fd);
+	return 0;
+}
+
+static int
+extract(const char *log, const std::string &idxname, unsigned long long n) {
+	std::vector<bootrec> boots;
+	unsigned long long idxsize;
+	struct stat st;
+	FILE *f;
+	int fd;
+
+	if ((f = fopen(idxname.c_str(), "r")) == NULL) {
+		perror(idxname.c_str());
+		return 1;
+	}
+	if (!bootidx_read(f, &idxsize, boots)) {
+		fprintf(stderr, "%s: not a boot index\n", idxname.c_str());
+		return 1;
+	}
+	fclose(f);
+	if (n >= boots.size()) {
+		fprintf(stderr, "%s: no boot %llu (%zu boots)\n", log, n, boots.size());
+		return 1;
+	}
+
+	if ((fd = open(log, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(log);
+		return 1;
+	}
+	if ((unsigned long long)st.st_size < idxsize) {
+		fprintf(stderr, "%s: shorter than when indexed; rerun logidx\n", log);
+		return 1;
+	}
+	if ((unsigned long long)st.st_size != idxsize && n == boots.size() - 1)
+		fprintf(stderr, "%s: has grown since indexed; boot %llu may continue\n", log, n);
+
+	std::vector<char> buf(LOGIDX_COPYBUF);
+	for (unsigned long long off = boots[n].start; off < boots[n].end;) {
+		size_t want = (size_t)std::min<unsigned long long>(buf.size(), boots[n].end - off);
+		ssize_t got = pread(fd, buf.data(), want, (off_t)off);
+
+		if (got <= 0) {
+			fprintf(stderr, "%s: %s\n", log, got < 0 ? strerror(errno) : "unexpected end of file");
+			return 1;
+		}
+		for (ssize_t done = 0; done < got;) {
+			ssize_t w = write(1, buf.data() + done, got - done);
+
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("write");
+				return 1;
+			}
+			done += w;
+		}
+		off += got;
+	}
+	close(fd);
+	return 0;
+}
+
+// A time range in seconds, "from,to", either end left out; in us.
+static bool
+parse_range(const char *arg, long long *from, long long *to) {
+	const char *comma = strchr(arg, ',');
+	char *end;
+
+	if (comma == NULL)
+		return false;
+	*from = 0;
+	*to = LLONG_MAX;
+	if (comma != arg) {
+		*from = (long long)(strtod(arg, &end) * 1e6);
+		if (end != comma)
+			return false;
+	}
+	if (comma[1] != 0) {
+		*to = (long long)(strtod(comma + 1, &end) * 1e6);
+		if (*end != 0)
+			return false;
+	}
+	return *from <= *to;
+}
+
+static bool
+pread_all(int fd, void *buf, size_t n, unsigned long long off) {
+	for (size_t done = 0; done < n;) {
+		ssize_t got = pread(fd, (char *)buf + done, n - done, (off_t)(off + done));
+
+		if (got <= 0)
+			return false;
+		done += got;
+	}
+	return true;
+}
+
+static int
+query(const char *log, const std::string &pkname, const pkquery &q) {
+	struct stat st, lst;
+	unsigned long long at = 0, nblocks = 0, nskipped = 0, nlines = 0, colbytes = 0;
+	std::vector<unsigned long long> col[PK_NCOLS];
+	std::vector<unsigned> hits;
+	std::vector<unsigned char> raw(8 * PK_BLOCKRECS);
+	std::vector<char> buf;
+	int fd, lfd;
+
+	if ((fd = open(pkname.c_str(), O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(pkname.c_str());
+		return 1;
+	}
+	if ((lfd = open(log, O_RDONLY)) < 0 || fstat(lfd, &lst) < 0) {
+		perror(log);
+		return 1;
+	}
+
+	for (auto &c : col)
+		c.resize(PK_BLOCKRECS);
+
+	// Column c of the block at at, decoded into col[c].
+	auto column = [&](const pkblock &b, unsigned long long at, int c) {
+		size_t n = (size_t)b.width[c] * b.count;
+
+		if (!pread_all(fd, raw.data(), n, at + pk_column(b, c)))
+			return false;
+		pk_decode(raw.data(), b.width[c], b.count, col[c].data());
+		colbytes += n;
+		return true;
+	};
+
+	auto t0 = std::chrono::steady_clock::now();
+	while (at + sizeof(pkblock) <= (unsigned long long)st.st_size) {
+		pkblock b;
+
+		bool widths = true;
+
+		if (!pread_all(fd, &b, sizeof(b), at) || memcmp(b.magic, PK_MAGIC, sizeof(b.magic)) != 0 ||
+		    b.count == 0 || b.count > PK_BLOCKRECS) {
+			fprintf(stderr, "%s: not a printk index at %llu\n", pkname.c_str(), at);
+			return 1;
+		}
+		for (int c = 0; c < PK_NCOLS; c++)
+			widths &= b.width[c] == 1 || b.width[c] == 2 || b.width[c] == 4 || b.width[c] == 8;
+		if (!widths) {
+			fprintf(stderr, "%s: bad block at %llu\n", pkname.c_str(), at);
+			return 1;
+		}
+		unsigned long long next = at + pk_column(b, PK_NCOLS);
+		if (next > (unsigned long long)st.st_size)
+			break;		// still being written
+		nblocks++;
+		colbytes += sizeof(b);
+		if (!pk_maybe(b, q)) {
+			nskipped++;
+			at = next;
+			continue;
+		}
+
+		// only the columns the query looks at
+		if ((q.gts && !column(b, at, PK_GTS)) || (q.hts && !column(b, at, PK_HTS)) ||
+		    (q.maxlevel >= 0 && !column(b, at, PK_LEVEL))) {
+			perror(pkname.c_str());
+			return 1;
+		}
+		hits.clear();
+		for (unsigned i = 0; i < b.count; i++) {
+			if (pk_match(b, q, col[PK_GTS][i], col[PK_HTS][i], col[PK_LEVEL][i]))
+				hits.push_back(i);
+		}
+		if (hits.empty()) {
+			at = next;
+			continue;
+		}
+		if (!column(b, at, PK_OFF) || !column(b, at, PK_LEN)) {
+			perror(pkname.c_str());
+			return 1;
+		}
+		std::vector<unsigned long long> &offs = col[PK_OFF], &lens = col[PK_LEN];
+
+		for (unsigned i : hits)
+			offs[i] += b.offbase;
+
+		// the lines, a run of adjoining ones per read
+		for (size_t h = 0; h < hits.size();) {
+			unsigned long long start = offs[hits[h]], end = start + lens[hits[h]];
+			size_t k = h + 1;
+
+			while (k < hits.size() && offs[hits[k]] == end && end - start < LOGIDX_COPYBUF)
+				end += lens[hits[k++]];
+			if (end > (unsigned long long)lst.st_size) {
+				fprintf(stderr, "%s: shorter than its printk index\n", log);
+				return 1;
+			}
+			buf.resize(end - start);
+			if (!pread_all(lfd, buf.data(), buf.size(), start) || fwrite(buf.data(), 1, buf.size(), stdout) != buf.size()) {
+				perror(log);
+				return 1;
+			}
+			nlines += k - h;
+			h = k;
+		}
+		at = next;
+	}
+	fflush(stdout);
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	fprintf(stderr, "%s: %llu lines; %llu of %llu blocks skipped, %.2f MB of %.2f MB of columns read, %.3f s\n",
+	    log, nlines, nskipped, nblocks, colbytes / 1e6, st.st_size / 1e6, secs);
+	close(fd);
+	close(lfd);
+	return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+	std::vector<std::string> banners;
+	std::string idxname, pkname;
+	unsigned nthreads = std::thread::hardware_concurrency();
+	long long boot = -1;
+	bool qflag = false;
+	pkquery q = { -1, false, false, 0, 0, 0, 0 };
+	int c;
+
+	while ((c = getopt(argc, argv, "b:i:j:k:l:qt:T:x:")) != -1) {
+		switch (c) {
+		case 'b':
+			if (*optarg == 0)
+				usage(argv[0]);
+			banners.push_back(optarg);
+			break;
+		case 'i':
+			idxname = optarg;
+			break;
+		case 'k':
+			pkname = optarg;
+			break;
+		case 'l':
+			q.maxlevel = (int)strtol(optarg, NULL, 10);
+			if (q.maxlevel < 0 || q.maxlevel > 7)
+				usage(argv[0]);
+			break;
+		case 'q':
+			qflag = true;
+			break;
+		case 't':
+			if (!parse_range(optarg, &q.gfrom, &q.gto))
+				usage(argv[0]);
+			q.gts = true;
+			break;
+		case 'T':
+			if (!parse_range(optarg, &q.hfrom, &q.hto))
+				usage(argv[0]);
+			q.hts = true;
+			break;
+		case 'j':
+			nthreads = (unsigned)strtoul(optarg, NULL, 10);
+			if (nthreads == 0)
+				usage(argv[0]);
+			break;
+		case 'x':
+			boot = strtoll(optarg, NULL, 10);
+			if (boot < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || (!qflag && (q.maxlevel >= 0 || q.gts || q.hts || !pkname.empty())) ||
+	    (qflag && boot >= 0))
+		usage(argv[0]);
+	if (qflag)
+		return query(argv[optind], pkname.empty() ? std::string(argv[optind]) + ".pk" : pkname, q);
+	if (nthreads == 0)
+		nthreads = 1;
+	if (idxname.empty())
+		idxname = std::string(argv[optind]) + ".idx";
+	if (boot >= 0)
+		return extract(argv[optind], idxname, (unsigned long long)boot);
+	if (banners.empty())
+		banners.assign(std::begin(bootidx_banners), std::end(bootidx_banners));
+	return build(argv[optind], idxname, nthreads, banners);
+}